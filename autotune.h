@@ -0,0 +1,105 @@
+/*
+ * autotune.h
+ *
+ * the cost model behind the auto-tuning of a working set tree (see
+ * WorkingSetTree::set_auto_tuning). Over a window of searches the tree
+ * counts the hits in each of its trees, the misses and the inserts. A hit
+ * in tree i is taken to be at the middle of that tree's recency ranks. The
+ * cost of an access is then estimated for any policy from the trees it
+ * would have to search (log2 of the keys of each, up to the one holding the
+ * key) and the shifts moving the key forward from there. An insert shifts
+ * one key through every tree. The tree retunes to the candidate scale
+ * factor and base height with the lowest estimated cost, when it saves at
+ * least min_gain of the cost of the current ones. The base height only
+ * matters under height boundaries.
+ *
+ * Under height boundaries the trees are taken to hold the keys their height
+ * allows at INSERTION_FILL, the node fill b-trees built by insertion reach
+ * and the one trees built in bulk are loaded to (see load_keys in
+ * wstpolicy.h).
+*/
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <algorithm> // for std::min, std::max
+#include <cmath> // for std::log2
+#include <vector>
+#include "wstpolicy.h"
+
+const double TUNING_SHIFT_WEIGHT = 2.0; // tree operations of a shift, relative to a search of the same tree
+
+struct TuningOptions {
+    int window; // searches between evaluations
+    double min_gain; // fraction of the estimated cost a retune must save
+    int step_interval; // operations between two steps of a migration
+    std::vector<int> scale_factors; // candidates
+    std::vector<int> base_heights; // candidates
+
+    TuningOptions() : window(100000), min_gain(0.1), step_interval(1000), scale_factors({2, 3, 4, 8}),
+                      base_heights({1, 2, 3}) {}
+};
+
+// the keys the tree at index level is expected to hold under pol
+template <class Policy>
+double estimated_level_keys(const Policy &pol, int level) {
+    return (double)pol.load_keys(level);
+}
+
+// estimated cost of accessing the key of recency rank rank in a working set
+//  tree of total_keys keys laid out by pol. a rank of total_keys or more is
+//  a miss, which searches every tree
+template <class Policy>
+double estimated_access_cost(const Policy &pol, double rank, double total_keys) {
+    double before = 0.0;
+    double cost = 0.0;
+    for (int level = 0;; ++level) {
+        double keys = std::min(estimated_level_keys(pol, level), std::max(total_keys - before, 0.0));
+        double search = std::log2(keys + 1.0);
+        cost += search;
+        before += keys;
+        if (rank < before) {
+            return cost + TUNING_SHIFT_WEIGHT * search;
+        }
+        if (before >= total_keys) {
+            return cost;
+        }
+    }
+}
+
+// estimated cost of an insert, shifting one key from every tree to the next
+template <class Policy>
+double estimated_insert_cost(const Policy &pol, double total_keys) {
+    double before = 0.0;
+    double cost = 0.0;
+    for (int level = 0; before < total_keys; ++level) {
+        double keys = std::min(estimated_level_keys(pol, level), total_keys - before);
+        cost += TUNING_SHIFT_WEIGHT * std::log2(keys + 1.0);
+        before += keys;
+    }
+    return cost;
+}
+
+// estimated cost of the sampled window under pol. hits[i] searches found
+//  their key in the tree holding sizes[i] keys
+template <class Policy>
+double estimated_window_cost(const Policy &pol, const std::vector<int> &sizes, const std::vector<long long> &hits,
+                             long long misses, long long inserts) {
+    double total_keys = 0.0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        total_keys += sizes[i];
+    }
+    double cost = 0.0;
+    double before = 0.0;
+    for (size_t i = 0; i < sizes.size() && i < hits.size(); ++i) {
+        if (hits[i] > 0) {
+            cost += hits[i] * estimated_access_cost(pol, before + sizes[i] / 2.0, total_keys);
+        }
+        before += sizes[i];
+    }
+    cost += misses * estimated_access_cost(pol, total_keys, total_keys);
+    cost += inserts * estimated_insert_cost(pol, total_keys);
+    return cost;
+}
+
+#endif // AUTOTUNE_H
@@ -0,0 +1,288 @@
+/*
+ * baselines.h
+ *
+ * reference structures a working set tree is measured against, with the
+ * interface the comparison drivers in main.cpp use:
+ *
+ *   bool insert(T)     false if the key was already present
+ *   bool search(T)     counts as an access to the key
+ *   bool remove(T)
+ *   int size()
+ *   MemoryStats memory_stats()
+ *   long long node_visits()   nodes read so far, or -1 if not observable
+ *
+ * SplayTree is the self-adjusting tree the working set bound was first proven
+ * for: every access rotates the key to the root (top-down splaying).
+ * SetBaseline is std::set, a red-black tree that ignores recency.
+ * LruBaseline keeps keys in a hash map and a list in recency order, as a
+ * cache does: O(1) accesses, no ordered operations.
+ *
+ * The memory of std::set and of the LRU is estimated from the node layouts
+ * of common standard libraries, as the containers do not report it.
+*/
+
+#ifndef BASELINES_H
+#define BASELINES_H
+
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "memorystats.h"
+
+template <class T>
+class SplayTree {
+public:
+    SplayTree() : root(nullptr), size_(0), visits(0) {}
+    ~SplayTree();
+    bool insert(T val);
+    bool search(T val);
+    bool remove(T val);
+    int size() {
+        return size_;
+    }
+    MemoryStats memory_stats();
+    long long node_visits() {
+        return visits;
+    }
+private:
+    struct SplayNode {
+        T key;
+        SplayNode *left;
+        SplayNode *right;
+        SplayNode() : key(), left(nullptr), right(nullptr) {}
+        explicit SplayNode(T k) : key(k), left(nullptr), right(nullptr) {}
+    };
+    SplayNode *root;
+    int size_;
+    long long visits;
+    SplayNode* splay(SplayNode *node, T val);
+};
+
+template <class T>
+SplayTree<T>::~SplayTree() {
+    // iteratively, as the tree can be as deep as it is large
+    std::vector<SplayNode*> stack;
+    if (root != nullptr) {
+        stack.push_back(root);
+    }
+    while (!stack.empty()) {
+        SplayNode *node = stack.back();
+        stack.pop_back();
+        if (node->left != nullptr) {
+            stack.push_back(node->left);
+        }
+        if (node->right != nullptr) {
+            stack.push_back(node->right);
+        }
+        delete node;
+    }
+}
+
+// top-down splay: the node holding val, or the last node on its search path,
+//  becomes the root of the subtree at node
+template <class T>
+typename SplayTree<T>::SplayNode* SplayTree<T>::splay(SplayNode *node, T val) {
+    if (node == nullptr) {
+        return node;
+    }
+    SplayNode header;
+    SplayNode *left_max = &header; // largest node of the tree of smaller keys
+    SplayNode *right_min = &header; // smallest node of the tree of larger keys
+    while (true) {
+        visits++;
+        if (val < node->key) {
+            if (node->left == nullptr) {
+                break;
+            }
+            if (val < node->left->key) { // zig-zig: rotate right
+                SplayNode *child = node->left;
+                node->left = child->right;
+                child->right = node;
+                node = child;
+                visits++;
+                if (node->left == nullptr) {
+                    break;
+                }
+            }
+            right_min->left = node;
+            right_min = node;
+            node = node->left;
+        }
+        else if (node->key < val) {
+            if (node->right == nullptr) {
+                break;
+            }
+            if (node->right->key < val) { // zig-zig: rotate left
+                SplayNode *child = node->right;
+                node->right = child->left;
+                child->left = node;
+                node = child;
+                visits++;
+                if (node->right == nullptr) {
+                    break;
+                }
+            }
+            left_max->right = node;
+            left_max = node;
+            node = node->right;
+        }
+        else {
+            break;
+        }
+    }
+    left_max->right = node->left;
+    right_min->left = node->right;
+    node->left = header.right;
+    node->right = header.left;
+    return node;
+}
+
+template <class T>
+bool SplayTree<T>::insert(T val) {
+    root = splay(root, val);
+    if (root != nullptr && !(root->key < val) && !(val < root->key)) {
+        return false;
+    }
+    SplayNode *node = new SplayNode(val);
+    if (root != nullptr) {
+        if (val < root->key) {
+            node->left = root->left;
+            node->right = root;
+            root->left = nullptr;
+        }
+        else {
+            node->right = root->right;
+            node->left = root;
+            root->right = nullptr;
+        }
+    }
+    root = node;
+    size_++;
+    return true;
+}
+
+template <class T>
+bool SplayTree<T>::search(T val) {
+    root = splay(root, val);
+    return root != nullptr && !(root->key < val) && !(val < root->key);
+}
+
+template <class T>
+bool SplayTree<T>::remove(T val) {
+    if (!search(val)) {
+        return false;
+    }
+    SplayNode *old_root = root;
+    if (root->left == nullptr) {
+        root = root->right;
+    }
+    else {
+        // val is larger than every key on the left, so splaying it there
+        //  brings the largest to a root with no right child
+        root = splay(root->left, val);
+        root->right = old_root->right;
+    }
+    delete old_root;
+    size_--;
+    return true;
+}
+
+template <class T>
+MemoryStats SplayTree<T>::memory_stats() {
+    MemoryStats stats;
+    stats.live_keys = size_;
+    stats.live_nodes = size_;
+    stats.key_slots = size_;
+    stats.allocator_overhead = size_ * ALLOCATION_OVERHEAD;
+    stats.bytes = sizeof(SplayTree<T>) + size_ * sizeof(SplayNode) + stats.allocator_overhead;
+    return stats;
+}
+
+template <class T>
+class SetBaseline {
+public:
+    bool insert(T val) {
+        return keys.insert(val).second;
+    }
+    bool search(T val) {
+        return keys.find(val) != keys.end();
+    }
+    bool remove(T val) {
+        return keys.erase(val) > 0;
+    }
+    int size() {
+        return keys.size();
+    }
+    // a red-black node holds a color and three links besides the key
+    MemoryStats memory_stats() {
+        MemoryStats stats;
+        stats.live_keys = keys.size();
+        stats.live_nodes = keys.size();
+        stats.key_slots = keys.size();
+        stats.allocator_overhead = keys.size() * ALLOCATION_OVERHEAD;
+        stats.bytes = sizeof(SetBaseline<T>) + keys.size() * (4 * sizeof(void*) + sizeof(T)) + stats.allocator_overhead;
+        return stats;
+    }
+    long long node_visits() {
+        return -1;
+    }
+private:
+    std::set<T> keys;
+};
+
+template <class T>
+class LruBaseline {
+public:
+    bool insert(T val) {
+        if (positions.find(val) != positions.end()) {
+            return false;
+        }
+        recency.push_front(val);
+        positions[val] = recency.begin();
+        return true;
+    }
+    // move the key to the front of the list
+    bool search(T val) {
+        typename std::unordered_map<T, typename std::list<T>::iterator>::iterator it = positions.find(val);
+        if (it == positions.end()) {
+            return false;
+        }
+        recency.splice(recency.begin(), recency, it->second);
+        return true;
+    }
+    bool remove(T val) {
+        typename std::unordered_map<T, typename std::list<T>::iterator>::iterator it = positions.find(val);
+        if (it == positions.end()) {
+            return false;
+        }
+        recency.erase(it->second);
+        positions.erase(it);
+        return true;
+    }
+    int size() {
+        return positions.size();
+    }
+    // a list node holds two links and the key, a hash node a link, the key,
+    //  the list position and the cached hash, plus one pointer per bucket
+    MemoryStats memory_stats() {
+        long long n = positions.size();
+        MemoryStats stats;
+        stats.live_keys = n;
+        stats.live_nodes = 2 * n;
+        stats.key_slots = n;
+        stats.allocator_overhead = (2 * n + 1) * ALLOCATION_OVERHEAD;
+        stats.bytes = sizeof(LruBaseline<T>) + n * (2 * sizeof(void*) + sizeof(T))
+                + n * (3 * sizeof(void*) + sizeof(T)) + positions.bucket_count() * sizeof(void*)
+                + stats.allocator_overhead;
+        return stats;
+    }
+    long long node_visits() {
+        return -1;
+    }
+private:
+    std::list<T> recency; // most recently accessed first
+    std::unordered_map<T, typename std::list<T>::iterator> positions;
+};
+
+#endif // BASELINES_H
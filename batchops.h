@@ -0,0 +1,71 @@
+/*
+ * batchops.h
+ *
+ * removal of many keys at once from any container providing remove,
+ * size, keys_by_recency, bulk_load and append_range (see level.h). the keys
+ * are removed in ascending order, so that consecutive removals descend
+ * through the same nodes while they are still cached. a batch that takes
+ * most of the container instead walks the recency list once and rebuilds
+ * the container from the keys that are left, keeping their recency order.
+ * the rebuild sorts and relinks every key left, so it only pays off once
+ * few keys are left. it fills nodes to the fill the caller passes, which a
+ * working set tree takes from its policy (see load_fill in wstpolicy.h).
+*/
+
+#ifndef BATCHOPS_H
+#define BATCHOPS_H
+
+#include <algorithm> // for std::sort, std::unique, std::binary_search
+#include <vector>
+
+// a batch leaving at most 1/BATCH_REMOVE_REBUILD_RATIO of the keys it
+//  removes makes the container be rebuilt
+const int BATCH_REMOVE_REBUILD_RATIO = 4;
+
+// remove the n sorted distinct keys from tree, returning how many it held.
+//  keys the tree does not hold count as removed when choosing to rebuild
+template <class T, class Container>
+int remove_sorted_keys(Container &tree, const T *keys, int n, double fill) {
+    if ((long long)(tree.size() - n) * BATCH_REMOVE_REBUILD_RATIO > n) {
+        int removed = 0;
+        for (int i = 0; i < n; ++i) {
+            if (tree.remove(keys[i])) {
+                removed++;
+            }
+        }
+        return removed;
+    }
+
+    std::vector<T> kept = tree.keys_by_recency();
+    size_t num_kept = 0;
+    for (size_t i = 0; i < kept.size(); ++i) {
+        if (!std::binary_search(keys, keys + n, kept[i])) {
+            kept[num_kept++] = kept[i];
+        }
+    }
+    int removed = kept.size() - num_kept;
+    if (removed > 0) {
+        tree.bulk_load(kept.data(), num_kept, fill);
+    }
+    return removed;
+}
+
+// remove every key in [lo, hi], returning how many were removed
+template <class T, class Container>
+int remove_range_of(Container &tree, T lo, T hi, double fill = 1.0) {
+    std::vector<T> keys;
+    tree.append_range(lo, hi, keys);
+    return remove_sorted_keys(tree, keys.data(), keys.size(), fill);
+}
+
+// remove the n keys, in any order and possibly repeated, returning how many
+//  the tree held
+template <class T, class Container>
+int remove_batch_of(Container &tree, const T *keys, int n, double fill = 1.0) {
+    std::vector<T> sorted(keys, keys + n);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    return remove_sorted_keys(tree, sorted.data(), sorted.size(), fill);
+}
+
+#endif // BATCHOPS_H
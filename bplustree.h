@@ -0,0 +1,699 @@
+/*
+ * bplustree.h
+ *
+ * template class for a b+-tree: every key lives in a leaf, internal nodes
+ * only hold separators to route searches, and the leaves are linked to their
+ * siblings. Deleting a key always removes it from a leaf, with no successor
+ * to find and delete further down, and ordered scans walk the leaves one
+ * after the other instead of climbing up and down the tree.
+ *
+ * Leaf keys are Elements on the same recency list BTree keeps, so the tree
+ * offers the container operations listed in level.h. Keys are expected to be
+ * distinct, as they are in a working set tree.
+*/
+
+#ifndef BPLUSTREE_H
+#define BPLUSTREE_H
+
+#include <algorithm> // for std::sort, std::upper_bound
+#include <string>
+#include <utility> // for std::pair
+#include <vector>
+#include "btree.h" // for DEFAULT_MAX_HEIGHT and the fill constants
+#include "element.h"
+#include "memorystats.h"
+
+template <class T>
+struct BPlusNode {
+    int num_keys; // elements in a leaf, separators in an internal node
+    bool is_leaf;
+    std::vector<Element<T> > elements; // leaves only
+    std::vector<T> separators; // internal only. children[i + 1] holds the keys not below separators[i]
+    std::vector<BPlusNode<T>*> children; // internal only
+    BPlusNode<T> *prev_leaf;
+    BPlusNode<T> *next_leaf;
+
+    BPlusNode(int min_degree, bool leaf) : num_keys(0), is_leaf(leaf), prev_leaf(nullptr), next_leaf(nullptr) {
+        if (leaf) {
+            elements.resize(min_degree * 2 - 1);
+        }
+        else {
+            separators.resize(min_degree * 2 - 1);
+            children.resize(min_degree * 2);
+        }
+    }
+};
+
+template <class T>
+class BPlusTree {
+public:
+    BPlusTree(int min_deg = DEFAULT_MIN_DEGREE, int max_hght = DEFAULT_MAX_HEIGHT);
+    ~BPlusTree();
+    bool contains(T val);
+    int insert(T val);
+    void insert_lru(T val);
+    bool remove(T val);
+    T remove_lru();
+    T remove_mru();
+    int get_height();
+    int get_max_height();
+    bool is_empty();
+    int size();
+    std::string to_string();
+    std::string print_ordered_mru();
+    std::string print_ordered_tail();
+    std::vector<T> keys_by_recency();
+    void bulk_load(const T *keys, int n, double fill = 1.0);
+    int recency_position(T val);
+    bool append_by_recency(const T *after, int count, std::vector<T> &out);
+    void append_range(T lo, T hi, std::vector<T> &out); // walks the linked leaves
+    MemoryStats memory_stats();
+    bool needs_compaction(double min_fill = DEFAULT_MIN_FILL);
+    void compact(double target_fill = DEFAULT_TARGET_FILL);
+    long long node_visits(); // nodes visited by searches, inserts and removes
+private:
+    int min_degree;
+    int height;
+    int max_height;
+    int size_;
+    int num_leaves;
+    int num_internal;
+    long long visits;
+    BPlusNode<T> *root;
+    Element<T> *head; // sentinel of the recency list: head->next is the most recent key
+
+    BPlusNode<T>* new_node(bool leaf);
+    void delete_node(BPlusNode<T> *node);
+    void destroy_tree(BPlusNode<T> *node);
+    void move_element(Element<T> &from, Element<T> &to);
+    BPlusNode<T>* find_leaf(T val);
+    int child_index(BPlusNode<T> *node, T val);
+    void split_child(BPlusNode<T> *node, int index);
+    int fill_child(BPlusNode<T> *node, int index);
+    void steal_from_left_neighbor(BPlusNode<T> *node, int index);
+    void steal_from_right_neighbor(BPlusNode<T> *node, int index);
+    void merge_children(BPlusNode<T> *node, int index);
+    void rebuild(const T *mru_keys, int n, double fill);
+};
+
+template <class T>
+BPlusTree<T>::BPlusTree(int min_deg, int max_hght)
+    : min_degree(min_deg), height(1), max_height(max_hght), size_(0), num_leaves(0), num_internal(0), visits(0) {
+    head = new Element<T>();
+    head->prev = head;
+    head->next = head;
+    root = new_node(true);
+}
+
+template <class T>
+BPlusTree<T>::~BPlusTree() {
+    destroy_tree(root);
+    delete head;
+}
+
+template <class T>
+BPlusNode<T>* BPlusTree<T>::new_node(bool leaf) {
+    if (leaf) {
+        num_leaves++;
+    }
+    else {
+        num_internal++;
+    }
+    return new BPlusNode<T>(min_degree, leaf);
+}
+
+template <class T>
+void BPlusTree<T>::delete_node(BPlusNode<T> *node) {
+    if (node->is_leaf) {
+        num_leaves--;
+    }
+    else {
+        num_internal--;
+    }
+    delete node;
+}
+
+template <class T>
+void BPlusTree<T>::destroy_tree(BPlusNode<T> *node) {
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; ++i) {
+            destroy_tree(node->children[i]);
+        }
+    }
+    delete_node(node);
+}
+
+// move an element to another slot, pointing its neighbours in the recency
+//  list at the new slot
+template <class T>
+void BPlusTree<T>::move_element(Element<T> &from, Element<T> &to) {
+    to = from;
+    to.prev->next = &to;
+    to.next->prev = &to;
+}
+
+template <class T>
+int BPlusTree<T>::child_index(BPlusNode<T> *node, T val) {
+    visits++;
+    return std::upper_bound(node->separators.begin(), node->separators.begin() + node->num_keys, val)
+            - node->separators.begin();
+}
+
+template <class T>
+BPlusNode<T>* BPlusTree<T>::find_leaf(T val) {
+    BPlusNode<T> *node = root;
+    while (!node->is_leaf) {
+        node = node->children[child_index(node, val)];
+    }
+    visits++;
+    return node;
+}
+
+// position of val in a leaf, or -1
+template <class T>
+static int leaf_position(BPlusNode<T> *leaf, T val) {
+    int lo = 0;
+    int hi = leaf->num_keys;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (leaf->elements[mid].key < val) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo < leaf->num_keys && leaf->elements[lo].key == val ? lo : -1;
+}
+
+template <class T>
+bool BPlusTree<T>::contains(T val) {
+    return leaf_position(find_leaf(val), val) >= 0;
+}
+
+// split the full child at index. a leaf keeps its first min_degree keys and
+//  the first key of the new leaf is copied up as the separator; an internal
+//  node moves its middle separator up, as in a b-tree
+template <class T>
+void BPlusTree<T>::split_child(BPlusNode<T> *node, int index) {
+    BPlusNode<T> *child = node->children[index];
+    BPlusNode<T> *sibling = new_node(child->is_leaf);
+    T separator;
+
+    if (child->is_leaf) {
+        int keep = min_degree;
+        for (int j = keep; j < child->num_keys; ++j) {
+            move_element(child->elements[j], sibling->elements[j - keep]);
+        }
+        sibling->num_keys = child->num_keys - keep;
+        child->num_keys = keep;
+        separator = sibling->elements[0].key;
+
+        sibling->next_leaf = child->next_leaf;
+        if (sibling->next_leaf != nullptr) {
+            sibling->next_leaf->prev_leaf = sibling;
+        }
+        sibling->prev_leaf = child;
+        child->next_leaf = sibling;
+    }
+    else {
+        int keep = min_degree - 1;
+        separator = child->separators[keep];
+        for (int j = keep + 1; j < child->num_keys; ++j) {
+            sibling->separators[j - keep - 1] = child->separators[j];
+        }
+        for (int j = keep + 1; j <= child->num_keys; ++j) {
+            sibling->children[j - keep - 1] = child->children[j];
+        }
+        sibling->num_keys = child->num_keys - keep - 1;
+        child->num_keys = keep;
+    }
+
+    for (int j = node->num_keys; j > index; --j) {
+        node->separators[j] = node->separators[j - 1];
+        node->children[j + 1] = node->children[j];
+    }
+    node->separators[index] = separator;
+    node->children[index + 1] = sibling;
+    node->num_keys++;
+}
+
+// insert val as the most recently accessed key. full nodes are split on the
+//  way down, so the leaf always has room. returns the levels traversed
+template <class T>
+int BPlusTree<T>::insert(T val) {
+    if (root->num_keys == min_degree * 2 - 1) {
+        BPlusNode<T> *new_root = new_node(false);
+        new_root->children[0] = root;
+        root = new_root;
+        split_child(root, 0);
+        height++;
+    }
+
+    BPlusNode<T> *node = root;
+    int levels = 1;
+    while (!node->is_leaf) {
+        int i = child_index(node, val);
+        if (node->children[i]->num_keys == min_degree * 2 - 1) {
+            split_child(node, i);
+            if (!(val < node->separators[i])) {
+                i++;
+            }
+        }
+        node = node->children[i];
+        levels++;
+    }
+    visits++;
+
+    int pos = node->num_keys;
+    while (pos > 0 && val < node->elements[pos - 1].key) {
+        move_element(node->elements[pos - 1], node->elements[pos]);
+        pos--;
+    }
+    node->elements[pos] = Element<T>(val, head, head->next);
+    head->next->prev = &node->elements[pos];
+    head->next = &node->elements[pos];
+    node->num_keys++;
+    size_++;
+    return levels;
+}
+
+// insert val as the least recently accessed key
+template <class T>
+void BPlusTree<T>::insert_lru(T val) {
+    insert(val);
+    Element<T> *e = head->next;
+    // move the new element from the front of the recency list to the back
+    head->next = e->next;
+    e->next->prev = head;
+    e->prev = head->prev;
+    e->next = head;
+    head->prev->next = e;
+    head->prev = e;
+}
+
+// give the child at index a key more than the minimum before the descent
+//  enters it, returning the index of the child to descend into
+template <class T>
+int BPlusTree<T>::fill_child(BPlusNode<T> *node, int index) {
+    if (index > 0 && node->children[index - 1]->num_keys >= min_degree) {
+        steal_from_left_neighbor(node, index);
+        return index;
+    }
+    if (index < node->num_keys && node->children[index + 1]->num_keys >= min_degree) {
+        steal_from_right_neighbor(node, index);
+        return index;
+    }
+    if (index < node->num_keys) {
+        merge_children(node, index);
+        return index;
+    }
+    merge_children(node, index - 1);
+    return index - 1;
+}
+
+template <class T>
+void BPlusTree<T>::steal_from_left_neighbor(BPlusNode<T> *node, int index) {
+    BPlusNode<T> *child = node->children[index];
+    BPlusNode<T> *left = node->children[index - 1];
+
+    if (child->is_leaf) {
+        for (int j = child->num_keys; j > 0; --j) {
+            move_element(child->elements[j - 1], child->elements[j]);
+        }
+        move_element(left->elements[left->num_keys - 1], child->elements[0]);
+        node->separators[index - 1] = child->elements[0].key;
+    }
+    else {
+        for (int j = child->num_keys; j > 0; --j) {
+            child->separators[j] = child->separators[j - 1];
+        }
+        for (int j = child->num_keys + 1; j > 0; --j) {
+            child->children[j] = child->children[j - 1];
+        }
+        child->separators[0] = node->separators[index - 1];
+        child->children[0] = left->children[left->num_keys];
+        node->separators[index - 1] = left->separators[left->num_keys - 1];
+    }
+    left->num_keys--;
+    child->num_keys++;
+}
+
+template <class T>
+void BPlusTree<T>::steal_from_right_neighbor(BPlusNode<T> *node, int index) {
+    BPlusNode<T> *child = node->children[index];
+    BPlusNode<T> *right = node->children[index + 1];
+
+    if (child->is_leaf) {
+        move_element(right->elements[0], child->elements[child->num_keys]);
+        for (int j = 1; j < right->num_keys; ++j) {
+            move_element(right->elements[j], right->elements[j - 1]);
+        }
+        node->separators[index] = right->elements[0].key;
+    }
+    else {
+        child->separators[child->num_keys] = node->separators[index];
+        child->children[child->num_keys + 1] = right->children[0];
+        node->separators[index] = right->separators[0];
+        for (int j = 1; j < right->num_keys; ++j) {
+            right->separators[j - 1] = right->separators[j];
+        }
+        for (int j = 1; j <= right->num_keys; ++j) {
+            right->children[j - 1] = right->children[j];
+        }
+    }
+    right->num_keys--;
+    child->num_keys++;
+}
+
+// merge the child at index + 1 into the child at index. leaves simply
+//  concatenate; internal nodes take the separator between them as well
+template <class T>
+void BPlusTree<T>::merge_children(BPlusNode<T> *node, int index) {
+    BPlusNode<T> *left = node->children[index];
+    BPlusNode<T> *right = node->children[index + 1];
+
+    if (left->is_leaf) {
+        for (int j = 0; j < right->num_keys; ++j) {
+            move_element(right->elements[j], left->elements[left->num_keys + j]);
+        }
+        left->num_keys += right->num_keys;
+        left->next_leaf = right->next_leaf;
+        if (left->next_leaf != nullptr) {
+            left->next_leaf->prev_leaf = left;
+        }
+    }
+    else {
+        left->separators[left->num_keys] = node->separators[index];
+        for (int j = 0; j < right->num_keys; ++j) {
+            left->separators[left->num_keys + 1 + j] = right->separators[j];
+        }
+        for (int j = 0; j <= right->num_keys; ++j) {
+            left->children[left->num_keys + 1 + j] = right->children[j];
+        }
+        left->num_keys += right->num_keys + 1;
+    }
+    delete_node(right);
+
+    for (int j = index; j < node->num_keys - 1; ++j) {
+        node->separators[j] = node->separators[j + 1];
+        node->children[j + 1] = node->children[j + 2];
+    }
+    node->num_keys--;
+}
+
+// remove val from its leaf. every node on the way down is given a key more
+//  than the minimum first, so the removal never needs a second pass
+template <class T>
+bool BPlusTree<T>::remove(T val) {
+    BPlusNode<T> *node = root;
+    while (!node->is_leaf) {
+        int i = child_index(node, val);
+        if (node->children[i]->num_keys < min_degree) {
+            i = fill_child(node, i);
+        }
+        if (node == root && node->num_keys == 0) {
+            // the root's last two children were merged: the merged child becomes the root
+            root = node->children[0];
+            delete_node(node);
+            height--;
+            node = root;
+            continue;
+        }
+        node = node->children[i];
+    }
+    visits++;
+
+    int pos = leaf_position(node, val);
+    if (pos < 0) {
+        return false;
+    }
+    Element<T> &e = node->elements[pos];
+    e.prev->next = e.next;
+    e.next->prev = e.prev;
+    for (int j = pos + 1; j < node->num_keys; ++j) {
+        move_element(node->elements[j], node->elements[j - 1]);
+    }
+    node->num_keys--;
+    size_--;
+    return true;
+}
+
+template <class T>
+T BPlusTree<T>::remove_lru() {
+    if (size_ == 0) {
+        return T();
+    }
+    T lru = head->prev->key;
+    remove(lru);
+    return lru;
+}
+
+template <class T>
+T BPlusTree<T>::remove_mru() {
+    if (size_ == 0) {
+        return T();
+    }
+    T mru = head->next->key;
+    remove(mru);
+    return mru;
+}
+
+template <class T>
+int BPlusTree<T>::get_height() {
+    return height;
+}
+
+template <class T>
+int BPlusTree<T>::get_max_height() {
+    return max_height;
+}
+
+template <class T>
+bool BPlusTree<T>::is_empty() {
+    return size_ == 0;
+}
+
+template <class T>
+int BPlusTree<T>::size() {
+    return size_;
+}
+
+// string representation: the leaves from left to right
+template <class T>
+std::string BPlusTree<T>::to_string() {
+    BPlusNode<T> *leaf = root;
+    while (!leaf->is_leaf) {
+        leaf = leaf->children[0];
+    }
+    std::string str = "";
+    for (; leaf != nullptr; leaf = leaf->next_leaf) {
+        str += "( ";
+        for (int i = 0; i < leaf->num_keys; ++i) {
+            str += std::to_string(leaf->elements[i].key) + " ";
+        }
+        str += ") ";
+    }
+    return str;
+}
+
+template <class T>
+std::string BPlusTree<T>::print_ordered_mru() {
+    std::string str = "MRU-> ";
+    for (Element<T> *e = head->next; e != head; e = e->next) {
+        str += "#" + std::to_string(e->key) + "# ";
+    }
+    str += " <-LRU";
+    return str;
+}
+
+template <class T>
+std::string BPlusTree<T>::print_ordered_tail() {
+    std::string str = "(tail) LRU-> ";
+    for (Element<T> *e = head->prev; e != head; e = e->prev) {
+        str += "#" + std::to_string(e->key) + "# ";
+    }
+    str += " <-MRU";
+    return str;
+}
+
+template <class T>
+std::vector<T> BPlusTree<T>::keys_by_recency() {
+    std::vector<T> keys;
+    keys.reserve(size_);
+    for (Element<T> *e = head->next; e != head; e = e->next) {
+        keys.push_back(e->key);
+    }
+    return keys;
+}
+
+// replace the contents with the n keys, ordered from the most to the least
+//  recently accessed, built bottom-up with leaves filled to fill. every node
+//  but the root still gets at least the minimum number of keys
+template <class T>
+void BPlusTree<T>::rebuild(const T *mru_keys, int n, double fill) {
+    destroy_tree(root);
+    head->prev = head;
+    head->next = head;
+    size_ = n;
+    height = 1;
+
+    std::vector<std::pair<T, int> > sorted(n);
+    for (int i = 0; i < n; ++i) {
+        sorted[i] = std::make_pair(mru_keys[i], i);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    int per_leaf = std::max(min_degree, std::min(min_degree * 2 - 1, (int)(fill * (min_degree * 2 - 1) + 0.5)));
+    int leaves = std::max(1, std::min((n + per_leaf - 1) / per_leaf, n / (min_degree - 1)));
+    std::vector<BPlusNode<T>*> nodes;
+    std::vector<T> first_keys; // smallest key under each node in nodes
+    std::vector<Element<T>*> by_recency(n);
+    BPlusNode<T> *prev_leaf = nullptr;
+    int pos = 0;
+    for (int l = 0; l < leaves; ++l) {
+        BPlusNode<T> *leaf = new_node(true);
+        int count = n / leaves + (l < n % leaves ? 1 : 0);
+        for (int j = 0; j < count; ++j, ++pos) {
+            leaf->elements[j] = Element<T>(sorted[pos].first, nullptr, nullptr);
+            by_recency[sorted[pos].second] = &leaf->elements[j];
+        }
+        leaf->num_keys = count;
+        leaf->prev_leaf = prev_leaf;
+        if (prev_leaf != nullptr) {
+            prev_leaf->next_leaf = leaf;
+        }
+        prev_leaf = leaf;
+        nodes.push_back(leaf);
+        first_keys.push_back(count > 0 ? leaf->elements[0].key : T());
+    }
+
+    int per_node = std::max(min_degree, std::min(min_degree * 2, per_leaf + 1));
+    while (nodes.size() > 1) {
+        int m = nodes.size();
+        int groups = std::max(1, std::min((m + per_node - 1) / per_node, m / min_degree));
+        std::vector<BPlusNode<T>*> parents;
+        std::vector<T> parent_keys;
+        int next = 0;
+        for (int g = 0; g < groups; ++g) {
+            BPlusNode<T> *parent = new_node(false);
+            int count = m / groups + (g < m % groups ? 1 : 0);
+            for (int j = 0; j < count; ++j, ++next) {
+                parent->children[j] = nodes[next];
+                if (j > 0) {
+                    parent->separators[j - 1] = first_keys[next];
+                }
+            }
+            parent->num_keys = count - 1;
+            parents.push_back(parent);
+            parent_keys.push_back(first_keys[next - count]);
+        }
+        nodes.swap(parents);
+        first_keys.swap(parent_keys);
+        height++;
+    }
+    root = nodes[0];
+
+    Element<T> *prev = head;
+    for (int i = 0; i < n; ++i) {
+        by_recency[i]->prev = prev;
+        prev->next = by_recency[i];
+        prev = by_recency[i];
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+template <class T>
+void BPlusTree<T>::bulk_load(const T *mru_keys, int n, double fill) {
+    rebuild(mru_keys, n, fill);
+}
+
+template <class T>
+int BPlusTree<T>::recency_position(T val) {
+    BPlusNode<T> *leaf = find_leaf(val);
+    int pos = leaf_position(leaf, val);
+    if (pos < 0) {
+        return -1;
+    }
+    int position = 0;
+    for (Element<T> *e = head->next; e != &leaf->elements[pos]; e = e->next) {
+        position++;
+    }
+    return position;
+}
+
+// descends without counting node visits, so that a snapshot may copy from the
+//  tree on another thread between writes (see snapshot.h)
+template <class T>
+bool BPlusTree<T>::append_by_recency(const T *after, int count, std::vector<T> &out) {
+    Element<T> *e = head;
+    if (after != nullptr) {
+        BPlusNode<T> *node = root;
+        while (!node->is_leaf) {
+            node = node->children[std::upper_bound(node->separators.begin(), node->separators.begin() + node->num_keys,
+                                                   *after) - node->separators.begin()];
+        }
+        int pos = leaf_position(node, *after);
+        if (pos < 0) {
+            return false;
+        }
+        e = &node->elements[pos];
+    }
+    for (e = e->next; e != head && count > 0; e = e->next, count--) {
+        out.push_back(e->key);
+    }
+    return true;
+}
+
+// append the keys in [lo, hi] to out in ascending order
+template <class T>
+void BPlusTree<T>::append_range(T lo, T hi, std::vector<T> &out) {
+    BPlusNode<T> *leaf = find_leaf(lo);
+    for (; leaf != nullptr; leaf = leaf->next_leaf) {
+        for (int i = 0; i < leaf->num_keys; ++i) {
+            T key = leaf->elements[i].key;
+            if (hi < key) {
+                return;
+            }
+            if (!(key < lo)) {
+                out.push_back(key);
+            }
+        }
+    }
+}
+
+// leaves count as nodes holding keys. internal nodes hold no keys, so only
+//  their memory is counted
+template <class T>
+MemoryStats BPlusTree<T>::memory_stats() {
+    MemoryStats stats;
+    stats.live_keys = size_;
+    stats.live_nodes = num_leaves + num_internal;
+    stats.key_slots = (long long)num_leaves * (min_degree * 2 - 1);
+    long long leaf_bytes = sizeof(BPlusNode<T>) + (min_degree * 2 - 1) * sizeof(Element<T>);
+    long long internal_bytes = sizeof(BPlusNode<T>) + (min_degree * 2 - 1) * sizeof(T)
+            + min_degree * 2 * sizeof(BPlusNode<T>*);
+    stats.allocator_overhead = ((long long)num_leaves * 2 + (long long)num_internal * 3 + 1) * ALLOCATION_OVERHEAD;
+    stats.bytes = sizeof(BPlusTree<T>) + sizeof(Element<T>) + num_leaves * leaf_bytes
+            + num_internal * internal_bytes + stats.allocator_overhead;
+    return stats;
+}
+
+template <class T>
+bool BPlusTree<T>::needs_compaction(double min_fill) {
+    return memory_stats().fill_factor() < min_fill;
+}
+
+template <class T>
+void BPlusTree<T>::compact(double target_fill) {
+    std::vector<T> keys = keys_by_recency();
+    rebuild(keys.data(), keys.size(), target_fill);
+}
+
+template <class T>
+long long BPlusTree<T>::node_visits() {
+    return visits;
+}
+
+#endif // BPLUSTREE_H
@@ -2,31 +2,47 @@
 #define BTREE_H
 
 #include <iostream>
+#include <algorithm> // for std::sort
 #include <climits> // for INT_MAX
 #include <queue>
 #include <string>
 #include <utility>   // for std::pair
 #include "node.h"
+#include "batchops.h"
+#include "btreeiterator.h"
+#include "frozentree.h"
+#include "memorystats.h"
+#include "snapshot.h"
+#include "trace.h"
 
-const int DEFAULT_MIN_DEGREE = 2;
 const int DEFAULT_MAX_HEIGHT = 10;
 const int MAX_NUM_FREE_NODES = 350000;
+const double DEFAULT_MIN_FILL = 0.5; // fill factor below which compaction is due
+const double DEFAULT_TARGET_FILL = 0.75; // fill factor compaction packs nodes to
 bool DEBUG = false;
 
 template <class T>
 class BTree {
 public:
-    BTree() : min_degree(DEFAULT_MIN_DEGREE), height(1), max_height(DEFAULT_MAX_HEIGHT) {
+    typedef BTreeIterator<T> iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    BTree() : min_degree(DEFAULT_MIN_DEGREE), height(1), max_height(DEFAULT_MAX_HEIGHT), order_statistics(false), visits(0) {
         create_tree();
     }
-    BTree(int min_deg, int max_hght = DEFAULT_MAX_HEIGHT) : min_degree(min_deg), height(1), max_height(max_hght) {
+    BTree(int min_deg, int max_hght = DEFAULT_MAX_HEIGHT, bool order_stats = false)
+        : min_degree(min_deg), height(1), max_height(max_hght), order_statistics(order_stats), visits(0) {
         create_tree();
     }
     ~BTree();
     std::pair<Node<T>*, int> search(T val);
+    bool contains(T val);
     int insert(T val);
     void insert_lru(T val);
     bool remove(T val); // returns whether val was found in the tree
+    // remove many keys at once, returning how many were found. see batchops.h
+    int remove_range(T lo, T hi); // every key in [lo, hi], cut out in place
+    int remove_batch(const T *keys, int n, double fill = 1.0); // fill for a rebuild, as in bulk_load
     T remove_lru(); // remove the element at the back of the linked list (least recently accessed element)
     T remove_mru(); // remove element at the beginning of the linked list (most recently accessed element)
     int get_height();
@@ -36,14 +52,44 @@ public:
     std::string to_string();
     std::string print_ordered_mru();
     std::string print_ordered_tail();
+    std::vector<T> keys_by_recency(); // keys from the most to the least recently accessed
+    // replace the contents with keys, given from MRU to LRU, filling nodes to about fill
+    void bulk_load(const T *keys, int n, double fill = 1.0);
+    // ordered traversal. none of these modify the recency linked list
+    iterator begin();
+    iterator end();
+    reverse_iterator rbegin();
+    reverse_iterator rend();
+    iterator lower_bound(T val); // first key not less than val
+    iterator upper_bound(T val); // first key greater than val
+    void append_range(T lo, T hi, std::vector<T> &out); // keys in [lo, hi] in ascending order
+    // order statistics. O(log n) when the tree maintains subtree key counts,
+    //  otherwise answered by an O(n) traversal
+    iterator select(int k); // the k-th smallest key (from 0), or end()
+    int rank(T val); // number of keys less than val
+    int recency_position(T val); // number of keys accessed more recently than val, or -1
+    // up to count keys accessed less recently than *after, or the most recent
+    //  ones if after is null. false if *after is not in the tree
+    bool append_by_recency(const T *after, int count, std::vector<T> &out);
+    MemoryStats memory_stats();
+    bool needs_compaction(double min_fill = DEFAULT_MIN_FILL);
+    void compact(double target_fill = DEFAULT_TARGET_FILL);
+    int trim_pool(int keep); // delete pooled nodes beyond keep, returning how many
+    Snapshot<T> snapshot(); // O(1) point-in-time view, see snapshot.h
+    FrozenTree<T> freeze(); // read-only copy of the keys for fast lookups, see frozentree.h
+    long long node_visits(); // nodes visited by searches, inserts and removes
 private:
     Node<T> *root;
     int min_degree; // each node contains (m-1) to (2*m-1) keys
     int height;
     int max_height;
     int size_;
+    int allocated_nodes; // nodes allocated and not yet deleted, live or pooled
+    bool order_statistics; // whether nodes maintain subtree_keys
+    long long visits;
     Element<T> *head;
     std::vector<Node<T> *> free_nodes;
+    SnapshotRegistry<T> snapshots;
     void create_tree();
     void destroy_tree(Node<T> *node);
     std::pair<Node<T>*, int> search_node(Node<T> *node, T val, bool delete_element, bool modify_linked_list, Element<T> *new_pos);
@@ -54,11 +100,26 @@ private:
     void steal_from_right_neighbor(Node<T> *node, int index);
     Element<T>* find_min_key(Node<T> *node); // implemented recursively. can be implemented iteratively
     void fix_up(Node<T> *node);
+    void add_to_path(Node<T> *node, int delta);
+    Node<T>* allocate_node();
+    void release_subtree(Node<T> *node);
+    int remove_keys(Node<T> *node, int from, int to);
+    int remove_children(Node<T> *node, int from, int to);
+    int cut_range(Node<T> *node, T lo, T hi, bool &kept, T &separator);
+    int cut_from(Node<T> *node, T lo);
+    int cut_until(Node<T> *node, T hi);
+    void refill_path(T val, bool past_equal);
+    void fix_path(T val, bool past_equal);
+    iterator bound(T val, bool include_equal);
+    Node<T>* build_subtree(std::pair<T, int> *items, int n, int h, bool is_root, int keys_per_node,
+                           std::vector<Element<T>*> &by_recency);
 };
 
 template <class T>
 void BTree<T>::create_tree() {
+    size_ = 0;
     root = new Node<T>(min_degree);
+    allocated_nodes = 1;
     head = new Element<T>(); // sentinel
     head->next = head;
     head->prev = head;
@@ -70,16 +131,19 @@ void BTree<T>::create_tree() {
         num_free_nodes = num_free_nodes + curr_lvl_nodes;
         if (num_free_nodes > MAX_NUM_FREE_NODES) {
             num_free_nodes = MAX_NUM_FREE_NODES;
+            break; // stop before curr_lvl_nodes overflows for tall trees
         }
     }
 
     for (int j = 0; j<num_free_nodes; ++j) {
         free_nodes.push_back(new Node<T>(min_degree));
     }
+    allocated_nodes += num_free_nodes;
 }
 
 template <class T>
 BTree<T>::~BTree() {
+    snapshots.before_write();
     destroy_tree(root);
     delete head;
     while (!free_nodes.empty()) {
@@ -98,16 +162,24 @@ void BTree<T>::destroy_tree(Node<T> *node) {
             destroy_tree(node->children[i]);
         }
     }
+    delete node;
 }
 
 template <class T>
 std::pair<Node<T>*, int> BTree<T>::search(T val) {
+    WST_TRACE_SPAN("BTree::search");
     // call helper function and start search at the root
     return search_node(root, val, false, true, nullptr);
 }
 
+template <class T>
+bool BTree<T>::contains(T val) {
+    return search(val).second >= 0;
+}
+
 template <class T>
 std::pair<Node<T>*, int> BTree<T>::search_node(Node<T> *node, T val, bool delete_element, bool modify_linked_list, Element<T> *new_pos) {
+    visits++;
 
     // find the index i of val in node
     // val is at index i, or in the i^th child of node
@@ -152,6 +224,9 @@ std::pair<Node<T>*, int> BTree<T>::search_node(Node<T> *node, T val, bool delete
                 }
                 node->num_keys--;
 
+                if (order_statistics) {
+                    add_to_path(node, -1);
+                }
                 fix_up(node);
 
                 // ----------- maybe return something different
@@ -172,7 +247,6 @@ std::pair<Node<T>*, int> BTree<T>::search_node(Node<T> *node, T val, bool delete
                 Element<T> succ_copy = Element<T>();
                 succ_copy = *successor;
                 node->keys[i].key = succ_copy.key;
-                size_++;
                 // remove the successor from its original position and
                 //  replace val with successor at val's current position
                 // remove_helper(node, successor->key, false, &(node->keys[i]));
@@ -205,7 +279,9 @@ std::pair<Node<T>*, int> BTree<T>::search_node(Node<T> *node, T val, bool delete
 
 template <class T>
 void BTree<T>::fix_up(Node<T> *node) {
-    if (node->num_keys >= min_degree - 1) {
+    WST_TRACE_SPAN("BTree::fix_up");
+    // the root is allowed to hold fewer than (min_degree - 1) keys
+    if (node->num_keys >= min_degree - 1 || node->parent == nullptr) {
         return;
     }
 
@@ -236,6 +312,9 @@ void BTree<T>::fix_up(Node<T> *node) {
 
 template <class T>
 int BTree<T>::insert(T val) {
+    WST_TRACE_SPAN("BTree::insert");
+    SnapshotWrite<T> write(snapshots);
+    snapshots.inserted(val);
 
     // levels of the tree traversed to insert val into the tree
     int levels_traversed = 0;
@@ -244,18 +323,12 @@ int BTree<T>::insert(T val) {
 
         // root node is full, split into two nodes and move middle
         // 	element up to become the new root
-        Node<T> *new_root;
-        if (free_nodes.empty()) {
-            new_root = new Node<T>(min_degree);
-        }
-        else {
-            new_root = free_nodes.back();
-            free_nodes.pop_back();
-        }
+        Node<T> *new_root = allocate_node();
 
         Node<T> *child_ptr = root;
 
         new_root->is_leaf = false;
+        new_root->subtree_keys = child_ptr->subtree_keys;
         new_root->children[0] = child_ptr;
         child_ptr->parent = new_root;
         child_ptr->index_in_parent = 0;
@@ -278,6 +351,7 @@ template <class T>
 void BTree<T>::insert_lru(T val) {
     // insert and add element to the back of the linked list
     //  used for element shifting in working set tree
+    SnapshotWrite<T> write(snapshots);
 
     insert(val);
 
@@ -295,17 +369,10 @@ void BTree<T>::insert_lru(T val) {
 
 template <class T>
 void BTree<T>::split_child(Node<T> *node, int index) {
+    WST_TRACE_SPAN("BTree::split_child");
 
     Node<T> *child1 = node->children[index]; // child to be split
-                                             //    Node<T> *child2 = new Node<T>(min_degree); // child splitting into
-    Node<T> *child2;
-    if (free_nodes.empty()) {
-        child2 = new Node<T>(min_degree);
-    }
-    else {
-        child2 = free_nodes.back();
-        free_nodes.pop_back();
-    }
+    Node<T> *child2 = allocate_node(); // child splitting into
 
     child2->is_leaf = child1->is_leaf;
     child2->num_keys = min_degree - 1;
@@ -330,6 +397,16 @@ void BTree<T>::split_child(Node<T> *node, int index) {
     // update child1 variable num_keys
     child1->num_keys = min_degree - 1;
 
+    if (order_statistics) {
+        child2->subtree_keys = child2->num_keys;
+        if (!child2->is_leaf) {
+            for (int i = 0; i <= child2->num_keys; ++i) {
+                child2->subtree_keys += child2->children[i]->subtree_keys;
+            }
+        }
+        child1->subtree_keys -= child2->subtree_keys + 1;
+    }
+
     // insert child2 into node's vector of children
     for (int i = node->num_keys; i >= index + 1; i--) {
         node->children[i + 1] = node->children[i];
@@ -356,6 +433,11 @@ void BTree<T>::split_child(Node<T> *node, int index) {
 
 template <class T>
 int BTree<T>::insert_nonfull(Node<T> *node, T element) {
+    visits++;
+
+    if (order_statistics) {
+        node->subtree_keys++;
+    }
 
     // find the position i in node to insert element
     int i = node->num_keys - 1;
@@ -406,16 +488,245 @@ int BTree<T>::insert_nonfull(Node<T> *node, T element) {
 
 template <class T>
 bool BTree<T>::remove(T value) {
-    size_--;
+    WST_TRACE_SPAN("BTree::remove");
+    SnapshotWrite<T> write(snapshots);
+    snapshots.removing(0, value);
     std::pair<Node<T>*, int> node_index = search_node(root, value, true, true, nullptr);
     if (node_index.second == -1) {
         return false;
     }
     else {
+        size_--;
         return true;
     }
 }
 
+// cut the keys in [lo, hi] out of the nodes holding them instead of
+//  removing them one by one: the subtrees wholly in range are unlinked from
+//  the recency list and returned to the pool, and only the nodes on the
+//  search paths of lo and hi are left short of keys. where the two paths
+//  split, one key in range is kept to separate them. the paths are then
+//  repaired from the root down and the kept key is removed as usual, in
+//  O(k + log n) for k keys removed
+template <class T>
+int BTree<T>::remove_range(T lo, T hi) {
+    WST_TRACE_SPAN("BTree::remove_range");
+    if (hi < lo) {
+        return 0;
+    }
+    snapshots.before_write();
+    bool kept = false;
+    T separator = T();
+    int removed = cut_range(root, lo, hi, kept, separator);
+    if (removed == 0 && !kept) {
+        return 0;
+    }
+    size_ -= removed;
+    refill_path(lo, false);
+    refill_path(hi, true);
+    fix_path(lo, false);
+    fix_path(hi, true);
+    if (kept) {
+        remove(separator);
+        removed++;
+    }
+    return removed;
+}
+
+// the adapter of a b-tree level cuts ranges out in place too (see level.h),
+//  so there is no rebuild to fill
+template <class T>
+int remove_range_of(BTree<T> &tree, T lo, T hi, double fill = 1.0) {
+    (void)fill;
+    return tree.remove_range(lo, hi);
+}
+
+// unlink the keys at [from, to) of node from the recency list and close the
+//  gap, returning how many there were
+template <class T>
+int BTree<T>::remove_keys(Node<T> *node, int from, int to) {
+    for (int j = from; j < to; ++j) {
+        node->keys[j].next->prev = node->keys[j].prev;
+        node->keys[j].prev->next = node->keys[j].next;
+    }
+    int gap = to - from;
+    for (int j = to; j < node->num_keys; ++j) {
+        node->keys[j - gap] = node->keys[j];
+        node->keys[j - gap].next->prev = &(node->keys[j - gap]);
+        node->keys[j - gap].prev->next = &(node->keys[j - gap]);
+    }
+    node->num_keys -= gap;
+    return gap;
+}
+
+// unlink every key under the children at [from, to) of node, return their
+//  nodes to the pool and close the gap, returning how many keys they held.
+//  node->num_keys must still count the keys between them
+template <class T>
+int BTree<T>::remove_children(Node<T> *node, int from, int to) {
+    int removed = 0;
+    std::vector<Node<T>*> pending(node->children.begin() + from, node->children.begin() + to);
+    while (!pending.empty()) {
+        Node<T> *child = pending.back();
+        pending.pop_back();
+        for (int j = 0; j < child->num_keys; ++j) {
+            child->keys[j].next->prev = child->keys[j].prev;
+            child->keys[j].prev->next = child->keys[j].next;
+        }
+        removed += child->num_keys;
+        if (!child->is_leaf) {
+            pending.insert(pending.end(), child->children.begin(), child->children.begin() + child->num_keys + 1);
+        }
+    }
+    for (int j = from; j < to; ++j) {
+        release_subtree(node->children[j]);
+    }
+    int gap = to - from;
+    for (int j = to; j <= node->num_keys; ++j) {
+        node->children[j - gap] = node->children[j];
+        node->children[j - gap]->index_in_parent = j - gap;
+    }
+    return removed;
+}
+
+// remove the keys in [lo, hi] from the subtree of node, returning how many
+//  were removed. the search paths of lo and hi run together down to the
+//  first node holding a key in range. past it, everything between them goes
+//  but its first key in range, which kept and separator report
+template <class T>
+int BTree<T>::cut_range(Node<T> *node, T lo, T hi, bool &kept, T &separator) {
+    visits++;
+    int a = 0;
+    while (a < node->num_keys && node->keys[a].key < lo) {
+        a++;
+    }
+    int b = a;
+    while (b < node->num_keys && !(hi < node->keys[b].key)) {
+        b++;
+    }
+    int removed;
+    if (node->is_leaf) {
+        removed = remove_keys(node, a, b);
+    }
+    else if (a == b) {
+        removed = cut_range(node->children[a], lo, hi, kept, separator);
+    }
+    else {
+        kept = true;
+        separator = node->keys[a].key;
+        removed = cut_from(node->children[a], lo) + cut_until(node->children[b], hi);
+        removed += remove_children(node, a + 1, b);
+        removed += remove_keys(node, a + 1, b);
+    }
+    node->subtree_keys -= removed;
+    return removed;
+}
+
+// remove every key from lo on from the subtree of node, whose keys are all
+//  below the upper end of the range
+template <class T>
+int BTree<T>::cut_from(Node<T> *node, T lo) {
+    visits++;
+    int a = 0;
+    while (a < node->num_keys && node->keys[a].key < lo) {
+        a++;
+    }
+    int removed = 0;
+    if (!node->is_leaf) {
+        removed += cut_from(node->children[a], lo);
+        removed += remove_children(node, a + 1, node->num_keys + 1);
+    }
+    removed += remove_keys(node, a, node->num_keys);
+    node->subtree_keys -= removed;
+    return removed;
+}
+
+// remove every key up to hi from the subtree of node, whose keys are all
+//  above the lower end of the range
+template <class T>
+int BTree<T>::cut_until(Node<T> *node, T hi) {
+    visits++;
+    int b = 0;
+    while (b < node->num_keys && !(hi < node->keys[b].key)) {
+        b++;
+    }
+    int removed = 0;
+    if (!node->is_leaf) {
+        removed += cut_until(node->children[b], hi);
+        removed += remove_children(node, 0, b);
+    }
+    removed += remove_keys(node, 0, b);
+    node->subtree_keys -= removed;
+    return removed;
+}
+
+// after a cut, walk down the search path of val (past keys equal to it when
+//  past_equal) and bring every child on it to at least min_degree keys by
+//  merging with or stealing from a sibling, so that a merge below cannot
+//  leave it short. the sibling away from the other path is tried first, the
+//  left one for the lower end of the range. if it is short as well a second
+//  merge may be needed, which leaves a node as few as min_degree - 2 keys
+//  for fix_path. a root left without keys is dropped by merge_children
+template <class T>
+void BTree<T>::refill_path(T val, bool past_equal) {
+    Node<T> *node = root;
+    while (!node->is_leaf) {
+        int i = 0;
+        while (i < node->num_keys && (node->keys[i].key < val || (past_equal && node->keys[i].key == val))) {
+            i++;
+        }
+        while (node->children[i]->num_keys < min_degree && node->num_keys > 0) {
+            bool use_left = i > 0 && (!past_equal || i == node->num_keys);
+            int pair = use_left ? i - 1 : i;
+            if (node->children[pair]->num_keys + node->children[pair + 1]->num_keys < min_degree * 2 - 1) {
+                merge_children(node, pair);
+                i = pair;
+                if (node != root && node->parent == nullptr) {
+                    break; // node was the root and is gone
+                }
+            }
+            else if (use_left) {
+                while (node->children[i]->num_keys < min_degree) {
+                    steal_from_left_neighbor(node, i);
+                }
+            }
+            else {
+                while (node->children[i]->num_keys < min_degree) {
+                    steal_from_right_neighbor(node, i);
+                }
+            }
+        }
+        node = node != root && node->parent == nullptr ? root : node->children[i];
+    }
+}
+
+// the nodes refill_path left short, by at most two keys below min_degree,
+//  are fixed from the top down so that each has a sibling to take from.
+//  fix_up carries any merge up to the root, so the walk starts over after
+//  every fix
+template <class T>
+void BTree<T>::fix_path(T val, bool past_equal) {
+    Node<T> *node = root;
+    while (!node->is_leaf) {
+        int i = 0;
+        while (i < node->num_keys && (node->keys[i].key < val || (past_equal && node->keys[i].key == val))) {
+            i++;
+        }
+        Node<T> *child = node->children[i];
+        if (child->num_keys < min_degree - 1) {
+            fix_up(child);
+            node = root;
+            continue;
+        }
+        node = child;
+    }
+}
+
+template <class T>
+int BTree<T>::remove_batch(const T *keys, int n, double fill) {
+    return remove_batch_of(*this, keys, n, fill);
+}
+
 // find the smallest element in the subtree rooted at node
 template <class T>
 Element<T>* BTree<T>::find_min_key(Node<T> *node) {
@@ -431,6 +742,7 @@ Element<T>* BTree<T>::find_min_key(Node<T> *node) {
 //  to the left child at index i
 template <class T>
 void BTree<T>::merge_children(Node<T> *node, int index) {
+    WST_TRACE_SPAN("BTree::merge_children");
     Node<T> *left_child = node->children[index];
     Node<T> *right_child = node->children[index + 1];
 
@@ -473,9 +785,11 @@ void BTree<T>::merge_children(Node<T> *node, int index) {
     }
 
     left_child->num_keys += right_child->num_keys + 1;
+    left_child->subtree_keys += right_child->subtree_keys + 1;
     node->num_keys--;
 
     right_child->num_keys = 0;
+    right_child->subtree_keys = 0;
     right_child->parent = nullptr;
     free_nodes.push_back(right_child);
 
@@ -483,7 +797,13 @@ void BTree<T>::merge_children(Node<T> *node, int index) {
     if (node == root && node->num_keys == 0) {
         root = left_child;
         left_child->parent = nullptr;
+        left_child->index_in_parent = -1;
         height--;
+
+        // return the old root to the pool
+        node->is_leaf = true;
+        node->subtree_keys = 0;
+        free_nodes.push_back(node);
     }
 }
 
@@ -492,6 +812,7 @@ void BTree<T>::merge_children(Node<T> *node, int index) {
 //  now has one more key
 template <class T>
 void BTree<T>::steal_from_left_neighbor(Node<T> *node, int index) {
+    WST_TRACE_SPAN("BTree::steal_from_left_neighbor");
 
     Node<T> *left_child = node->children[index - 1];
     Node<T> *child = node->children[index];
@@ -525,6 +846,10 @@ void BTree<T>::steal_from_left_neighbor(Node<T> *node, int index) {
         child->children[0]->index_in_parent = 0;
     }
 
+    int moved_keys = 1 + (child->is_leaf ? 0 : child->children[0]->subtree_keys);
+    left_child->subtree_keys -= moved_keys;
+    child->subtree_keys += moved_keys;
+
     left_child->num_keys--;
     child->num_keys++;
 
@@ -535,6 +860,7 @@ void BTree<T>::steal_from_left_neighbor(Node<T> *node, int index) {
 //  child now has one more key
 template <class T>
 void BTree<T>::steal_from_right_neighbor(Node<T> *node, int index) {
+    WST_TRACE_SPAN("BTree::steal_from_right_neighbor");
 
     Node<T> *child = node->children[index];
     Node<T> *right_child = node->children[index + 1];
@@ -569,6 +895,10 @@ void BTree<T>::steal_from_right_neighbor(Node<T> *node, int index) {
 
     }
 
+    int moved_keys = 1 + (child->is_leaf ? 0 : child->children[child->num_keys + 1]->subtree_keys);
+    right_child->subtree_keys -= moved_keys;
+    child->subtree_keys += moved_keys;
+
     child->num_keys++;
     right_child->num_keys--;
 }
@@ -688,4 +1018,420 @@ std::string BTree<T>::print_ordered_tail() {
 
 }
 
+// list all keys from the most recently accessed (head) to the least
+//  recently accessed element (tail)
+template <class T>
+std::vector<T> BTree<T>::keys_by_recency() {
+    std::vector<T> keys;
+    keys.reserve(size_);
+    for (Element<T> *elmt = head->next; elmt != head; elmt = elmt->next) {
+        keys.push_back(elmt->key);
+    }
+    return keys;
+}
+
+// take a node from the pool of preallocated nodes, or allocate a new one
+//  if the pool is empty
+template <class T>
+Node<T>* BTree<T>::allocate_node() {
+    if (free_nodes.empty()) {
+        allocated_nodes++;
+        return new Node<T>(min_degree);
+    }
+    Node<T> *node = free_nodes.back();
+    free_nodes.pop_back();
+    return node;
+}
+
+// reset every node of the subtree rooted at node and return it to the pool
+template <class T>
+void BTree<T>::release_subtree(Node<T> *node) {
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; ++i) {
+            release_subtree(node->children[i]);
+        }
+    }
+    node->num_keys = 0;
+    node->subtree_keys = 0;
+    node->is_leaf = true;
+    node->parent = nullptr;
+    node->index_in_parent = -1;
+    free_nodes.push_back(node);
+}
+
+// number of keys in a subtree of height h in which every node holds
+//  keys_per_node keys, saturated at LLONG_MAX
+static inline long long subtree_capacity(long long keys_per_node, int h) {
+    long long capacity = 1;
+    for (int i = 0; i < h; ++i) {
+        if (capacity > LLONG_MAX / (keys_per_node + 1)) {
+            return LLONG_MAX;
+        }
+        capacity *= keys_per_node + 1;
+    }
+    return capacity - 1;
+}
+
+// build a subtree of height h holding the n sorted items. every non-root
+//  node of the result holds between (min_degree - 1) and (2*min_degree - 1)
+//  keys, and as close to keys_per_node keys as that allows. the address of
+//  the element holding the item of recency rank r is stored in by_recency[r]
+template <class T>
+Node<T>* BTree<T>::build_subtree(std::pair<T, int> *items, int n, int h, bool is_root, int keys_per_node,
+                                 std::vector<Element<T>*> &by_recency) {
+    Node<T> *node = allocate_node();
+    node->is_leaf = (h == 1);
+
+    if (node->is_leaf) {
+        for (int j = 0; j < n; ++j) {
+            node->keys[j] = Element<T>(items[j].first, nullptr, nullptr);
+            by_recency[items[j].second] = &(node->keys[j]);
+        }
+        node->num_keys = n;
+        node->subtree_keys = n;
+        return node;
+    }
+
+    // choose the number of children c such that every child receives
+    //  between the minimum and the maximum number of keys of a subtree of
+    //  height (h - 1), preferring children holding keys_per_node keys per node
+    long long child_min = subtree_capacity(min_degree - 1, h - 1);
+    long long child_max = subtree_capacity(min_degree * 2 - 1, h - 1);
+    long long child_target = subtree_capacity(keys_per_node, h - 1);
+    long long c = (n + 1 + child_target) / (child_target + 1); // ceil((n + 1) / (child_target + 1))
+    long long c_min = std::max<long long>(is_root ? 2 : min_degree, (n + 1 + child_max) / (child_max + 1));
+    long long c_max = std::min<long long>(min_degree * 2, (n + 1) / (child_min + 1));
+    c = std::min(std::max(c, c_min), c_max);
+
+    int child_keys = n - (int)(c - 1);
+    int base = child_keys / (int)c;
+    int extra = child_keys % (int)c;
+    int pos = 0;
+    for (int j = 0; j < c; ++j) {
+        int count = base + (j < extra ? 1 : 0);
+        Node<T> *child = build_subtree(items + pos, count, h - 1, false, keys_per_node, by_recency);
+        child->parent = node;
+        child->index_in_parent = j;
+        node->children[j] = child;
+        pos += count;
+        if (j < c - 1) {
+            node->keys[j] = Element<T>(items[pos].first, nullptr, nullptr);
+            by_recency[items[pos].second] = &(node->keys[j]);
+            pos++;
+        }
+    }
+    node->num_keys = (int)c - 1;
+    node->subtree_keys = n;
+    return node;
+}
+
+// replace the contents of the tree with the n given keys, ordered from the
+//  most to the least recently accessed. the tree is built bottom-up from the
+//  sorted keys in O(n log n) instead of n separate insertions, with nodes
+//  holding about fill * (2*min_degree - 1) keys (at least min_degree - 1),
+//  or more where that many would make the tree taller than max_height
+template <class T>
+void BTree<T>::bulk_load(const T *keys, int n, double fill) {
+    snapshots.before_write();
+    release_subtree(root);
+
+    std::vector<std::pair<T, int> > items(n);
+    for (int i = 0; i < n; ++i) {
+        items[i] = std::pair<T, int>(keys[i], i);
+    }
+    std::sort(items.begin(), items.end());
+
+    int keys_per_node = (int)(fill * (min_degree * 2 - 1) + 0.5);
+    keys_per_node = std::min(std::max(keys_per_node, std::max(min_degree - 1, 1)), min_degree * 2 - 1);
+    while (keys_per_node < min_degree * 2 - 1 && subtree_capacity(keys_per_node, max_height) < n) {
+        keys_per_node++;
+    }
+
+    // the lowest height holding n keys at keys_per_node keys per node, but
+    //  no taller than a root with two minimal subtrees allows and no lower
+    //  than full nodes require
+    int h = 1;
+    while (subtree_capacity(keys_per_node, h) < n && 2 * (subtree_capacity(min_degree - 1, h) + 1) - 1 <= n) {
+        h++;
+    }
+    while (subtree_capacity(min_degree * 2 - 1, h) < n) {
+        h++;
+    }
+
+    std::vector<Element<T>*> by_recency(n);
+    root = build_subtree(items.data(), n, h, true, keys_per_node, by_recency);
+    root->parent = nullptr;
+    root->index_in_parent = -1;
+    height = h;
+    size_ = n;
+
+    // relink the list from the most (head->next) to the least recently
+    //  accessed element (head->prev)
+    Element<T> *prev = head;
+    for (int i = 0; i < n; ++i) {
+        prev->next = by_recency[i];
+        by_recency[i]->prev = prev;
+        prev = by_recency[i];
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+// iterator to the smallest key of the tree
+template <class T>
+typename BTree<T>::iterator BTree<T>::begin() {
+    if (root->num_keys == 0) {
+        return end();
+    }
+    Node<T> *node = root;
+    while (!node->is_leaf) {
+        node = node->children[0];
+    }
+    return iterator(node, 0, root);
+}
+
+template <class T>
+typename BTree<T>::iterator BTree<T>::end() {
+    return iterator(nullptr, 0, root);
+}
+
+template <class T>
+typename BTree<T>::reverse_iterator BTree<T>::rbegin() {
+    return reverse_iterator(end());
+}
+
+template <class T>
+typename BTree<T>::reverse_iterator BTree<T>::rend() {
+    return reverse_iterator(begin());
+}
+
+template <class T>
+typename BTree<T>::iterator BTree<T>::lower_bound(T val) {
+    return bound(val, true);
+}
+
+template <class T>
+typename BTree<T>::iterator BTree<T>::upper_bound(T val) {
+    return bound(val, false);
+}
+
+template <class T>
+void BTree<T>::append_range(T lo, T hi, std::vector<T> &out) {
+    for (iterator it = lower_bound(lo); it != end() && !(hi < *it); ++it) {
+        out.push_back(*it);
+    }
+}
+
+// descend from the root, remembering the last key that satisfies the bound.
+//  the deepest such key is the smallest one in the tree
+template <class T>
+typename BTree<T>::iterator BTree<T>::bound(T val, bool include_equal) {
+    iterator result = end();
+    Node<T> *node = root;
+    while (true) {
+        int i = 0;
+        while (i < node->num_keys && (node->keys[i].key < val || (!include_equal && node->keys[i].key == val))) {
+            i++;
+        }
+        if (i < node->num_keys) {
+            result = iterator(node, i, root);
+        }
+        if (node->is_leaf) {
+            return result;
+        }
+        node = node->children[i];
+    }
+}
+
+// add delta to the subtree key counts of node and all its ancestors
+template <class T>
+void BTree<T>::add_to_path(Node<T> *node, int delta) {
+    while (node != nullptr) {
+        node->subtree_keys += delta;
+        node = node->parent;
+    }
+}
+
+// descend towards the k-th smallest key, skipping whole subtrees using
+//  their key counts
+template <class T>
+typename BTree<T>::iterator BTree<T>::select(int k) {
+    if (k < 0) {
+        return end();
+    }
+    if (!order_statistics) {
+        iterator it = begin();
+        while (k > 0 && it != end()) {
+            ++it;
+            k--;
+        }
+        return it;
+    }
+    if (k >= root->subtree_keys) {
+        return end();
+    }
+
+    Node<T> *node = root;
+    while (!node->is_leaf) {
+        int j = 0;
+        while (true) {
+            int child_keys = node->children[j]->subtree_keys;
+            if (k < child_keys) {
+                node = node->children[j];
+                break;
+            }
+            k -= child_keys;
+            if (k == 0) {
+                return iterator(node, j, root);
+            }
+            k--;
+            j++;
+        }
+    }
+    return iterator(node, k, root);
+}
+
+// count the keys less than val: at every node on the search path, add the
+//  keys to the left of the path and the key counts of their subtrees
+template <class T>
+int BTree<T>::rank(T val) {
+    if (!order_statistics) {
+        int r = 0;
+        for (iterator it = begin(); it != end() && *it < val; ++it) {
+            r++;
+        }
+        return r;
+    }
+
+    int r = 0;
+    Node<T> *node = root;
+    while (true) {
+        int i = 0;
+        while (i < node->num_keys && node->keys[i].key < val) {
+            i++;
+        }
+        r += i;
+        if (node->is_leaf) {
+            return r;
+        }
+        for (int j = 0; j < i; ++j) {
+            r += node->children[j]->subtree_keys;
+        }
+        node = node->children[i];
+    }
+}
+
+// position of val in the linked list, counted from the most recently
+//  accessed element. walks the list from val towards the head
+template <class T>
+int BTree<T>::recency_position(T val) {
+    std::pair<Node<T>*, int> node_index = search_node(root, val, false, false, nullptr);
+    if (node_index.second < 0) {
+        return -1;
+    }
+    int position = 0;
+    for (Element<T> *elmt = node_index.first->keys[node_index.second].prev; elmt != head; elmt = elmt->prev) {
+        position++;
+    }
+    return position;
+}
+
+// reads the tree without counting node visits, so that a snapshot may copy
+//  from it on another thread between writes (see snapshot.h)
+template <class T>
+bool BTree<T>::append_by_recency(const T *after, int count, std::vector<T> &out) {
+    Element<T> *elmt = head;
+    if (after != nullptr) {
+        Node<T> *node = root;
+        while (true) {
+            int i = 0;
+            while (i < node->num_keys && *after > node->keys[i].key) {
+                i++;
+            }
+            if (i < node->num_keys && *after == node->keys[i].key) {
+                elmt = &node->keys[i];
+                break;
+            }
+            if (node->is_leaf) {
+                return false;
+            }
+            node = node->children[i];
+        }
+    }
+    for (elmt = elmt->next; elmt != head && count > 0; elmt = elmt->next, count--) {
+        out.push_back(elmt->key);
+    }
+    return true;
+}
+
+// memory held by the tree. every node holds a vector of (2*min_degree - 1)
+//  elements and a vector of 2*min_degree child pointers, each a separate
+//  heap block
+template <class T>
+MemoryStats BTree<T>::memory_stats() {
+    MemoryStats stats;
+    long long node_bytes = sizeof(Node<T>) + (min_degree * 2 - 1) * sizeof(Element<T>) + min_degree * 2 * sizeof(Node<T>*);
+    stats.live_keys = size_;
+    stats.pooled_nodes = free_nodes.size();
+    stats.live_nodes = allocated_nodes - stats.pooled_nodes;
+    stats.key_slots = stats.live_nodes * (min_degree * 2 - 1);
+    stats.allocator_overhead = (allocated_nodes * 3 + 2) * ALLOCATION_OVERHEAD; // plus the sentinel and the pool
+    stats.bytes = sizeof(BTree<T>) + allocated_nodes * node_bytes + sizeof(Element<T>)
+        + free_nodes.capacity() * sizeof(Node<T>*) + stats.allocator_overhead;
+    return stats;
+}
+
+// whether the live nodes are filled below min_fill, or the pool holds more
+//  nodes than the tree itself
+template <class T>
+bool BTree<T>::needs_compaction(double min_fill) {
+    MemoryStats stats = memory_stats();
+    return stats.fill_factor() < min_fill || stats.pooled_nodes > stats.live_nodes;
+}
+
+// rebuild the tree with nodes filled to about target_fill, keeping the
+//  recency order of the keys, and delete the pooled nodes that the rebuild
+//  leaves unused apart from enough for one root-to-leaf chain of splits
+template <class T>
+void BTree<T>::compact(double target_fill) {
+    std::vector<T> keys = keys_by_recency();
+    bulk_load(keys.data(), keys.size(), target_fill);
+    trim_pool(height + 1);
+}
+
+template <class T>
+int BTree<T>::trim_pool(int keep) {
+    int trimmed = 0;
+    while ((int)free_nodes.size() > keep) {
+        delete free_nodes.back();
+        free_nodes.pop_back();
+        allocated_nodes--;
+        trimmed++;
+    }
+    std::vector<Node<T>*>(free_nodes).swap(free_nodes);
+    return trimmed;
+}
+
+template <class T>
+Snapshot<T> BTree<T>::snapshot() {
+    return snapshots.take(1, [this](int, const T *after, int count, std::vector<T> &out) {
+        return append_by_recency(after, count, out);
+    });
+}
+
+template <class T>
+FrozenTree<T> BTree<T>::freeze() {
+    std::vector<T> sorted;
+    sorted.reserve(size_);
+    for (iterator it = begin(); it != end(); ++it) {
+        sorted.push_back(*it);
+    }
+    return FrozenTree<T>(sorted.data(), sorted.size());
+}
+
+template <class T>
+long long BTree<T>::node_visits() {
+    return visits;
+}
+
 #endif // BTREE_H
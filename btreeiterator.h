@@ -0,0 +1,122 @@
+/*
+ * btreeiterator.h
+ *
+ * template class for a bidirectional, read-only iterator over the keys of a
+ * b-tree in ascending order. The iterator stores the node it points into and
+ * the index of the key in that node, and moves between nodes using the
+ * parent and index_in_parent fields of Node<T>. Iterating never touches the
+ * recency linked list. The past-the-end iterator has a null node and keeps
+ * the root so that it can be decremented to the largest key.
+*/
+
+#ifndef BTREEITERATOR_H
+#define BTREEITERATOR_H
+
+#include <cstddef>
+#include <iterator>
+#include "node.h"
+
+template <class T>
+class BTreeIterator {
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const T* pointer;
+    typedef const T& reference;
+
+    BTreeIterator() : node(nullptr), index(0), root(nullptr) {}
+    BTreeIterator(Node<T> *n, int i, Node<T> *r) : node(n), index(i), root(r) {}
+
+    reference operator*() const {
+        return node->keys[index].key;
+    }
+
+    pointer operator->() const {
+        return &(node->keys[index].key);
+    }
+
+    // move to the next larger key: the smallest key of the right subtree,
+    //  or the first ancestor key to the right
+    BTreeIterator& operator++() {
+        if (!node->is_leaf) {
+            node = node->children[index + 1];
+            while (!node->is_leaf) {
+                node = node->children[0];
+            }
+            index = 0;
+            return *this;
+        }
+        index++;
+        while (node != nullptr && index == node->num_keys) {
+            index = node->index_in_parent;
+            node = node->parent;
+        }
+        if (node == nullptr) {
+            index = 0;
+        }
+        return *this;
+    }
+
+    // move to the next smaller key: the largest key of the left subtree,
+    //  or the first ancestor key to the left. decrementing the past-the-end
+    //  iterator moves to the largest key of the tree
+    BTreeIterator& operator--() {
+        if (node == nullptr) {
+            node = root;
+            while (!node->is_leaf) {
+                node = node->children[node->num_keys];
+            }
+            index = node->num_keys - 1;
+            return *this;
+        }
+        if (!node->is_leaf) {
+            node = node->children[index];
+            while (!node->is_leaf) {
+                node = node->children[node->num_keys];
+            }
+            index = node->num_keys - 1;
+            return *this;
+        }
+        if (index > 0) {
+            index--;
+            return *this;
+        }
+        while (node->parent != nullptr && node->index_in_parent == 0) {
+            node = node->parent;
+        }
+        index = node->index_in_parent - 1;
+        node = node->parent;
+        if (node == nullptr) {
+            index = 0;
+        }
+        return *this;
+    }
+
+    BTreeIterator operator++(int) {
+        BTreeIterator it = *this;
+        ++(*this);
+        return it;
+    }
+
+    BTreeIterator operator--(int) {
+        BTreeIterator it = *this;
+        --(*this);
+        return it;
+    }
+
+    bool operator==(const BTreeIterator &other) const {
+        return node == other.node && index == other.index;
+    }
+
+    bool operator!=(const BTreeIterator &other) const {
+        return !(*this == other);
+    }
+
+private:
+    Node<T> *node;
+    int index;
+    Node<T> *root;
+};
+
+#endif // BTREEITERATOR_H
@@ -0,0 +1,286 @@
+/*
+ * flattree.h
+ *
+ * template class for a small set of keys stored in one contiguous array in
+ * recency order, from the least recently accessed key at index 0 to the most
+ * recently accessed key at the back. It offers the same operations as BTree
+ * for use as one of the front levels of a working set tree, where a handful
+ * of keys do not justify the nodes and linked elements of a b-tree. Lookups
+ * scan the array from the most recent end, using SSE2 for int keys.
+*/
+
+#ifndef FLATTREE_H
+#define FLATTREE_H
+
+#include <algorithm> // for std::sort
+#include <string>
+#include <vector>
+#include "memorystats.h"
+#include "node.h" // for DEFAULT_MIN_DEGREE
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// index of the last occurrence of val in keys[0..n), or -1
+template <class T>
+int find_key(const T *keys, int n, T val) {
+    for (int i = n - 1; i >= 0; --i) {
+        if (keys[i] == val) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#if defined(__SSE2__)
+// compare four keys at a time, walking back from the most recent end
+inline int find_key(const int *keys, int n, int val) {
+    __m128i needle = _mm_set1_epi32(val);
+    int i = n;
+    while (i >= 4) {
+        i -= 4;
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, needle)));
+        if (mask != 0) {
+            return i + (mask & 8 ? 3 : mask & 4 ? 2 : mask & 2 ? 1 : 0);
+        }
+    }
+    while (i > 0) {
+        i--;
+        if (keys[i] == val) {
+            return i;
+        }
+    }
+    return -1;
+}
+#endif
+
+template <class T>
+class FlatTree {
+public:
+    FlatTree(int min_deg = DEFAULT_MIN_DEGREE, int max_hght = 1)
+        : min_degree(min_deg), max_height(max_hght), visits(0) {}
+    int insert(T val);
+    void insert_lru(T val);
+    bool remove(T val);
+    T remove_lru();
+    T remove_mru();
+    bool contains(T val);
+    int get_height();
+    int get_max_height();
+    bool is_empty();
+    int size();
+    std::string to_string();
+    std::string print_ordered_mru();
+    std::string print_ordered_tail();
+    std::vector<T> keys_by_recency();
+    void bulk_load(const T *keys, int n, double fill = 1.0);
+    int recency_position(T val);
+    bool append_by_recency(const T *after, int count, std::vector<T> &out);
+    void append_range(T lo, T hi, std::vector<T> &out);
+    MemoryStats memory_stats();
+    bool needs_compaction(double min_fill);
+    void compact(double target_fill);
+    long long node_visits(); // scans of the array, which is the only node
+private:
+    int min_degree;
+    int max_height;
+    long long visits;
+    std::vector<T> keys; // from LRU (front) to MRU (back)
+};
+
+// insert val as the most recently accessed key
+template <class T>
+int FlatTree<T>::insert(T val) {
+    keys.push_back(val);
+    return 1;
+}
+
+// insert val as the least recently accessed key
+template <class T>
+void FlatTree<T>::insert_lru(T val) {
+    keys.insert(keys.begin(), val);
+}
+
+template <class T>
+bool FlatTree<T>::remove(T val) {
+    visits++;
+    int i = find_key(keys.data(), (int)keys.size(), val);
+    if (i < 0) {
+        return false;
+    }
+    keys.erase(keys.begin() + i);
+    return true;
+}
+
+template <class T>
+T FlatTree<T>::remove_lru() {
+    if (keys.empty()) {
+        return T();
+    }
+    T lru = keys.front();
+    keys.erase(keys.begin());
+    return lru;
+}
+
+template <class T>
+T FlatTree<T>::remove_mru() {
+    if (keys.empty()) {
+        return T();
+    }
+    T mru = keys.back();
+    keys.pop_back();
+    return mru;
+}
+
+template <class T>
+bool FlatTree<T>::contains(T val) {
+    visits++;
+    return find_key(keys.data(), (int)keys.size(), val) >= 0;
+}
+
+// the height of a b-tree of the same minimum degree holding these keys in
+//  full nodes, so that height boundaries treat both containers alike
+template <class T>
+int FlatTree<T>::get_height() {
+    int height = 1;
+    long long capacity = min_degree * 2 - 1;
+    while (capacity < (long long)keys.size()) {
+        capacity = capacity * (min_degree * 2) + (min_degree * 2 - 1);
+        height++;
+    }
+    return height;
+}
+
+template <class T>
+int FlatTree<T>::get_max_height() {
+    return max_height;
+}
+
+template <class T>
+bool FlatTree<T>::is_empty() {
+    return keys.empty();
+}
+
+template <class T>
+int FlatTree<T>::size() {
+    return keys.size();
+}
+
+// string representation: the keys in ascending order
+template <class T>
+std::string FlatTree<T>::to_string() {
+    std::vector<T> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    std::string str = "[ ";
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        str += std::to_string(sorted[i]) + " ";
+    }
+    return str + "]";
+}
+
+template <class T>
+std::string FlatTree<T>::print_ordered_mru() {
+    std::string str = "MRU-> ";
+    for (int i = (int)keys.size() - 1; i >= 0; --i) {
+        str += "#" + std::to_string(keys[i]) + "# ";
+    }
+    str += " <-LRU";
+    return str;
+}
+
+template <class T>
+std::string FlatTree<T>::print_ordered_tail() {
+    std::string str = "(tail) LRU-> ";
+    for (size_t i = 0; i < keys.size(); ++i) {
+        str += "#" + std::to_string(keys[i]) + "# ";
+    }
+    str += " <-MRU";
+    return str;
+}
+
+template <class T>
+std::vector<T> FlatTree<T>::keys_by_recency() {
+    return std::vector<T>(keys.rbegin(), keys.rend());
+}
+
+// replace the contents with the n given keys, ordered from the most to the
+//  least recently accessed. keys are always contiguous, so the fill does not
+//  apply
+template <class T>
+void FlatTree<T>::bulk_load(const T *mru_keys, int n, double fill) {
+    (void)fill;
+    keys.assign(mru_keys, mru_keys + n);
+    std::reverse(keys.begin(), keys.end());
+}
+
+template <class T>
+int FlatTree<T>::recency_position(T val) {
+    visits++;
+    int i = find_key(keys.data(), (int)keys.size(), val);
+    if (i < 0) {
+        return -1;
+    }
+    return (int)keys.size() - 1 - i;
+}
+
+// a scan that is not counted as a visit, so that a snapshot may copy from the
+//  array on another thread between writes (see snapshot.h)
+template <class T>
+bool FlatTree<T>::append_by_recency(const T *after, int count, std::vector<T> &out) {
+    int i = keys.size();
+    if (after != nullptr) {
+        i = find_key(keys.data(), (int)keys.size(), *after);
+        if (i < 0) {
+            return false;
+        }
+    }
+    for (i--; i >= 0 && count > 0; --i, --count) {
+        out.push_back(keys[i]);
+    }
+    return true;
+}
+
+// append the keys in [lo, hi] to out in ascending order
+template <class T>
+void FlatTree<T>::append_range(T lo, T hi, std::vector<T> &out) {
+    size_t first = out.size();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!(keys[i] < lo) && !(hi < keys[i])) {
+            out.push_back(keys[i]);
+        }
+    }
+    std::sort(out.begin() + first, out.end());
+}
+
+// memory held by the array. a flat tree has no nodes
+template <class T>
+MemoryStats FlatTree<T>::memory_stats() {
+    MemoryStats stats;
+    stats.live_keys = keys.size();
+    stats.key_slots = keys.capacity();
+    stats.allocator_overhead = keys.capacity() > 0 ? ALLOCATION_OVERHEAD : 0;
+    stats.bytes = sizeof(FlatTree<T>) + keys.capacity() * sizeof(T) + stats.allocator_overhead;
+    return stats;
+}
+
+template <class T>
+bool FlatTree<T>::needs_compaction(double min_fill) {
+    return memory_stats().fill_factor() < min_fill;
+}
+
+// release the unused capacity of the array. keys are always contiguous, so
+//  the target fill does not apply
+template <class T>
+void FlatTree<T>::compact(double target_fill) {
+    (void)target_fill;
+    keys.shrink_to_fit();
+}
+
+template <class T>
+long long FlatTree<T>::node_visits() {
+    return visits;
+}
+
+#endif // FLATTREE_H
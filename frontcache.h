@@ -0,0 +1,302 @@
+/*
+ * frontcache.h
+ *
+ * a working set tree shared between threads, and a small per-thread tier in
+ * front of it. SharedWorkingSetTree serializes every operation on a
+ * WorkingSetTree with one mutex. A FrontCache belongs to one thread and
+ * keeps the keys that thread found most recently in a FlatTree (see
+ * flattree.h). A search finding its key there is answered without touching
+ * the shared tree or its lock, and is recorded as a pending promotion. The
+ * pending promotions are replayed on the shared tree as searches, under one
+ * lock, once publish_batch of them have accumulated, and before any other
+ * operation of the thread reaches the shared tree. The recency order of the
+ * shared tree thus lags each thread by at most publish_batch hits.
+ *
+ * A removed key must not be found in a front tier afterwards. Every removal
+ * through the shared tree is written to a ring of the last REMOVAL_LOG_SIZE
+ * removed keys and advances an atomic epoch. Before every search a front
+ * cache compares the epoch with the last one it saw, and on a change drops
+ * the logged keys from its tier, or empties the tier if the ring has wrapped
+ * around since. A search racing with the removal of its key may still find
+ * it, as if it had run just before the removal. Keys evicted by the weight
+ * cap of the tree (see set_weight_boundaries in workingsettree.h) are logged
+ * as removals by the insert that evicted them, so the shared tree turns on
+ * collect_evictions.
+*/
+
+#ifndef FRONTCACHE_H
+#define FRONTCACHE_H
+
+#include <algorithm> // for std::reverse
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "flattree.h"
+#include "workingsettree.h"
+
+const int DEFAULT_FRONT_CACHE_KEYS = 64;
+const int DEFAULT_PUBLISH_BATCH = 256;
+const int REMOVAL_LOG_SIZE = 4096;
+
+template <class T, class Policy>
+class FrontCache;
+
+template <class T, class Policy = DynamicPolicy>
+class SharedWorkingSetTree {
+public:
+    explicit SharedWorkingSetTree(WorkingSetTree<T, Policy> &wst) : tree(wst), epoch(0), removal_log(REMOVAL_LOG_SIZE) {
+        tree.collect_evictions(true);
+    }
+    void insert(T val);
+    bool search(T val);
+    bool remove(T val);
+    int remove_range(T lo, T hi);
+    int remove_batch(const T *keys, int n);
+    int size();
+private:
+    friend class FrontCache<T, Policy>;
+    WorkingSetTree<T, Policy> &tree;
+    std::mutex lock;
+    std::atomic<long long> epoch; // number of removals logged so far
+    std::vector<T> removal_log; // removal e is at index e % REMOVAL_LOG_SIZE
+    // the following require lock to be held
+    bool remove_locked(T val);
+    void log_removal(T val);
+    void log_evictions();
+    void invalidate_all();
+};
+
+template <class T, class Policy>
+void SharedWorkingSetTree<T, Policy>::insert(T val) {
+    std::lock_guard<std::mutex> guard(lock);
+    tree.insert(val);
+    log_evictions();
+}
+
+template <class T, class Policy>
+bool SharedWorkingSetTree<T, Policy>::search(T val) {
+    std::lock_guard<std::mutex> guard(lock);
+    return tree.search(val);
+}
+
+template <class T, class Policy>
+bool SharedWorkingSetTree<T, Policy>::remove(T val) {
+    std::lock_guard<std::mutex> guard(lock);
+    return remove_locked(val);
+}
+
+// which keys went is not known, so every front tier starts over
+template <class T, class Policy>
+int SharedWorkingSetTree<T, Policy>::remove_range(T lo, T hi) {
+    std::lock_guard<std::mutex> guard(lock);
+    int removed = tree.remove_range(lo, hi);
+    if (removed > 0) {
+        invalidate_all();
+    }
+    return removed;
+}
+
+template <class T, class Policy>
+int SharedWorkingSetTree<T, Policy>::remove_batch(const T *keys, int n) {
+    std::lock_guard<std::mutex> guard(lock);
+    int removed = tree.remove_batch(keys, n);
+    if (removed > 0 && n <= REMOVAL_LOG_SIZE) {
+        for (int i = 0; i < n; ++i) {
+            log_removal(keys[i]);
+        }
+    }
+    else if (removed > 0) {
+        invalidate_all();
+    }
+    return removed;
+}
+
+template <class T, class Policy>
+int SharedWorkingSetTree<T, Policy>::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return tree.size();
+}
+
+template <class T, class Policy>
+bool SharedWorkingSetTree<T, Policy>::remove_locked(T val) {
+    if (!tree.remove(val)) {
+        return false;
+    }
+    log_removal(val);
+    return true;
+}
+
+template <class T, class Policy>
+void SharedWorkingSetTree<T, Policy>::log_removal(T val) {
+    long long e = epoch.load(std::memory_order_relaxed);
+    removal_log[e % REMOVAL_LOG_SIZE] = val;
+    epoch.store(e + 1, std::memory_order_release);
+}
+
+// the keys the last insert evicted are removals as well
+template <class T, class Policy>
+void SharedWorkingSetTree<T, Policy>::log_evictions() {
+    std::vector<T> evicted = tree.take_evictions();
+    if ((int)evicted.size() > REMOVAL_LOG_SIZE) {
+        invalidate_all();
+        return;
+    }
+    for (size_t i = 0; i < evicted.size(); ++i) {
+        log_removal(evicted[i]);
+    }
+}
+
+// advance the epoch past the whole ring, as if it had wrapped around
+template <class T, class Policy>
+void SharedWorkingSetTree<T, Policy>::invalidate_all() {
+    epoch.store(epoch.load(std::memory_order_relaxed) + REMOVAL_LOG_SIZE + 1, std::memory_order_release);
+}
+
+template <class T, class Policy = DynamicPolicy>
+class FrontCache {
+public:
+    FrontCache(SharedWorkingSetTree<T, Policy> &shared_tree, int max_keys = DEFAULT_FRONT_CACHE_KEYS,
+               int batch = DEFAULT_PUBLISH_BATCH)
+        : shared(shared_tree), capacity(max_keys), publish_batch(batch), seen_epoch(shared_tree.epoch.load()), local_hits(0) {}
+    ~FrontCache();
+    void insert(T val);
+    bool search(T val);
+    bool remove(T val);
+    void flush(); // publish the pending promotions now
+    long long hits(); // searches answered by the front tier
+private:
+    SharedWorkingSetTree<T, Policy> &shared;
+    int capacity;
+    int publish_batch;
+    long long seen_epoch;
+    long long local_hits;
+    FlatTree<T> front;
+    std::vector<T> pending; // keys found in front, in the order they were found
+    std::vector<T> promotions;
+    void take_promotions();
+    // the following require shared.lock to be held
+    void catch_up();
+    void publish();
+    void admit(T val);
+};
+
+template <class T, class Policy>
+FrontCache<T, Policy>::~FrontCache() {
+    flush();
+}
+
+template <class T, class Policy>
+void FrontCache<T, Policy>::insert(T val) {
+    take_promotions();
+    std::lock_guard<std::mutex> guard(shared.lock);
+    catch_up();
+    publish();
+    shared.tree.insert(val);
+    shared.log_evictions();
+    admit(val);
+    catch_up(); // drops the evicted keys, val among them if it went at once
+}
+
+template <class T, class Policy>
+bool FrontCache<T, Policy>::search(T val) {
+    if (shared.epoch.load(std::memory_order_acquire) == seen_epoch && front.remove(val)) {
+        front.insert(val);
+        pending.push_back(val);
+        local_hits++;
+        if ((int)pending.size() >= publish_batch) {
+            flush();
+        }
+        return true;
+    }
+
+    take_promotions();
+    std::lock_guard<std::mutex> guard(shared.lock);
+    catch_up();
+    publish();
+    bool found = shared.tree.search(val);
+    if (found) {
+        admit(val);
+    }
+    return found;
+}
+
+template <class T, class Policy>
+bool FrontCache<T, Policy>::remove(T val) {
+    take_promotions();
+    std::lock_guard<std::mutex> guard(shared.lock);
+    catch_up();
+    publish();
+    front.remove(val);
+    return shared.remove_locked(val);
+}
+
+template <class T, class Policy>
+void FrontCache<T, Policy>::flush() {
+    take_promotions();
+    if (promotions.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(shared.lock);
+    catch_up();
+    publish();
+}
+
+template <class T, class Policy>
+long long FrontCache<T, Policy>::hits() {
+    return local_hits;
+}
+
+// turn the pending hits into promotions outside the lock: every key once, at
+//  its last hit, from the least to the most recent
+template <class T, class Policy>
+void FrontCache<T, Policy>::take_promotions() {
+    promotions.clear();
+    for (int i = (int)pending.size() - 1; i >= 0; --i) {
+        if (find_key(promotions.data(), (int)promotions.size(), pending[i]) < 0) {
+            promotions.push_back(pending[i]);
+        }
+    }
+    std::reverse(promotions.begin(), promotions.end());
+    pending.clear();
+}
+
+// drop the keys removed since the last epoch seen from the front tier and
+//  from the promotions not yet published
+template <class T, class Policy>
+void FrontCache<T, Policy>::catch_up() {
+    long long current = shared.epoch.load(std::memory_order_relaxed);
+    if (current - seen_epoch > REMOVAL_LOG_SIZE) {
+        front = FlatTree<T>();
+        promotions.clear();
+        seen_epoch = current;
+        return;
+    }
+    for (long long e = seen_epoch; e < current; ++e) {
+        T removed = shared.removal_log[e % REMOVAL_LOG_SIZE];
+        front.remove(removed);
+        int i = find_key(promotions.data(), (int)promotions.size(), removed);
+        if (i >= 0) {
+            promotions.erase(promotions.begin() + i);
+        }
+    }
+    seen_epoch = current;
+}
+
+template <class T, class Policy>
+void FrontCache<T, Policy>::publish() {
+    for (size_t i = 0; i < promotions.size(); ++i) {
+        shared.tree.search(promotions[i]);
+    }
+    promotions.clear();
+}
+
+// make val, present in the shared tree, the most recent key of the front tier
+template <class T, class Policy>
+void FrontCache<T, Policy>::admit(T val) {
+    if (!front.remove(val) && front.size() >= capacity) {
+        front.remove_lru();
+    }
+    front.insert(val);
+}
+
+#endif // FRONTCACHE_H
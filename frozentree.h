@@ -0,0 +1,327 @@
+/*
+ * frozentree.h
+ *
+ * template class for an immutable set of keys built once from a b-tree (see
+ * BTree::freeze()) for lookups only. The keys are stored in one contiguous
+ * array in Eytzinger order: the root at index 1 and the children of index k
+ * at 2k and 2k + 1, so that the first levels of every search share the same
+ * few cache lines. A search descends without a branch on the comparison.
+ * The descendants of slot k as many levels down as a cache line holds keys
+ * (four for int keys) sit next to each other on one line, from slot
+ * k * keys per line, and that line is prefetched at every step.
+ * search_batch runs a group of searches in lockstep so that their cache
+ * misses overlap.
+ *
+ * There are no nodes, recency links or pooled nodes. A frozen tree can be
+ * written to a flat file and mapped back, with the keys used in place from
+ * the mapping, so that processes loading the same file share its pages.
+ *
+ * file format (host byte order): a header of FROZEN_HEADER_SIZE bytes
+ * holding the magic "WSTF", uint32 version, uint32 sizeof(T) and uint64
+ * number of keys n, then the n + 1 slots of the array (slot 0 is unused)
+*/
+
+#ifndef FROZENTREE_H
+#define FROZENTREE_H
+
+#include <cstdint>
+#include <cstring> // for std::memcpy
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <utility> // for std::move
+#include <vector>
+#include "memorystats.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define WST_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const char FROZEN_MAGIC[4] = {'W', 'S', 'T', 'F'};
+const uint32_t FROZEN_VERSION = 1;
+const size_t FROZEN_HEADER_SIZE = 64; // a cache line, so that mapped keys stay aligned
+const int FROZEN_BATCH = 8; // searches run in lockstep by search_batch
+const size_t CACHE_LINE_BYTES = 64;
+
+template <class T>
+class FrozenTree {
+public:
+    FrozenTree() : n(0), mapping(nullptr), mapping_length(0) {
+        keys = allocate_slots();
+    }
+    FrozenTree(const T *sorted_keys, size_t num_keys); // keys in ascending order
+    FrozenTree(FrozenTree &&other);
+    FrozenTree& operator=(FrozenTree &&other);
+    FrozenTree(const FrozenTree&) = delete;
+    FrozenTree& operator=(const FrozenTree&) = delete;
+    ~FrozenTree();
+    bool contains(T val) const;
+    // look up the n values, setting found[i] for values[i]. returns how many
+    //  were found
+    int search_batch(const T *values, int count, bool *found) const;
+    int size() const;
+    MemoryStats memory_stats() const;
+    bool save(const std::string &path) const;
+    bool load(const std::string &path); // false, leaving the tree unchanged, if path is not a valid file
+private:
+    const T *keys; // n + 1 slots in Eytzinger order, slot 0 unused
+    size_t n;
+    std::vector<T> slots; // holds keys, from a cache line boundary, unless they are mapped from a file
+    void *mapping;
+    size_t mapping_length;
+    T* allocate_slots();
+    size_t fill(T *dest, const T *sorted_keys, size_t next, size_t k);
+    size_t lower_bound_slot(size_t k) const;
+    void release();
+};
+
+template <class T>
+FrozenTree<T>::FrozenTree(const T *sorted_keys, size_t num_keys)
+    : n(num_keys), mapping(nullptr), mapping_length(0) {
+    T *dest = allocate_slots();
+    fill(dest, sorted_keys, 0, 1);
+    keys = dest;
+}
+
+template <class T>
+FrozenTree<T>::FrozenTree(FrozenTree &&other)
+    : keys(nullptr), n(0), mapping(nullptr), mapping_length(0) {
+    *this = std::move(other);
+}
+
+template <class T>
+FrozenTree<T>& FrozenTree<T>::operator=(FrozenTree &&other) {
+    if (this != &other) {
+        // swapping the vectors keeps their buffers, so keys stays valid
+        release();
+        n = other.n;
+        slots.swap(other.slots);
+        mapping = other.mapping;
+        mapping_length = other.mapping_length;
+        keys = other.keys;
+        other.mapping = nullptr;
+        other.mapping_length = 0;
+        other.n = 0;
+        other.keys = other.allocate_slots();
+    }
+    return *this;
+}
+
+template <class T>
+FrozenTree<T>::~FrozenTree() {
+    release();
+}
+
+template <class T>
+void FrozenTree<T>::release() {
+#ifdef WST_HAVE_MMAP
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_length);
+    }
+#endif
+    mapping = nullptr;
+    mapping_length = 0;
+}
+
+// size slots for n + 1 keys and return where slot 0 starts: the first cache
+//  line boundary in the vector, when keys divide a cache line
+template <class T>
+T* FrozenTree<T>::allocate_slots() {
+    size_t line_keys = CACHE_LINE_BYTES % sizeof(T) == 0 ? CACHE_LINE_BYTES / sizeof(T) : 1;
+    slots.assign(n + line_keys, T());
+    size_t offset = 0;
+    while (offset + 1 < line_keys && reinterpret_cast<uintptr_t>(slots.data() + offset) % CACHE_LINE_BYTES != 0) {
+        offset++;
+    }
+    return slots.data() + offset;
+}
+
+// an in-order walk of the implicit tree rooted at slot k hands out the
+//  sorted keys in turn. returns the index of the next key to place
+template <class T>
+size_t FrozenTree<T>::fill(T *dest, const T *sorted_keys, size_t next, size_t k) {
+    if (k <= n) {
+        next = fill(dest, sorted_keys, next, 2 * k);
+        dest[k] = sorted_keys[next++];
+        next = fill(dest, sorted_keys, next, 2 * k + 1);
+    }
+    return next;
+}
+
+// the search ends below a leaf at k. the last left turn on the way there,
+//  undone by dropping the trailing ones and one more bit, is the slot of the
+//  smallest key not less than the value, or 0 if there is none
+template <class T>
+size_t FrozenTree<T>::lower_bound_slot(size_t k) const {
+#if defined(__GNUC__)
+    return k >> __builtin_ffsll(~(unsigned long long)k);
+#else
+    while (k & 1) {
+        k >>= 1;
+    }
+    return k >> 1;
+#endif
+}
+
+template <class T>
+bool FrozenTree<T>::contains(T val) const {
+    const size_t line_keys = CACHE_LINE_BYTES % sizeof(T) == 0 ? CACHE_LINE_BYTES / sizeof(T) : 1;
+    size_t k = 1;
+    while (k <= n) {
+#if defined(__GNUC__)
+        __builtin_prefetch(keys + k * line_keys);
+#endif
+        k = 2 * k + (keys[k] < val);
+    }
+    k = lower_bound_slot(k);
+    return k != 0 && keys[k] == val;
+}
+
+// a search that has left the array keeps its slot until the group is done
+template <class T>
+int FrozenTree<T>::search_batch(const T *values, int count, bool *found) const {
+    const size_t line_keys = CACHE_LINE_BYTES % sizeof(T) == 0 ? CACHE_LINE_BYTES / sizeof(T) : 1;
+    int num_found = 0;
+    for (int start = 0; start < count; start += FROZEN_BATCH) {
+        int group = count - start < FROZEN_BATCH ? count - start : FROZEN_BATCH;
+        size_t k[FROZEN_BATCH];
+        for (int j = 0; j < group; ++j) {
+            k[j] = 1;
+        }
+        bool active = n > 0;
+        while (active) {
+            active = false;
+            for (int j = 0; j < group; ++j) {
+                size_t kj = k[j];
+                bool inside = kj <= n;
+#if defined(__GNUC__)
+                __builtin_prefetch(keys + kj * line_keys);
+#endif
+                size_t next = 2 * kj + (keys[inside ? kj : 0] < values[start + j]);
+                k[j] = inside ? next : kj;
+                active |= inside;
+            }
+        }
+        for (int j = 0; j < group; ++j) {
+            size_t slot = lower_bound_slot(k[j]);
+            found[start + j] = slot != 0 && keys[slot] == values[start + j];
+            num_found += found[start + j];
+        }
+    }
+    return num_found;
+}
+
+template <class T>
+int FrozenTree<T>::size() const {
+    return n;
+}
+
+template <class T>
+MemoryStats FrozenTree<T>::memory_stats() const {
+    MemoryStats stats;
+    stats.live_keys = n;
+    stats.live_nodes = n > 0 ? 1 : 0; // the array
+    stats.key_slots = n;
+    stats.allocator_overhead = mapping != nullptr ? 0 : ALLOCATION_OVERHEAD;
+    stats.bytes = sizeof(FrozenTree<T>) + (mapping != nullptr ? mapping_length : slots.capacity() * sizeof(T))
+        + stats.allocator_overhead;
+    return stats;
+}
+
+template <class T>
+bool FrozenTree<T>::save(const std::string &path) const {
+    static_assert(std::is_trivially_copyable<T>::value, "frozen tree files require trivially copyable keys");
+
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open()) {
+        return false;
+    }
+    char header[FROZEN_HEADER_SIZE] = {0};
+    uint32_t version = FROZEN_VERSION;
+    uint32_t key_size = sizeof(T);
+    uint64_t num_keys = n;
+    std::memcpy(header, FROZEN_MAGIC, sizeof(FROZEN_MAGIC));
+    std::memcpy(header + 4, &version, sizeof(version));
+    std::memcpy(header + 8, &key_size, sizeof(key_size));
+    std::memcpy(header + 12, &num_keys, sizeof(num_keys));
+    ofs.write(header, FROZEN_HEADER_SIZE);
+    ofs.write(reinterpret_cast<const char*>(keys), (n + 1) * sizeof(T));
+    return ofs.good();
+}
+
+// the keys are used in place from a read-only shared mapping of the file
+//  where possible, and copied otherwise
+template <class T>
+bool FrozenTree<T>::load(const std::string &path) {
+    static_assert(std::is_trivially_copyable<T>::value, "frozen tree files require trivially copyable keys");
+
+    std::vector<char> buffer;
+    const char *data = nullptr;
+    size_t length = 0;
+    void *mapped = nullptr;
+#ifdef WST_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < FROZEN_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    length = st.st_size;
+    mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    data = static_cast<const char*>(mapped);
+#else
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    buffer.assign((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    data = buffer.data();
+    length = buffer.size();
+#endif
+
+    uint32_t version = 0, key_size = 0;
+    uint64_t num_keys = 0;
+    if (length >= FROZEN_HEADER_SIZE) {
+        std::memcpy(&version, data + 4, sizeof(version));
+        std::memcpy(&key_size, data + 8, sizeof(key_size));
+        std::memcpy(&num_keys, data + 12, sizeof(num_keys));
+    }
+    if (length < FROZEN_HEADER_SIZE || std::memcmp(data, FROZEN_MAGIC, sizeof(FROZEN_MAGIC)) != 0
+            || version != FROZEN_VERSION || key_size != sizeof(T)
+            || (length - FROZEN_HEADER_SIZE) / sizeof(T) < num_keys + 1) {
+#ifdef WST_HAVE_MMAP
+        munmap(mapped, length);
+#endif
+        return false;
+    }
+
+    release();
+    n = num_keys;
+    if (mapped != nullptr && FROZEN_HEADER_SIZE % alignof(T) == 0) {
+        mapping = mapped;
+        mapping_length = length;
+        std::vector<T>().swap(slots);
+        keys = reinterpret_cast<const T*>(data + FROZEN_HEADER_SIZE);
+        return true;
+    }
+    T *dest = allocate_slots();
+    std::memcpy(dest, data + FROZEN_HEADER_SIZE, (n + 1) * sizeof(T));
+    keys = dest;
+#ifdef WST_HAVE_MMAP
+    munmap(mapped, length);
+#endif
+    return true;
+}
+
+#endif // FROZENTREE_H
@@ -0,0 +1,173 @@
+/*
+ * level.h
+ *
+ * the container holding one level of a working set tree. Level<T> is the
+ * interface the working set tree works through, and LevelAdapter wraps any
+ * container providing the following operations (BTree, BPlusTree, FlatTree,
+ * PackedTree and PagedTree do), constructed from whatever arguments the
+ * adapter is given:
+ *
+ *   int insert(T)          insert as the most recently accessed key
+ *   void insert_lru(T)     insert as the least recently accessed key
+ *   bool remove(T)         returns whether the key was found
+ *   T remove_lru(), T remove_mru()
+ *   bool contains(T)       must not change the recency of the key
+ *   int get_height(), int get_max_height(), bool is_empty(), int size()
+ *   std::string to_string(), print_ordered_mru(), print_ordered_tail()
+ *   std::vector<T> keys_by_recency()       from the most recently accessed
+ *   void bulk_load(const T *keys, int n, double fill)  keys from the most
+ *                          recently accessed, with nodes filled to about fill
+ *                          where the container has nodes to fill
+ *   int recency_position(T)
+ *   bool append_by_recency(const T *after, int count, std::vector<T> &out)
+ *                          up to count keys from the one accessed next less
+ *                          recently than *after (from the most recent if
+ *                          after is null), false if *after is absent. must
+ *                          not count node visits: snapshots call it from
+ *                          other threads between writes (see snapshot.h)
+ *   void append_range(T lo, T hi, std::vector<T> &out)  in ascending order
+ *   MemoryStats memory_stats()
+ *   bool needs_compaction(double min_fill)
+ *   void compact(double target_fill)   repack, keeping the recency order
+ *   long long node_visits()            nodes read by operations so far
+ *
+ * remove_range(T lo, T hi, double fill) and remove_batch(const T *keys, int n,
+ * double fill) are built by the adapter from these operations (see
+ * batchops.h), rebuilding with nodes filled to about fill when most keys go,
+ * except that a BTree cuts a range out of its nodes in place (see
+ * BTree::remove_range).
+ *
+ * The working set tree chooses the container of every level by its index
+ * (see flat_levels() in wstpolicy.h, and set_bplus_trees(),
+ * set_packed_storage() and set_paged_storage() in workingsettree.h).
+*/
+
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include <string>
+#include <utility> // for std::forward
+#include <vector>
+#include "batchops.h"
+#include "memorystats.h"
+
+template <class T>
+class Level {
+public:
+    virtual ~Level() {}
+    virtual int insert(T val) = 0;
+    virtual void insert_lru(T val) = 0;
+    virtual bool remove(T val) = 0;
+    // built on the operations above for every container, see batchops.h
+    virtual int remove_range(T lo, T hi, double fill = 1.0) = 0;
+    virtual int remove_batch(const T *keys, int n, double fill = 1.0) = 0;
+    virtual T remove_lru() = 0;
+    virtual T remove_mru() = 0;
+    virtual bool contains(T val) = 0;
+    virtual int get_height() = 0;
+    virtual int get_max_height() = 0;
+    virtual bool is_empty() = 0;
+    virtual int size() = 0;
+    virtual std::string to_string() = 0;
+    virtual std::string print_ordered_mru() = 0;
+    virtual std::string print_ordered_tail() = 0;
+    virtual std::vector<T> keys_by_recency() = 0;
+    virtual void bulk_load(const T *keys, int n, double fill = 1.0) = 0;
+    virtual int recency_position(T val) = 0;
+    virtual bool append_by_recency(const T *after, int count, std::vector<T> &out) = 0;
+    virtual void append_range(T lo, T hi, std::vector<T> &out) = 0;
+    virtual MemoryStats memory_stats() = 0;
+    virtual bool needs_compaction(double min_fill) = 0;
+    virtual void compact(double target_fill) = 0;
+    virtual long long node_visits() = 0;
+};
+
+template <class T, class Container>
+class LevelAdapter : public Level<T> {
+public:
+    template <class... Args>
+    explicit LevelAdapter(Args&&... args) : tree(std::forward<Args>(args)...) {}
+
+    int insert(T val) {
+        return tree.insert(val);
+    }
+    void insert_lru(T val) {
+        tree.insert_lru(val);
+    }
+    bool remove(T val) {
+        return tree.remove(val);
+    }
+    int remove_range(T lo, T hi, double fill = 1.0) {
+        return remove_range_of(tree, lo, hi, fill);
+    }
+    int remove_batch(const T *keys, int n, double fill = 1.0) {
+        return remove_batch_of(tree, keys, n, fill);
+    }
+    T remove_lru() {
+        return tree.remove_lru();
+    }
+    T remove_mru() {
+        return tree.remove_mru();
+    }
+    bool contains(T val) {
+        return tree.contains(val);
+    }
+    int get_height() {
+        return tree.get_height();
+    }
+    int get_max_height() {
+        return tree.get_max_height();
+    }
+    bool is_empty() {
+        return tree.is_empty();
+    }
+    int size() {
+        return tree.size();
+    }
+    std::string to_string() {
+        return tree.to_string();
+    }
+    std::string print_ordered_mru() {
+        return tree.print_ordered_mru();
+    }
+    std::string print_ordered_tail() {
+        return tree.print_ordered_tail();
+    }
+    std::vector<T> keys_by_recency() {
+        return tree.keys_by_recency();
+    }
+    void bulk_load(const T *keys, int n, double fill = 1.0) {
+        tree.bulk_load(keys, n, fill);
+    }
+    int recency_position(T val) {
+        return tree.recency_position(val);
+    }
+    bool append_by_recency(const T *after, int count, std::vector<T> &out) {
+        return tree.append_by_recency(after, count, out);
+    }
+    void append_range(T lo, T hi, std::vector<T> &out) {
+        tree.append_range(lo, hi, out);
+    }
+    MemoryStats memory_stats() {
+        MemoryStats stats = tree.memory_stats();
+        stats.bytes += sizeof(LevelAdapter<T, Container>) - sizeof(Container) + ALLOCATION_OVERHEAD;
+        stats.allocator_overhead += ALLOCATION_OVERHEAD;
+        return stats;
+    }
+    bool needs_compaction(double min_fill) {
+        return tree.needs_compaction(min_fill);
+    }
+    void compact(double target_fill) {
+        tree.compact(target_fill);
+    }
+    long long node_visits() {
+        return tree.node_visits();
+    }
+    Container& container() {
+        return tree;
+    }
+private:
+    Container tree;
+};
+
+#endif // LEVEL_H
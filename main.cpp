@@ -1,5 +1,8 @@
 #include <QCoreApplication>
 
+#include <algorithm> // for std::max, std::max_element, std::minmax_element, std::nth_element
+#include <chrono>
+#include <cmath> // for std::pow
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -7,10 +10,52 @@
 #include "node.h"
 #include "btree.h"
 #include "workingsettree.h"
+#include "mrcsimulator.h"
+#include "baselines.h"
+#include "workload.h"
+#include "workingsetbound.h"
+#include "frontcache.h"
+#include "perfcounters.h"
+#include "replay.h"
 #include <time.h>
 using namespace std;
 
-int insert_file_wst(std::string filename, WorkingSetTree<int> &wst) {
+// hardware counters around the phases of time_btree_ms and time_wst_ms, only
+//  when main is given --perf. print_phase reports the counts of the last
+//  phase per operation
+PerfCounters *phase_counters = nullptr;
+
+void begin_phase() {
+    if (phase_counters != nullptr) {
+        phase_counters->start();
+    }
+}
+
+void end_phase() {
+    if (phase_counters != nullptr) {
+        phase_counters->stop();
+    }
+}
+
+void print_phase(long long ops) {
+    if (phase_counters != nullptr) {
+        cout << phase_counters->report(ops) << endl;
+    }
+}
+
+// number of keys in a data file, one per line
+int count_file_keys(std::string filename) {
+    std::ifstream ifs(filename);
+    std::string line;
+    int n = 0;
+    while (getline(ifs, line)) {
+        n++;
+    }
+    return n;
+}
+
+template <class Policy>
+int insert_file_wst(std::string filename, WorkingSetTree<int, Policy> &wst) {
     std::ifstream ifs;
     ifs.open(filename);
 
@@ -30,7 +75,8 @@ int insert_file_wst(std::string filename, WorkingSetTree<int> &wst) {
     return 0;
 }
 
-int search_file_wst(std::string filename, WorkingSetTree<int> &wst) {
+template <class Policy>
+int search_file_wst(std::string filename, WorkingSetTree<int, Policy> &wst) {
     std::ifstream ifs;
     ifs.open(filename);
 
@@ -320,45 +366,70 @@ void time_btree_ms(std::string tree_file, std::string insert_file, std::string s
 
     BTree<int> btree;
 
+    begin_phase();
     t = clock();
     insert_file_btree(tree_file, btree);
     t = clock() - t;
+    end_phase();
     cout << "Time taken to insert 500,000 elements into b-tree: " << t << endl;
+    print_phase(btree.size());
 //    cout << "time: " << t << " miliseconds" << endl;
     cout << CLOCKS_PER_SEC << " clocks per second" << endl;
     cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
     cout << "btree size: " << btree.size() << endl;
+    cout << "btree memory: " << memory_stats_to_string(btree.memory_stats()) << endl;
     //string file_string = "data\\unique\\unique";
 
 
     // searching
+    begin_phase();
     t = clock();
     search_file_btree(search_file, btree);
     t = clock() - t;
+    end_phase();
 
     cout << "Time taken to search 50,000 elements in b-tree: " << t << endl;
+    print_phase(count_file_keys(search_file));
 //    cout << "time: " << t << " miliseconds" << endl;
     cout << CLOCKS_PER_SEC << " clocks per second" << endl;
     cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
 
 
     // deleting
+    begin_phase();
     t = clock();
     delete_file_btree(delete_file, btree);
     t = clock() - t;
+    end_phase();
 
     cout << "Time taken to delete 50,000 elements in b-tree: " << t << endl;
+    print_phase(count_file_keys(delete_file));
 //    cout << "time: " << t << " miliseconds" << endl;
     cout << CLOCKS_PER_SEC << " clocks per second" << endl;
     cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
 
+    // compacting
+    if (btree.needs_compaction()) {
+        cout << "btree memory before compaction: " << memory_stats_to_string(btree.memory_stats()) << endl;
+        t = clock();
+        btree.compact();
+        t = clock() - t;
+        cout << "Time taken to compact b-tree: " << t << endl;
+        cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
+        cout << "btree memory after compaction: " << memory_stats_to_string(btree.memory_stats()) << endl;
+    }
+
 
     // inserting
+    int size_before = btree.size();
+    begin_phase();
     t = clock();
     insert_file_btree(insert_file, btree);
     t = clock() - t;
+    end_phase();
 
     cout << "Time taken to insert 50,000 elements into the b-tree: " << t << endl;
+    print_phase(btree.size() - size_before);
 //    cout << "time: " << t << " miliseconds" << endl;
     cout << CLOCKS_PER_SEC << " clocks per second" << endl;
     cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
@@ -391,39 +462,769 @@ void time_wst_sec(std::string tree_file, std::string search_file) {
 
 }
 
+template <class Policy>
 void time_wst_ms(std::string tree_file, std::string search_file) {
 
     clock_t t;
 
-    WorkingSetTree<int> wst;
+    WorkingSetTree<int, Policy> wst;
 
+    begin_phase();
     t = clock();
     insert_file_wst(tree_file, wst);
     t = clock() - t;
+    end_phase();
     cout << "Time taken to insert 500,000 elements: " << t << endl;
+    print_phase(wst.size());
     cout << "insert completed. size: " << wst.size() << endl;
+    std::vector<MemoryStats> tree_stats = wst.tree_memory_stats();
+    for (size_t i = 0; i < tree_stats.size(); ++i) {
+        cout << "tree " << i << " memory: " << memory_stats_to_string(tree_stats[i]) << endl;
+    }
+    cout << "total memory: " << memory_stats_to_string(wst.memory_stats()) << endl;
 //    cout << "time: " << t << " miliseconds" << endl;
     cout << CLOCKS_PER_SEC << " clocks per second" << endl;
     cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
 
 
 
+    begin_phase();
     t = clock(); // get current time; same as: now = time(NULL)
                  //search_file("data\\p1_p99_500", wst);
     search_file_wst(search_file, wst);
     t = clock() - t;
+    end_phase();
 
     //cout << "Time taken to search 500,000 elements: " << seconds << endl;
     cout << "Time taken to search 50,000 elements: " << t << endl;
+    print_phase(count_file_keys(search_file));
 //    cout << "time: " << t << " miliseconds" << endl;
     cout << CLOCKS_PER_SEC << " clocks per second" << endl;
     cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
 
 }
 
+std::vector<int> read_file_keys(std::string filename) {
+    std::vector<int> keys;
+    std::ifstream ifs;
+    ifs.open(filename);
+    if (!ifs.is_open()) {
+        std::cout << filename << " cannot be opened for reading." << std::endl;
+        return keys;
+    }
+    std::string line;
+    while (getline(ifs, line)) {
+        keys.push_back(stoi(line));
+    }
+    return keys;
+}
+
+// bytes per key and lookup throughput of a b-tree and a packed tree holding
+//  the same keys, both compacted to full nodes
+template <class Container>
+void time_lookups_ms(std::string name, Container &tree, const std::vector<int> &tree_keys, const std::vector<int> &search_keys) {
+
+    clock_t t;
+
+    for (size_t i = 0; i < tree_keys.size(); ++i) {
+        tree.insert(tree_keys[i]);
+    }
+    tree.compact(1.0);
+    cout << name << " memory: " << memory_stats_to_string(tree.memory_stats()) << endl;
+
+    int found = 0;
+    t = clock();
+    for (size_t i = 0; i < search_keys.size(); ++i) {
+        found += tree.contains(search_keys[i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to look up " << search_keys.size() << " elements in " << name << ": " << t
+         << " (" << found << " found, " << search_keys.size() / (t * 1.0 / CLOCKS_PER_SEC) << " lookups per second)" << endl;
+
+}
+
+void time_packed_ms(std::string tree_file, std::string search_file) {
+
+    std::vector<int> tree_keys = read_file_keys(tree_file);
+    std::vector<int> search_keys = read_file_keys(search_file);
+
+    BTree<int> btree;
+    time_lookups_ms("b-tree", btree, tree_keys, search_keys);
+
+    PackedTree<int> packed;
+    time_lookups_ms("packed tree", packed, tree_keys, search_keys);
+
+}
+
+// lookups in a b-tree against its frozen copy (see frozentree.h), one at a
+//  time and in batches, repeating the search keys rounds times
+void time_frozen_ms(std::string tree_file, std::string search_file, int rounds) {
+
+    std::vector<int> tree_keys = read_file_keys(tree_file);
+    std::vector<int> search_keys = read_file_keys(search_file);
+    long long lookups = (long long)search_keys.size() * rounds;
+
+    BTree<int> btree;
+    for (size_t i = 0; i < tree_keys.size(); ++i) {
+        btree.insert(tree_keys[i]);
+    }
+    clock_t t = clock();
+    FrozenTree<int> frozen = btree.freeze();
+    t = clock() - t;
+    cout << "Time taken to freeze " << frozen.size() << " elements: " << t << endl;
+    cout << "b-tree memory: " << memory_stats_to_string(btree.memory_stats()) << endl;
+    cout << "frozen tree memory: " << memory_stats_to_string(frozen.memory_stats()) << endl;
+
+    long long found = 0;
+    t = clock();
+    for (int r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < search_keys.size(); ++i) {
+            found += btree.contains(search_keys[i]);
+        }
+    }
+    t = clock() - t;
+    cout << "Time taken to look up " << lookups << " elements in b-tree: " << t << " (" << found << " found)" << endl;
+
+    found = 0;
+    t = clock();
+    for (int r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < search_keys.size(); ++i) {
+            found += frozen.contains(search_keys[i]);
+        }
+    }
+    t = clock() - t;
+    cout << "Time taken to look up " << lookups << " elements in frozen tree: " << t << " (" << found << " found)" << endl;
+
+    found = 0;
+    std::unique_ptr<bool[]> hits(new bool[search_keys.size()]);
+    t = clock();
+    for (int r = 0; r < rounds; ++r) {
+        found += frozen.search_batch(search_keys.data(), search_keys.size(), hits.get());
+    }
+    t = clock() - t;
+    cout << "Time taken to look up " << lookups << " elements in frozen tree in batches: " << t << " (" << found << " found)" << endl;
+
+}
+
+// insert, look up, scan ranges of about 100 keys starting at the search keys,
+//  then delete, timing each phase
+template <class Container>
+void time_layout_ms(std::string name, Container &tree, const std::vector<int> &tree_keys,
+                    const std::vector<int> &search_keys, const std::vector<int> &delete_keys) {
+
+    clock_t t;
+
+    t = clock();
+    for (size_t i = 0; i < tree_keys.size(); ++i) {
+        tree.insert(tree_keys[i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to insert " << tree_keys.size() << " elements into " << name << ": " << t << endl;
+
+    t = clock();
+    for (size_t i = 0; i < search_keys.size(); ++i) {
+        tree.contains(search_keys[i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to look up " << search_keys.size() << " elements in " << name << ": " << t << endl;
+
+    std::pair<std::vector<int>::const_iterator, std::vector<int>::const_iterator> bounds =
+            std::minmax_element(tree_keys.begin(), tree_keys.end());
+    long long width = tree_keys.empty() ? 0 : ((long long)*bounds.second - *bounds.first) / tree_keys.size() * 100;
+    std::vector<int> out;
+    size_t scanned = 0;
+    t = clock();
+    for (size_t i = 0; i < search_keys.size(); ++i) {
+        out.clear();
+        tree.append_range(search_keys[i], (int)std::min<long long>(INT_MAX, search_keys[i] + width), out);
+        scanned += out.size();
+    }
+    t = clock() - t;
+    cout << "Time taken to scan " << search_keys.size() << " ranges (" << scanned << " keys) in " << name << ": " << t << endl;
+
+    t = clock();
+    for (size_t i = 0; i < delete_keys.size(); ++i) {
+        tree.remove(delete_keys[i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to delete " << delete_keys.size() << " elements from " << name << ": " << t << endl;
+    cout << name << " memory: " << memory_stats_to_string(tree.memory_stats()) << endl;
+
+}
+
+void time_bplus_ms(std::string tree_file, std::string search_file, std::string delete_file) {
+
+    std::vector<int> tree_keys = read_file_keys(tree_file);
+    std::vector<int> search_keys = read_file_keys(search_file);
+    std::vector<int> delete_keys = read_file_keys(delete_file);
+
+    BTree<int> btree;
+    time_layout_ms("b-tree", btree, tree_keys, search_keys, delete_keys);
+
+    BPlusTree<int> bplus;
+    time_layout_ms("b+-tree", bplus, tree_keys, search_keys, delete_keys);
+
+}
+
+// miss ratio curve of a trace in one pass, sampling keys on every core (see
+//  mrcsimulator.h). the tree boundaries are those of the default policy
+void print_mrc(std::string trace_file, double sample_rate) {
+
+    clock_t t;
+
+    MrcOptions options;
+    options.sample_rate = sample_rate;
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    t = clock();
+    MrcResult result = simulate_mrc(trace_file, DynamicPolicy(), options);
+    t = clock() - t;
+    if (result.accesses == 0) {
+        cout << trace_file << " cannot be opened for reading." << endl;
+        return;
+    }
+    cout << result.to_string();
+    cout << "Time taken to simulate " << result.accesses << " accesses on " << options.threads << " threads: " << t << endl;
+
+}
+
+// whether the level sizes the simulator assumes are those of a real tree
+//  filled by distinct inserts. the first two levels are compared, averaged
+//  once the third is in use; deeper degree 2 trees hold well under
+//  load_keys, their sparse nodes compounding over the height
+void check_mrc_level_keys() {
+
+    int degrees[] = {2, 3, 8};
+    for (int d = 0; d < 3; ++d) {
+        DynamicPolicy policy(degrees[d]);
+        WorkingSetTree<int> tree(policy);
+        std::vector<long long> simulated = mrc_level_keys(policy, 1LL << 30);
+        int inserts = (int)std::min(20 * simulated[1], 1LL << 22);
+        double held[2] = {0, 0};
+        long long samples = 0;
+        for (int i = 0; i < inserts; ++i) {
+            tree.insert((int)(i * 2654435761u % 1000000007));
+            if (i >= inserts / 2) {
+                std::vector<int> sizes = tree.tree_sizes();
+                held[0] += sizes[0];
+                held[1] += sizes[0] + sizes[1];
+                ++samples;
+            }
+        }
+        bool close = true;
+        for (int level = 0; level < 2; ++level) {
+            double ratio = simulated[level] / (held[level] / samples);
+            close = close && ratio < 2 && ratio > 0.5;
+        }
+        cout << "Simulated level sizes at degree " << degrees[d] << ": " << simulated[0] << ", " << simulated[1]
+             << (close ? " match" : " DIFFER FROM") << " the real " << (long long)(held[0] / samples)
+             << ", " << (long long)(held[1] / samples) << endl;
+    }
+
+}
+
+template <class Container>
+void apply_workload_op(Container &tree, const WorkloadOp &op) {
+    switch (op.type) {
+    case WORKLOAD_INSERT:
+        tree.insert(op.key);
+        break;
+    case WORKLOAD_SEARCH:
+        tree.search(op.key);
+        break;
+    case WORKLOAD_REMOVE:
+        tree.remove(op.key);
+        break;
+    }
+}
+
+// replay a workload on two new containers: one untimed per operation for the
+//  throughput, one timing every operation for the latency percentiles (which
+//  include the cost of reading the clock). prints a line of
+//  name,ops_per_sec,p50_ns,p99_ns,p999_ns,bytes_per_key,visits_per_op
+template <class Container>
+void compare_on_workload(std::string name, const Workload &workload) {
+
+    typedef std::chrono::steady_clock clock_type;
+    size_t num_ops = workload.ops.size();
+    double seconds;
+    {
+        Container tree;
+        for (size_t i = 0; i < workload.initial_keys.size(); ++i) {
+            tree.insert(workload.initial_keys[i]);
+        }
+        clock_type::time_point start = clock_type::now();
+        for (size_t i = 0; i < num_ops; ++i) {
+            apply_workload_op(tree, workload.ops[i]);
+        }
+        seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    }
+
+    Container tree;
+    for (size_t i = 0; i < workload.initial_keys.size(); ++i) {
+        tree.insert(workload.initial_keys[i]);
+    }
+    long long visits = tree.node_visits();
+    std::vector<long long> latencies(num_ops);
+    for (size_t i = 0; i < num_ops; ++i) {
+        clock_type::time_point start = clock_type::now();
+        apply_workload_op(tree, workload.ops[i]);
+        latencies[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+    }
+    visits = visits < 0 ? -1 : tree.node_visits() - visits;
+
+    double percentiles[] = {0.5, 0.99, 0.999};
+    std::string row = name + "," + std::to_string(seconds > 0 ? num_ops / seconds : 0.0);
+    for (int p = 0; p < 3; ++p) {
+        if (num_ops == 0) {
+            row += ",0";
+            continue;
+        }
+        std::vector<long long>::iterator nth = latencies.begin() + (size_t)(percentiles[p] * (num_ops - 1));
+        std::nth_element(latencies.begin(), nth, latencies.end());
+        row += "," + std::to_string(*nth);
+    }
+    row += "," + std::to_string(tree.memory_stats().bytes_per_key());
+    row += visits < 0 || num_ops == 0 ? ",n/a" : "," + std::to_string(visits * 1.0 / num_ops);
+    cout << row << endl;
+
+}
+
+// the working set tree side by side with a b-tree and the baselines of
+//  baselines.h on one workload
+void compare_baselines(const Workload &workload) {
+
+    cout << workload.name << ": " << workload.initial_keys.size() << " keys, " << workload.ops.size() << " operations" << endl;
+    cout << "structure,ops_per_sec,p50_ns,p99_ns,p999_ns,bytes_per_key,visits_per_op" << endl;
+    compare_on_workload<WorkingSetTree<int> >("working set tree", workload);
+    compare_on_workload<BTree<int> >("b-tree", workload);
+    compare_on_workload<SplayTree<int> >("splay tree", workload);
+    compare_on_workload<SetBaseline<int> >("std::set", workload);
+    compare_on_workload<LruBaseline<int> >("hash map + lru list", workload);
+
+}
+
+// searches of a workload split between threads, each search going to one
+//  working set tree shared by all threads, or through a front cache of the
+//  searching thread (see frontcache.h). prints a line of
+//  threads,shared_ops_per_sec,front_cache_ops_per_sec,front_hit_rate
+void compare_front_cache(const Workload &workload, int threads) {
+
+    std::vector<int> search_keys;
+    for (size_t i = 0; i < workload.ops.size(); ++i) {
+        if (workload.ops[i].type == WORKLOAD_SEARCH) {
+            search_keys.push_back(workload.ops[i].key);
+        }
+    }
+
+    double ops_per_sec[2];
+    std::atomic<long long> front_hits(0);
+    for (int with_front = 0; with_front < 2; ++with_front) {
+        WorkingSetTree<int> wst;
+        for (size_t i = 0; i < workload.initial_keys.size(); ++i) {
+            wst.insert(workload.initial_keys[i]);
+        }
+        SharedWorkingSetTree<int> shared(wst);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int w = 0; w < threads; ++w) {
+            workers.push_back(std::thread([&, w] {
+                if (with_front) {
+                    FrontCache<int> front(shared);
+                    for (size_t i = w; i < search_keys.size(); i += threads) {
+                        front.search(search_keys[i]);
+                    }
+                    front_hits += front.hits();
+                }
+                else {
+                    for (size_t i = w; i < search_keys.size(); i += threads) {
+                        shared.search(search_keys[i]);
+                    }
+                }
+            }));
+        }
+        for (int w = 0; w < threads; ++w) {
+            workers[w].join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ops_per_sec[with_front] = seconds > 0 ? search_keys.size() / seconds : 0.0;
+    }
+
+    cout << threads << "," << ops_per_sec[0] << "," << ops_per_sec[1] << ","
+         << (search_keys.empty() ? 0.0 : front_hits * 1.0 / search_keys.size()) << endl;
+
+}
+
+// cost of every search against log2 of its working set number (see
+//  workingsetbound.h), for a working set tree of the given shape
+void print_working_set_bound(const Workload &workload, int min_degree, int scale_factor) {
+
+    clock_t t;
+
+    WorkingSetTree<int> wst(min_degree, scale_factor);
+    t = clock();
+    WorkingSetBoundReport report = verify_working_set_bound(wst, workload);
+    t = clock() - t;
+    cout << workload.name << ", min degree " << min_degree << ", scale factor " << scale_factor << endl;
+    cout << report.to_string();
+    cout << "Time taken to replay " << workload.ops.size() << " operations: " << t << endl;
+
+}
+
+#ifdef WST_HAVE_PAGED_STORAGE
+// search with the trees from first_paged_level on moved to paged storage whose
+//  buffer pool holds the given fraction of each tree's pages
+void time_wst_paged_ms(std::string tree_file, std::string search_file, std::string page_directory,
+                       int first_paged_level, double pool_fraction) {
+
+    clock_t t;
+
+    WorkingSetTree<int> wst(DynamicPolicy(DEFAULT_MIN_DEGREE, DEFAULT_SCALE_FACTOR, DEFAULT_BASE_HEIGHT,
+                                          KEY_COUNT_BOUNDARIES, DEFAULT_BASE_CAPACITY));
+    insert_file_wst(tree_file, wst);
+
+    std::vector<int> sizes = wst.tree_sizes();
+    int largest = 0;
+    for (size_t i = first_paged_level; i < sizes.size(); ++i) {
+        largest = std::max(largest, sizes[i]);
+    }
+    int pool_pages = (int)(PagedTree<int>::estimated_pages(largest) * pool_fraction);
+
+    t = clock();
+    if (!wst.set_paged_storage(first_paged_level, page_directory, pool_pages)) {
+        cout << page_directory << " cannot hold paged storage." << endl;
+        return;
+    }
+    t = clock() - t;
+    cout << "pool of " << pool_pages << " pages (" << pool_fraction * 100 << "% of the largest paged tree)" << endl;
+    cout << "Time taken to move trees " << first_paged_level << "+ to paged storage: " << t << endl;
+    cout << "total memory: " << memory_stats_to_string(wst.memory_stats()) << endl;
+
+    t = clock();
+    search_file_wst(search_file, wst);
+    t = clock() - t;
+    cout << "Time taken to search 50,000 elements: " << t << endl;
+    cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
+    if (wst.paged_storage_failed()) {
+        cout << "paged storage failed to write, keeping pages in memory" << endl;
+    }
+
+}
+#endif
+
+// insertion of every key against building the trees from the whole dump at
+//  once, on one thread and on every core
+void time_wst_build_ms(std::string tree_file) {
+
+    std::vector<int> keys = read_file_keys(tree_file);
+
+    WorkingSetTree<int> inserted;
+    clock_t t = clock();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        inserted.insert(keys[i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to insert " << keys.size() << " elements: " << t << endl;
+
+    // the inserts that follow a build should shift about as many keys as on
+    //  the tree built by insertion, rather than spill an overfull tree
+    const int next_inserts = 1000;
+    int next_key = keys.empty() ? 0 : *std::max_element(keys.begin(), keys.end()) + 1;
+    long long shifted = inserted.shifted_keys();
+    for (int k = 0; k < next_inserts; ++k) {
+        inserted.insert(next_key + k);
+    }
+    cout << "Keys shifted by the next " << next_inserts << " inserts: " << inserted.shifted_keys() - shifted << endl;
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    int thread_counts[] = {1, (int)cores};
+    for (int i = 0; i < 2; ++i) {
+        WorkingSetTree<int> built;
+        // clock() adds up the time of every thread, so wall time is measured
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        built.build(keys.data(), keys.size(), thread_counts[i]);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        cout << "Time taken to build from " << keys.size() << " elements on " << thread_counts[i] << " threads: "
+             << ms << " ms" << endl;
+        shifted = built.shifted_keys();
+        for (int k = 0; k < next_inserts; ++k) {
+            built.insert(next_key + k);
+        }
+        cout << "Keys shifted by the next " << next_inserts << " inserts after building: "
+             << built.shifted_keys() - shifted << endl;
+    }
+
+}
+
+// insertion of every key against insertion in batches of the sizes the
+//  ingestion path admits
+void time_wst_batch_ms(std::string tree_file) {
+
+    std::vector<int> keys = read_file_keys(tree_file);
+
+    WorkingSetTree<int> inserted;
+    clock_t t = clock();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        inserted.insert(keys[i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to insert " << keys.size() << " elements one by one: " << t << endl;
+
+    size_t batch_sizes[] = {1000, 10000};
+    for (int i = 0; i < 2; ++i) {
+        WorkingSetTree<int> batched;
+        t = clock();
+        for (size_t start = 0; start < keys.size(); start += batch_sizes[i]) {
+            batched.insert_batch(keys.data() + start, std::min(batch_sizes[i], keys.size() - start));
+        }
+        t = clock() - t;
+        cout << "Time taken to insert " << keys.size() << " elements in batches of " << batch_sizes[i] << ": " << t
+             << " (" << batched.shifted_keys() << " keys shifted against " << inserted.shifted_keys() << ")" << endl;
+    }
+
+}
+
+// invalidation of a contiguous range of range_size keys and of the keys of
+//  delete_file, one key at a time against remove_range and remove_batch
+void time_bulk_delete_ms(std::string tree_file, std::string delete_file, int range_size) {
+
+    std::vector<int> keys = read_file_keys(tree_file);
+    std::vector<int> delete_keys = read_file_keys(delete_file);
+    std::vector<int> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    if (sorted.empty()) {
+        return;
+    }
+    range_size = std::min<int>(range_size, sorted.size());
+    int lo = sorted[(sorted.size() - range_size) / 2];
+    int hi = sorted[(sorted.size() - range_size) / 2 + range_size - 1];
+
+    WorkingSetTree<int> one_by_one, bulk;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        one_by_one.insert(keys[i]);
+        bulk.insert(keys[i]);
+    }
+
+    clock_t t = clock();
+    for (int i = 0; i < range_size; ++i) {
+        one_by_one.remove(sorted[(sorted.size() - range_size) / 2 + i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to delete " << range_size << " contiguous elements one by one: " << t << endl;
+    t = clock();
+    int removed = bulk.remove_range(lo, hi);
+    t = clock() - t;
+    cout << "Time taken to delete " << removed << " contiguous elements with remove_range: " << t << endl;
+
+    t = clock();
+    for (size_t i = 0; i < delete_keys.size(); ++i) {
+        one_by_one.remove(delete_keys[i]);
+    }
+    t = clock() - t;
+    cout << "Time taken to delete " << delete_keys.size() << " elements one by one: " << t << endl;
+    t = clock();
+    removed = bulk.remove_batch(delete_keys.data(), delete_keys.size());
+    t = clock() - t;
+    cout << "Time taken to delete " << delete_keys.size() << " elements with remove_batch (" << removed
+         << " found): " << t << endl;
+
+    // under key count boundaries a tree holds a fixed number of keys, so
+    //  removing in bulk must leave every tree as full as removing one by one
+    DynamicPolicy by_count(DEFAULT_MIN_DEGREE, DEFAULT_SCALE_FACTOR, DEFAULT_BASE_HEIGHT,
+                           KEY_COUNT_BOUNDARIES, DEFAULT_BASE_CAPACITY);
+    WorkingSetTree<int> counted_one_by_one(by_count), counted_bulk(by_count);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        counted_one_by_one.insert(keys[i]);
+        counted_bulk.insert(keys[i]);
+    }
+    for (int i = 0; i < range_size; ++i) {
+        counted_one_by_one.remove(sorted[(sorted.size() - range_size) / 2 + i]);
+    }
+    counted_bulk.remove_range(lo, hi);
+    for (size_t i = 0; i < delete_keys.size(); ++i) {
+        counted_one_by_one.remove(delete_keys[i]);
+    }
+    counted_bulk.remove_batch(delete_keys.data(), delete_keys.size());
+    cout << "Tree sizes after bulk deletes "
+         << (counted_bulk.tree_sizes() == counted_one_by_one.tree_sizes() ? "match" : "DIFFER FROM")
+         << " deleting one by one under key count boundaries" << endl;
+
+}
+
+// searches alternating between phases of uniform access, as in batch hours,
+//  and Zipf access, as in interactive hours, on a tree of the default shape
+//  and on one tuning itself (see autotune.h). prints a line of
+//  phase,distribution,fixed_ms,tuned_ms,scale_factor,base_height per phase
+void compare_auto_tuning(int phases, int phase_ops) {
+
+    WorkloadOptions options;
+    options.operations = phase_ops;
+    options.update_fraction = 0.0; // the same keys throughout
+    Workload uniform = generate_workload(UNIFORM_ACCESS, options);
+    Workload zipf = generate_workload(ZIPF_ACCESS, options);
+
+    WorkingSetTree<int> fixed, tuned;
+    tuned.set_auto_tuning(true);
+    for (size_t i = 0; i < uniform.initial_keys.size(); ++i) {
+        fixed.insert(uniform.initial_keys[i]);
+        tuned.insert(uniform.initial_keys[i]);
+    }
+
+    cout << "phase,distribution,fixed_ms,tuned_ms,scale_factor,base_height" << endl;
+    for (int p = 0; p < phases; ++p) {
+        const Workload &phase = p % 2 == 0 ? uniform : zipf;
+        clock_t t = clock();
+        for (size_t i = 0; i < phase.ops.size(); ++i) {
+            fixed.search(phase.ops[i].key);
+        }
+        double fixed_ms = (clock() - t) * 1000.0 / CLOCKS_PER_SEC;
+        t = clock();
+        for (size_t i = 0; i < phase.ops.size(); ++i) {
+            tuned.search(phase.ops[i].key);
+        }
+        double tuned_ms = (clock() - t) * 1000.0 / CLOCKS_PER_SEC;
+        cout << p << "," << phase.name << "," << fixed_ms << "," << tuned_ms << ","
+             << tuned.get_policy().scale_factor() << "," << tuned.get_policy().base_height() << endl;
+    }
+
+}
+
+// the searches of search_file replayed one line at a time on one thread,
+//  against the pipelined replay of replay.h on shards trees, each holding the
+//  keys of tree_file of its shard. times are wall clock, since the pipeline
+//  runs on several threads
+void time_replay_ms(std::string tree_file, std::string search_file, int shards) {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    WorkingSetTree<int> wst;
+    insert_file_wst(tree_file, wst);
+    clock_type::time_point start = clock_type::now();
+    search_file_wst(search_file, wst);
+    double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    cout << "Time taken to replay " << search_file << " line by line: " << seconds * 1000.0 << " ms" << endl;
+
+    std::vector<WorkingSetTree<int>*> trees;
+    for (int s = 0; s < shards; ++s) {
+        trees.push_back(new WorkingSetTree<int>());
+    }
+    ReplayStats inserted = replay_pipelined(tree_file, trees, [](WorkingSetTree<int> &tree, int key) { tree.insert(key); });
+    if (inserted.bytes < 0) {
+        cout << tree_file << " cannot be opened for reading." << endl;
+    }
+    ReplayStats searched = replay_pipelined(search_file, trees, [](WorkingSetTree<int> &tree, int key) { tree.search(key); });
+    if (searched.bytes < 0) {
+        cout << search_file << " cannot be opened for reading." << endl;
+    }
+    cout << "Time taken to replay " << search_file << " pipelined on " << shards << " shards: "
+         << searched.seconds * 1000.0 << " ms" << endl;
+    cout << searched.to_string();
+    for (int s = 0; s < shards; ++s) {
+        delete trees[s];
+    }
+
+}
+
+// a cache of objects of 100 B to 1 MB under a cap on their total size. every
+//  search of a Zipf workload that misses inserts its key with the size of
+//  its object, as a cache filling itself would; removed keys leave the
+//  cache. prints the hit ratio, the keys evicted and the most bytes held
+void time_weighted_cache_ms(long long cap_bytes) {
+
+    WorkloadOptions options;
+    options.initial_keys = 200000;
+    Workload zipf = generate_workload(ZIPF_ACCESS, options);
+
+    WorkingSetTree<int> cache;
+    cache.set_weight_boundaries(64 << 10, cap_bytes);
+    cache.collect_evictions(true);
+    long long hits = 0, searches = 0, evicted = 0, most_bytes = 0;
+    clock_t t = clock();
+    for (size_t i = 0; i < zipf.ops.size(); ++i) {
+        const WorkloadOp &op = zipf.ops[i];
+        if (op.type == WORKLOAD_REMOVE) {
+            cache.remove(op.key);
+        }
+        else if (op.type == WORKLOAD_SEARCH) {
+            searches++;
+            if (cache.search(op.key)) {
+                hits++;
+                continue;
+            }
+            // log-uniform over [100, 1M] bytes, fixed per key
+            double unit = (mrc_hash((uint64_t)op.key) >> 11) * (1.0 / (1ULL << 53));
+            cache.insert(op.key, (long long)(100.0 * std::pow(10000.0, unit)));
+            evicted += cache.take_evictions().size();
+            most_bytes = std::max(most_bytes, cache.total_weight());
+        }
+    }
+    t = clock() - t;
+    cout << "Time taken to replay " << zipf.ops.size() << " operations on a cache capped at " << cap_bytes
+         << " bytes: " << t << endl;
+    cout << "hit ratio: " << (searches > 0 ? hits * 1.0 / searches : 0.0) << ", keys held: " << cache.size()
+         << ", keys evicted: " << evicted << ", most bytes held: " << most_bytes << endl;
+    std::vector<long long> tree_bytes = cache.tree_weights();
+    for (size_t i = 0; i < tree_bytes.size(); ++i) {
+        cout << "tree " << i << " bytes: " << tree_bytes[i] << endl;
+    }
+
+}
+
+void time_wst_snapshot_ms(std::string tree_file, std::string snapshot_file) {
+
+    clock_t t;
+
+    WorkingSetTree<int> wst;
+    insert_file_wst(tree_file, wst);
+
+    t = clock();
+    if (!wst.save(snapshot_file)) {
+        cout << snapshot_file << " cannot be opened for writing." << endl;
+        return;
+    }
+    t = clock() - t;
+    cout << "Time taken to save snapshot of " << wst.size() << " elements: " << t << endl;
+    cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
+
+    WorkingSetTree<int> restored;
+
+    t = clock();
+    if (!restored.load(snapshot_file)) {
+        cout << snapshot_file << " is not a valid snapshot." << endl;
+        return;
+    }
+    t = clock() - t;
+    cout << "Time taken to load snapshot of " << restored.size() << " elements: " << t << endl;
+    cout << "time: " << t*1.0 / CLOCKS_PER_SEC << " seconds" << endl;
+
+}
+
+// whether main was given flag, or --all for every benchmark after the
+//  baseline b-tree and working set tree runs
+bool has_flag(int argc, char *argv[], const std::string &flag) {
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == flag || (flag != "--perf" && std::string(argv[i]) == "--all")) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int main(int argc, char *argv[])
 {
 
+    // counters per operation for every phase of time_btree_ms and time_wst_ms
+    PerfCounters counters;
+    if (has_flag(argc, argv, "--perf")) {
+        if (counters.available()) {
+            phase_counters = &counters;
+        }
+        else {
+            cout << "performance counters unavailable, reporting times only" << endl;
+        }
+    }
+
     string tree_file_btree = "data/original_unique_1_500000";
     string insert_file_btree = "data/uniform0_50000";
     string search_file_btree = "data/uniform1_50000";
@@ -442,7 +1243,128 @@ int main(int argc, char *argv[])
         cout << "\n\n" << endl;
 
         //time_wst_sec();
-        time_wst_ms(tree_file_btree, search_file_btree);
+#ifdef WST_TRACE
+        clear_trace(); // keep the spans of the working set tree only
+#endif
+        time_wst_ms<DynamicPolicy>(tree_file_btree, search_file_btree);
+#ifdef WST_TRACE
+        // the last spans of the run, for chrome://tracing (see trace.h)
+        if (!dump_trace("data/wst_trace.json")) {
+            cout << "data/wst_trace.json cannot be opened for writing." << endl;
+        }
+#endif
+
+        // the benchmarks below run only when asked for by flag, see has_flag
+        if (has_flag(argc, argv, "--static")) {
+            // same configuration with the tree shape fixed at compile time
+            cout << "\n\n" << endl;
+            time_wst_ms<DefaultStaticPolicy>(tree_file_btree, search_file_btree);
+
+            // the first two levels stored as flat arrays instead of b-trees
+            cout << "\n\n" << endl;
+            time_wst_ms<StaticPolicy<DEFAULT_MIN_DEGREE, DEFAULT_SCALE_FACTOR, DEFAULT_BASE_HEIGHT,
+                HEIGHT_BOUNDARIES, DEFAULT_BASE_CAPACITY, 2> >(tree_file_btree, search_file_btree);
+        }
+
+        if (has_flag(argc, argv, "--weighted")) {
+            cout << "\n\n" << endl;
+            time_weighted_cache_ms(1LL << 30);
+        }
+
+        if (has_flag(argc, argv, "--replay")) {
+            int replay_shards[] = {1, 4};
+            for (int i = 0; i < 2; ++i) {
+                cout << "\n\n" << endl;
+                time_replay_ms(tree_file_btree, search_file_btree, replay_shards[i]);
+            }
+        }
+
+        if (has_flag(argc, argv, "--snapshot")) {
+            cout << "\n\n" << endl;
+            time_wst_snapshot_ms(tree_file_btree, "data/wst_snapshot.bin");
+        }
+
+        if (has_flag(argc, argv, "--build")) {
+            cout << "\n\n" << endl;
+            time_wst_build_ms(tree_file_btree);
+        }
+
+        if (has_flag(argc, argv, "--batch")) {
+            cout << "\n\n" << endl;
+            time_wst_batch_ms(tree_file_btree);
+        }
+
+        if (has_flag(argc, argv, "--bulk-delete")) {
+            cout << "\n\n" << endl;
+            time_bulk_delete_ms(tree_file_btree, delete_file_btree, 100000);
+        }
+
+        if (has_flag(argc, argv, "--packed")) {
+            cout << "\n\n" << endl;
+            time_packed_ms(tree_file_btree, search_file_btree);
+        }
+
+        if (has_flag(argc, argv, "--frozen")) {
+            cout << "\n\n" << endl;
+            time_frozen_ms(tree_file_btree, search_file_btree, 10);
+        }
+
+        if (has_flag(argc, argv, "--bplus")) {
+            cout << "\n\n" << endl;
+            time_bplus_ms(tree_file_btree, search_file_btree, delete_file_btree);
+        }
+
+        if (has_flag(argc, argv, "--mrc")) {
+            cout << "\n\n" << endl;
+            print_mrc(search_file_btree, 0.1);
+            check_mrc_level_keys();
+        }
+
+        if (has_flag(argc, argv, "--baselines")) {
+            cout << "\n\n" << endl;
+            compare_baselines(file_workload(tree_file_btree, search_file_btree, delete_file_btree));
+            WorkloadDistribution distributions[] = {UNIFORM_ACCESS, ZIPF_ACCESS, SLIDING_WINDOW_ACCESS};
+            for (int i = 0; i < 3; ++i) {
+                cout << endl;
+                compare_baselines(generate_workload(distributions[i], WorkloadOptions()));
+            }
+        }
+
+        // whether the working set bound holds as the trees grow faster
+        if (has_flag(argc, argv, "--bound")) {
+            int scale_factors[] = {2, 4, 8};
+            for (int i = 0; i < 3; ++i) {
+                cout << "\n\n" << endl;
+                print_working_set_bound(generate_workload(ZIPF_ACCESS, WorkloadOptions()), DEFAULT_MIN_DEGREE, scale_factors[i]);
+            }
+        }
+
+        // the shape of the trees following the access pattern as it shifts
+        if (has_flag(argc, argv, "--autotune")) {
+            cout << "\n\n" << endl;
+            compare_auto_tuning(6, 1000000);
+        }
+
+        // one shared tree against per-thread front caches, as threads are added
+        if (has_flag(argc, argv, "--front-cache")) {
+            cout << "\n\n" << endl;
+            cout << "threads,shared_ops_per_sec,front_cache_ops_per_sec,front_hit_rate" << endl;
+            Workload zipf = generate_workload(ZIPF_ACCESS, WorkloadOptions());
+            for (int threads = 1; threads <= 32; threads *= 2) {
+                compare_front_cache(zipf, threads);
+            }
+        }
+
+#ifdef WST_HAVE_PAGED_STORAGE
+        // the coldest trees on disk, with less and less of them cached
+        if (has_flag(argc, argv, "--paged")) {
+            double pool_fractions[] = {1.0, 0.5, 0.25, 0.1};
+            for (int i = 0; i < 4; ++i) {
+                cout << "\n\n" << endl;
+                time_wst_paged_ms(tree_file_btree, search_file_btree, "data", 4, pool_fractions[i]);
+            }
+        }
+#endif
 
         return 0;
 }
@@ -0,0 +1,58 @@
+/*
+ * memorystats.h
+ *
+ * struct reporting the memory used by a b-tree, a level of a working set tree
+ * or a whole working set tree. All counters are kept up to date by the trees
+ * as they change, so collecting the statistics costs O(1) per tree.
+ * Allocator overhead is an estimate: ALLOCATION_OVERHEAD bytes of bookkeeping
+ * for every heap block (a node, and the key and child arrays of the node).
+*/
+
+#ifndef MEMORYSTATS_H
+#define MEMORYSTATS_H
+
+#include <string>
+
+const long long ALLOCATION_OVERHEAD = 2 * sizeof(void*);
+
+struct MemoryStats {
+    long long live_keys;
+    long long live_nodes; // nodes currently part of the tree
+    long long pooled_nodes; // preallocated or freed nodes held for reuse
+    long long key_slots; // keys the live nodes (or arrays) can hold
+    long long bytes; // all memory held, including pooled nodes and allocator overhead
+    long long allocator_overhead;
+
+    MemoryStats() : live_keys(0), live_nodes(0), pooled_nodes(0), key_slots(0), bytes(0), allocator_overhead(0) {}
+
+    // fraction of the key slots in use
+    double fill_factor() const {
+        return key_slots == 0 ? 0.0 : (double)live_keys / key_slots;
+    }
+
+    double bytes_per_key() const {
+        return live_keys == 0 ? 0.0 : (double)bytes / live_keys;
+    }
+
+    MemoryStats& operator+=(const MemoryStats &other) {
+        live_keys += other.live_keys;
+        live_nodes += other.live_nodes;
+        pooled_nodes += other.pooled_nodes;
+        key_slots += other.key_slots;
+        bytes += other.bytes;
+        allocator_overhead += other.allocator_overhead;
+        return *this;
+    }
+};
+
+/* string format: "keys: k, nodes: n (+p pooled), fill: f, bytes: b (x per key, o allocator overhead)" */
+inline std::string memory_stats_to_string(const MemoryStats &stats) {
+    std::string str = "keys: " + std::to_string(stats.live_keys);
+    str += ", nodes: " + std::to_string(stats.live_nodes) + " (+" + std::to_string(stats.pooled_nodes) + " pooled)";
+    str += ", fill: " + std::to_string(stats.fill_factor());
+    str += ", bytes: " + std::to_string(stats.bytes) + " (" + std::to_string(stats.bytes_per_key()) + " per key, ";
+    str += std::to_string(stats.allocator_overhead) + " allocator overhead)";
+    return str;
+}
+
+#endif // MEMORYSTATS_H
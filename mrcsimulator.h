@@ -0,0 +1,344 @@
+/*
+ * mrcsimulator.h
+ *
+ * single-pass miss ratio curve of a trace of int keys, one per line, in the
+ * format of the data files main.cpp replays. Every access is given its stack
+ * distance, the number of distinct keys accessed since the previous access
+ * to the same key: a cache holding the c most recently accessed keys hits
+ * exactly the accesses whose distance is below c. One pass thus gives the
+ * hit ratio of every capacity, of every tree boundary of a working set tree
+ * (the keys held by its first trees), and the accesses each tree would
+ * serve if its trees were filled in recency order.
+ *
+ * Distances are counted with a Fenwick tree over access times, in memory
+ * proportional to the number of distinct keys tracked. To bound that on
+ * large traces, keys are sampled by hash (SHARDS): only keys whose hash falls
+ * below sample_rate are tracked, and their distances are scaled up by
+ * 1 / sample_rate. The sampled keys are split by hash into one disjoint
+ * subset per thread; each subset is itself a sample of rate
+ * sample_rate / threads, and the partial histograms are added together.
+ * The trace is read once, in batches handed to the threads through bounded
+ * queues, so memory does not grow with the trace.
+*/
+
+#ifndef MRCSIMULATOR_H
+#define MRCSIMULATOR_H
+
+#include <algorithm> // for std::sort, std::upper_bound
+#include <climits> // for LLONG_MAX
+#include <condition_variable>
+#include <cstdlib> // for std::strtol
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility> // for std::pair
+#include <vector>
+#include "wstpolicy.h"
+
+const int MRC_BATCH_KEYS = 4096;
+const int MRC_QUEUED_BATCHES = 8; // per thread
+const uint64_t MRC_HASH_RANGE = 1 << 24;
+
+struct MrcOptions {
+    double sample_rate; // fraction of the keys tracked, 1.0 for exact distances
+    int threads;
+    long long bucket_keys; // capacity step of the curve
+    long long max_capacity; // largest capacity of the curve
+
+    MrcOptions() : sample_rate(1.0), threads(1), bucket_keys(1000), max_capacity(1000000) {}
+};
+
+struct MrcResult {
+    long long accesses; // in the trace
+    long long sampled; // accesses to tracked keys
+    long long cold; // first accesses to tracked keys
+    double sample_rate;
+    long long bucket_keys;
+    // sampled accesses by scaled stack distance / bucket_keys. the last entry
+    //  counts distances of max_capacity and more
+    std::vector<long long> distance_histogram;
+    std::vector<long long> level_keys; // keys held by trees 0..i together
+    std::vector<long long> level_hits; // sampled accesses whose key tree i holds
+
+    MrcResult() : accesses(0), sampled(0), cold(0), sample_rate(1.0), bucket_keys(1) {}
+    double hit_ratio(long long capacity) const; // of a cache holding capacity keys
+    std::string to_string() const;
+};
+
+// hit ratio of a cache of capacity keys, from the histogram. distances are
+//  known to bucket_keys, so capacities are rounded down to a bucket
+inline double MrcResult::hit_ratio(long long capacity) const {
+    if (sampled == 0) {
+        return 0.0;
+    }
+    long long hits = 0;
+    long long buckets = std::min<long long>(capacity / bucket_keys, distance_histogram.size() - 1);
+    for (long long b = 0; b < buckets; ++b) {
+        hits += distance_histogram[b];
+    }
+    return hits * 1.0 / sampled;
+}
+
+// the curve, then the tree boundaries and the per-tree histogram, as
+//  comma-separated lines
+inline std::string MrcResult::to_string() const {
+    std::string str = "accesses," + std::to_string(accesses) + "\nsampled," + std::to_string(sampled)
+            + "\ncold," + std::to_string(cold) + "\n\ncapacity,hit_ratio\n";
+    for (size_t b = 1; b < distance_histogram.size(); ++b) {
+        long long capacity = b * bucket_keys;
+        str += std::to_string(capacity) + "," + std::to_string(hit_ratio(capacity)) + "\n";
+    }
+    str += "\ntree,keys_through_tree,hit_ratio,accesses_served\n";
+    long long served = 0;
+    for (size_t i = 0; i < level_keys.size(); ++i) {
+        served += level_hits[i];
+        str += std::to_string(i) + "," + std::to_string(level_keys[i]) + ","
+                + std::to_string(sampled == 0 ? 0.0 : served * 1.0 / sampled) + ","
+                + std::to_string(level_hits[i]) + "\n";
+    }
+    return str;
+}
+
+// splitmix64, so that sampling does not follow patterns in the keys
+inline uint64_t mrc_hash(uint64_t key) {
+    key += 0x9E3779B97F4A7C15ULL;
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+    return key ^ (key >> 31);
+}
+
+// stack distances of the accesses to one subset of the keys. every tracked
+//  key marks the time of its last access in a Fenwick tree, so the distinct
+//  keys accessed since a time are the marks after it. times are renumbered
+//  when they run out, keeping the tree as large as twice the tracked keys
+class StackDistanceTracker {
+public:
+    StackDistanceTracker() : next_time(0) {
+        counts.assign(1 << 16, 0);
+    }
+
+    // the stack distance of an access to key, or -1 for its first access
+    long long access(int key) {
+        if (next_time == (long long)counts.size()) {
+            renumber();
+        }
+        long long distance = -1;
+        std::unordered_map<int, long long>::iterator it = last_access.find(key);
+        if (it != last_access.end()) {
+            distance = prefix(next_time - 1) - prefix(it->second);
+            add(it->second, -1);
+            it->second = next_time;
+        }
+        else {
+            last_access[key] = next_time;
+        }
+        add(next_time, 1);
+        next_time++;
+        return distance;
+    }
+
+    // stop tracking key, as if it had never been accessed
+    void forget(int key) {
+        std::unordered_map<int, long long>::iterator it = last_access.find(key);
+        if (it != last_access.end()) {
+            add(it->second, -1);
+            last_access.erase(it);
+        }
+    }
+
+private:
+    std::unordered_map<int, long long> last_access;
+    std::vector<int> counts; // Fenwick tree over times
+    long long next_time;
+
+    void add(long long time, int delta) {
+        for (long long i = time + 1; i <= (long long)counts.size(); i += i & -i) {
+            counts[i - 1] += delta;
+        }
+    }
+
+    // marks at times 0..time
+    long long prefix(long long time) {
+        long long sum = 0;
+        for (long long i = time + 1; i > 0; i -= i & -i) {
+            sum += counts[i - 1];
+        }
+        return sum;
+    }
+
+    void renumber() {
+        std::vector<std::pair<long long, int> > by_time;
+        by_time.reserve(last_access.size());
+        for (std::unordered_map<int, long long>::iterator it = last_access.begin(); it != last_access.end(); ++it) {
+            by_time.push_back(std::make_pair(it->second, it->first));
+        }
+        std::sort(by_time.begin(), by_time.end());
+        size_t size = counts.size();
+        while (by_time.size() * 2 > size) {
+            size *= 2;
+        }
+        counts.assign(size, 0);
+        for (size_t t = 0; t < by_time.size(); ++t) {
+            last_access[by_time[t].second] = t;
+            add(t, 1);
+        }
+        next_time = by_time.size();
+    }
+};
+
+// batches of keys for one thread. push blocks while the queue is full
+class MrcQueue {
+public:
+    MrcQueue() : closed(false) {}
+
+    void push(std::vector<int> &batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return batches.size() < (size_t)MRC_QUEUED_BATCHES; });
+        batches.push(std::vector<int>());
+        batches.back().swap(batch);
+        not_empty.notify_one();
+    }
+
+    // false once the queue is closed and drained
+    bool pop(std::vector<int> &batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !batches.empty() || closed; });
+        if (batches.empty()) {
+            return false;
+        }
+        batch.swap(batches.front());
+        batches.pop();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::queue<std::vector<int> > batches;
+    bool closed;
+};
+
+// the keys held by trees 0..i together, for the trees below max_capacity
+//  and the first one reaching it. a tree holds about load_keys(i) keys, the
+//  capacity under key-count boundaries and the keys of a tree filled by
+//  inserts under height boundaries, see wstpolicy.h
+template <class Policy>
+std::vector<long long> mrc_level_keys(const Policy &policy, long long max_capacity) {
+    std::vector<long long> level_keys;
+    long long total = 0;
+    for (int level = 0; total < max_capacity && level < 64; ++level) {
+        long long keys = policy.load_keys(level);
+        total = keys > LLONG_MAX - total ? LLONG_MAX : total + keys;
+        level_keys.push_back(total);
+    }
+    return level_keys;
+}
+
+// replay trace_file once, returning the sampled stack distance histogram and
+//  the hit ratios at the tree boundaries of policy. result.accesses is 0 if
+//  the file cannot be read
+template <class Policy>
+MrcResult simulate_mrc(const std::string &trace_file, const Policy &policy, const MrcOptions &options) {
+    MrcResult result;
+    std::ifstream ifs(trace_file);
+    if (!ifs.is_open()) {
+        return result;
+    }
+
+    int threads = std::max(1, options.threads);
+    double thread_rate = options.sample_rate / threads;
+    uint64_t threshold = (uint64_t)(options.sample_rate * MRC_HASH_RANGE);
+    long long buckets = options.max_capacity / options.bucket_keys + 1;
+    result.sample_rate = options.sample_rate;
+    result.bucket_keys = options.bucket_keys;
+    result.level_keys = mrc_level_keys(policy, options.max_capacity);
+
+    std::vector<MrcQueue> queues(threads);
+    std::vector<MrcResult> partial(threads);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; ++w) {
+        workers.push_back(std::thread([&, w] {
+            MrcResult &part = partial[w];
+            part.distance_histogram.assign(buckets, 0);
+            part.level_hits.assign(result.level_keys.size(), 0);
+            StackDistanceTracker tracker;
+            std::vector<int> batch;
+            while (queues[w].pop(batch)) {
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    long long distance = tracker.access(batch[i]);
+                    part.sampled++;
+                    if (distance < 0) {
+                        part.cold++;
+                        part.distance_histogram.back()++;
+                        continue;
+                    }
+                    long long scaled = (long long)(distance / thread_rate);
+                    part.distance_histogram[std::min(scaled / options.bucket_keys, buckets - 1)]++;
+                    size_t level = std::upper_bound(result.level_keys.begin(), result.level_keys.end(), scaled)
+                            - result.level_keys.begin();
+                    if (level < part.level_hits.size()) {
+                        part.level_hits[level]++;
+                    }
+                }
+                batch.clear();
+            }
+        }));
+    }
+
+    std::vector<std::vector<int> > batches(threads);
+    std::string line;
+    while (getline(ifs, line)) {
+        char *end;
+        int key = (int)std::strtol(line.c_str(), &end, 10);
+        if (end == line.c_str()) {
+            continue; // not a key
+        }
+        result.accesses++;
+        uint64_t hash = mrc_hash((uint64_t)(int64_t)key);
+        if (hash % MRC_HASH_RANGE >= threshold) {
+            continue;
+        }
+        int w = (hash >> 32) % threads;
+        batches[w].push_back(key);
+        if (batches[w].size() == (size_t)MRC_BATCH_KEYS) {
+            queues[w].push(batches[w]);
+        }
+    }
+    for (int w = 0; w < threads; ++w) {
+        if (!batches[w].empty()) {
+            queues[w].push(batches[w]);
+        }
+        queues[w].close();
+    }
+    for (int w = 0; w < threads; ++w) {
+        workers[w].join();
+    }
+
+    result.distance_histogram.assign(buckets, 0);
+    result.level_hits.assign(result.level_keys.size(), 0);
+    for (int w = 0; w < threads; ++w) {
+        result.sampled += partial[w].sampled;
+        result.cold += partial[w].cold;
+        for (long long b = 0; b < buckets; ++b) {
+            result.distance_histogram[b] += partial[w].distance_histogram[b];
+        }
+        for (size_t i = 0; i < result.level_hits.size(); ++i) {
+            result.level_hits[i] += partial[w].level_hits[i];
+        }
+    }
+    return result;
+}
+
+#endif // MRCSIMULATOR_H
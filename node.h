@@ -14,7 +14,7 @@
 #include "element.h"
 #include <vector>
 
-const int DEFAULT_MIN_DEGR = 2;
+const int DEFAULT_MIN_DEGREE = 2;
 
 template <class T>
 struct Node {
@@ -23,16 +23,17 @@ struct Node {
     int min_degree;
     Node<T> *parent;
     int index_in_parent; // its index in the parent's children vector
+    int subtree_keys; // keys in the subtree rooted here. only maintained by trees with order statistics
     std::vector<Element<T> > keys;
     std::vector<Node<T>*> children;
 
-    Node() : num_keys(0), is_leaf(true), min_degree(DEFAULT_MIN_DEGR), index_in_parent(-1) {
+    Node() : num_keys(0), is_leaf(true), min_degree(DEFAULT_MIN_DEGREE), index_in_parent(-1), subtree_keys(0) {
         keys.resize(min_degree * 2 - 1);
         children.resize(min_degree * 2);
         parent = nullptr;
     }
 
-    Node(int md) : num_keys(0), is_leaf(true), min_degree(md), index_in_parent(-1) {
+    Node(int md) : num_keys(0), is_leaf(true), min_degree(md), index_in_parent(-1), subtree_keys(0) {
         keys.resize(min_degree * 2 - 1);
         children.resize(min_degree * 2);
         parent = nullptr;
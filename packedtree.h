@@ -0,0 +1,675 @@
+/*
+ * packedtree.h
+ *
+ * template class for one level of a working set tree over integer keys,
+ * storing the keys compressed. Keys are kept sorted in blocks of at most
+ * PACKED_BLOCK_KEYS keys, each block holding its smallest key and the other
+ * keys as bit-packed differences from it (frame of reference), so that keys
+ * close together take a few bits each instead of sizeof(T) bytes.
+ *
+ * Recency is a doubly linked list over 32-bit slot numbers instead of
+ * pointers: every key owns a slot, the slot records its neighbours and the
+ * block holding the key, and the block records the slot of each of its keys.
+ * Slot 0 is the head of the list.
+ *
+ * A lookup unpacks one block and searches it with SSE2 when the differences
+ * are 32 bits wide. It offers the container operations listed in level.h.
+*/
+
+#ifndef PACKEDTREE_H
+#define PACKEDTREE_H
+
+#include <algorithm> // for std::sort, std::lower_bound
+#include <climits>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility> // for std::pair
+#include <vector>
+#include "memorystats.h"
+#include "node.h" // for DEFAULT_MIN_DEGREE
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+const int PACKED_BLOCK_KEYS = 128;
+const int PACKED_MERGE_KEYS = PACKED_BLOCK_KEYS / 4; // blocks this small merge with a neighbour
+
+// index of the first of the n sorted values not below target
+template <class U>
+int count_below(const U *values, int n, U target) {
+    return std::lower_bound(values, values + n, target) - values;
+}
+
+#if defined(__SSE2__)
+// compare four values at a time. SSE2 only compares signed integers, so both
+//  sides are offset by 2^31 first
+inline int count_below(const uint32_t *values, int n, uint32_t target) {
+    __m128i bias = _mm_set1_epi32(INT_MIN);
+    __m128i needle = _mm_xor_si128(_mm_set1_epi32((int)target), bias);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)), bias);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(block, needle)));
+        count += (mask & 1) + (mask >> 1 & 1) + (mask >> 2 & 1) + (mask >> 3 & 1);
+        if (mask != 15) {
+            return count;
+        }
+    }
+    while (i < n && values[i] < target) {
+        i++;
+        count++;
+    }
+    return count;
+}
+#endif
+
+template <class T>
+class PackedTree {
+    static_assert(std::is_integral<T>::value, "PackedTree requires integer keys");
+    typedef typename std::make_unsigned<T>::type Delta;
+public:
+    PackedTree(int min_deg = DEFAULT_MIN_DEGREE, int max_hght = 1);
+    int insert(T val);
+    void insert_lru(T val);
+    bool remove(T val);
+    T remove_lru();
+    T remove_mru();
+    bool contains(T val);
+    int get_height();
+    int get_max_height();
+    bool is_empty();
+    int size();
+    std::string to_string();
+    std::string print_ordered_mru();
+    std::string print_ordered_tail();
+    std::vector<T> keys_by_recency();
+    void bulk_load(const T *keys, int n, double fill = 1.0);
+    int recency_position(T val);
+    bool append_by_recency(const T *after, int count, std::vector<T> &out);
+    void append_range(T lo, T hi, std::vector<T> &out);
+    MemoryStats memory_stats();
+    bool needs_compaction(double min_fill);
+    void compact(double target_fill);
+    long long node_visits(); // blocks searched by lookups, inserts and removes
+private:
+    struct Block {
+        T base; // the smallest key
+        int count;
+        int bits; // width of every packed difference
+        std::vector<uint64_t> packed;
+        std::vector<uint32_t> slots; // slot of each key, in key order
+    };
+    int min_degree;
+    int max_height;
+    int size_;
+    long long visits;
+    std::vector<Block> blocks; // by block id, which never changes while the block is used
+    std::vector<uint32_t> order; // ids of the used blocks in key order
+    std::vector<T> first_keys; // base of each block in order, for finding blocks
+    std::vector<uint32_t> free_blocks;
+    std::vector<uint32_t> prev; // by slot
+    std::vector<uint32_t> next;
+    std::vector<uint32_t> slot_block;
+    std::vector<uint32_t> free_slots;
+
+    void encode(Block &block, const T *keys, const uint32_t *slots, int n);
+    void decode(const Block &block, Delta *deltas);
+    void decode_keys(const Block &block, T *keys);
+    int find_block(T val, bool count_visit = true);
+    bool locate(T val, int *block_index, int *position, bool count_visit = true);
+    uint32_t new_slot();
+    void link_after(uint32_t slot, uint32_t at);
+    void unlink(uint32_t slot);
+    T key_of_slot(uint32_t slot);
+    void insert_key(T val, uint32_t slot);
+    void erase_at(int block_index, int position);
+    uint32_t new_block();
+    void release_block(int block_index);
+    void rebuild(const T *mru_keys, int n, int keys_per_block);
+};
+
+template <class T>
+PackedTree<T>::PackedTree(int min_deg, int max_hght)
+    : min_degree(min_deg), max_height(max_hght), size_(0), visits(0), prev(1, 0), next(1, 0), slot_block(1, 0) {
+}
+
+// pack the differences of the n sorted keys from the first one into block,
+//  in as few bits each as the largest difference needs
+template <class T>
+void PackedTree<T>::encode(Block &block, const T *keys, const uint32_t *slots, int n) {
+    block.base = keys[0];
+    block.count = n;
+    Delta span = (Delta)keys[n - 1] - (Delta)keys[0];
+    int bits = 0;
+    while (bits < (int)sizeof(Delta) * 8 && (span >> bits) != 0) {
+        bits++;
+    }
+    block.bits = bits;
+    block.packed.assign(((size_t)n * bits + 63) / 64, 0);
+    for (int i = 0; i < n && bits > 0; ++i) {
+        uint64_t delta = (Delta)keys[i] - (Delta)keys[0];
+        size_t bit = (size_t)i * bits;
+        int offset = bit % 64;
+        block.packed[bit / 64] |= delta << offset;
+        if (offset + bits > 64) {
+            block.packed[bit / 64 + 1] |= delta >> (64 - offset);
+        }
+    }
+    block.slots.assign(slots, slots + n);
+}
+
+template <class T>
+void PackedTree<T>::decode(const Block &block, Delta *deltas) {
+    int bits = block.bits;
+    if (bits == 0) {
+        std::fill(deltas, deltas + block.count, 0);
+        return;
+    }
+    uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    const uint64_t *words = block.packed.data();
+    for (int i = 0; i < block.count; ++i) {
+        size_t bit = (size_t)i * bits;
+        int offset = bit % 64;
+        uint64_t value = words[bit / 64] >> offset;
+        if (offset + bits > 64) {
+            value |= words[bit / 64 + 1] << (64 - offset);
+        }
+        deltas[i] = (Delta)(value & mask);
+    }
+}
+
+template <class T>
+void PackedTree<T>::decode_keys(const Block &block, T *keys) {
+    Delta deltas[PACKED_BLOCK_KEYS + 1];
+    decode(block, deltas);
+    for (int i = 0; i < block.count; ++i) {
+        keys[i] = (T)((Delta)block.base + deltas[i]);
+    }
+}
+
+// index in order of the block val belongs in: the last block whose smallest
+//  key is not above val, or the first block. -1 when there are no blocks
+template <class T>
+int PackedTree<T>::find_block(T val, bool count_visit) {
+    if (order.empty()) {
+        return -1;
+    }
+    if (count_visit) {
+        visits++;
+    }
+    int index = std::upper_bound(first_keys.begin(), first_keys.end(), val) - first_keys.begin() - 1;
+    return index < 0 ? 0 : index;
+}
+
+template <class T>
+bool PackedTree<T>::locate(T val, int *block_index, int *position, bool count_visit) {
+    int index = find_block(val, count_visit);
+    if (index < 0) {
+        return false;
+    }
+    const Block &block = blocks[order[index]];
+    if (val < block.base) {
+        return false;
+    }
+    Delta target = (Delta)val - (Delta)block.base;
+    if (block.bits < (int)sizeof(Delta) * 8 && (target >> block.bits) != 0) {
+        return false;
+    }
+    Delta deltas[PACKED_BLOCK_KEYS + 1];
+    decode(block, deltas);
+    int pos = count_below(deltas, block.count, target);
+    if (pos == block.count || deltas[pos] != target) {
+        return false;
+    }
+    *block_index = index;
+    *position = pos;
+    return true;
+}
+
+template <class T>
+uint32_t PackedTree<T>::new_slot() {
+    if (!free_slots.empty()) {
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+    prev.push_back(0);
+    next.push_back(0);
+    slot_block.push_back(0);
+    return prev.size() - 1;
+}
+
+template <class T>
+void PackedTree<T>::link_after(uint32_t slot, uint32_t at) {
+    prev[slot] = at;
+    next[slot] = next[at];
+    prev[next[at]] = slot;
+    next[at] = slot;
+}
+
+template <class T>
+void PackedTree<T>::unlink(uint32_t slot) {
+    next[prev[slot]] = next[slot];
+    prev[next[slot]] = prev[slot];
+}
+
+template <class T>
+T PackedTree<T>::key_of_slot(uint32_t slot) {
+    const Block &block = blocks[slot_block[slot]];
+    int pos = std::find(block.slots.begin(), block.slots.end(), slot) - block.slots.begin();
+    T keys[PACKED_BLOCK_KEYS + 1];
+    decode_keys(block, keys);
+    return keys[pos];
+}
+
+template <class T>
+uint32_t PackedTree<T>::new_block() {
+    if (!free_blocks.empty()) {
+        uint32_t id = free_blocks.back();
+        free_blocks.pop_back();
+        return id;
+    }
+    blocks.push_back(Block());
+    return blocks.size() - 1;
+}
+
+template <class T>
+void PackedTree<T>::release_block(int block_index) {
+    uint32_t id = order[block_index];
+    std::vector<uint64_t>().swap(blocks[id].packed);
+    std::vector<uint32_t>().swap(blocks[id].slots);
+    blocks[id].count = 0;
+    free_blocks.push_back(id);
+    order.erase(order.begin() + block_index);
+    first_keys.erase(first_keys.begin() + block_index);
+}
+
+// add val, owning slot, to its block, splitting the block in half when full
+template <class T>
+void PackedTree<T>::insert_key(T val, uint32_t slot) {
+    int index = find_block(val);
+    if (index < 0) {
+        uint32_t id = new_block();
+        encode(blocks[id], &val, &slot, 1);
+        order.push_back(id);
+        first_keys.push_back(val);
+        slot_block[slot] = id;
+        return;
+    }
+
+    uint32_t id = order[index];
+    int n = blocks[id].count;
+    T keys[PACKED_BLOCK_KEYS + 1];
+    uint32_t slots[PACKED_BLOCK_KEYS + 1];
+    decode_keys(blocks[id], keys);
+    std::copy(blocks[id].slots.begin(), blocks[id].slots.end(), slots);
+    int pos = std::upper_bound(keys, keys + n, val) - keys;
+    for (int i = n; i > pos; --i) {
+        keys[i] = keys[i - 1];
+        slots[i] = slots[i - 1];
+    }
+    keys[pos] = val;
+    slots[pos] = slot;
+    slot_block[slot] = id;
+    n++;
+
+    if (n <= PACKED_BLOCK_KEYS) {
+        encode(blocks[id], keys, slots, n);
+        first_keys[index] = blocks[id].base;
+        return;
+    }
+
+    int half = n / 2;
+    uint32_t right = new_block(); // may move blocks, so nothing refers into it yet
+    encode(blocks[id], keys, slots, half);
+    encode(blocks[right], keys + half, slots + half, n - half);
+    for (int i = half; i < n; ++i) {
+        slot_block[slots[i]] = right;
+    }
+    first_keys[index] = blocks[id].base;
+    order.insert(order.begin() + index + 1, right);
+    first_keys.insert(first_keys.begin() + index + 1, blocks[right].base);
+}
+
+// remove the key at position of the block at block_index. a block left nearly
+//  empty is merged into a neighbour when the two fit in three quarters of a block
+template <class T>
+void PackedTree<T>::erase_at(int block_index, int position) {
+    uint32_t id = order[block_index];
+    int n = blocks[id].count;
+    if (n == 1) {
+        release_block(block_index);
+        return;
+    }
+    T keys[PACKED_BLOCK_KEYS + 1];
+    uint32_t slots[PACKED_BLOCK_KEYS + 1];
+    decode_keys(blocks[id], keys);
+    std::copy(blocks[id].slots.begin(), blocks[id].slots.end(), slots);
+    for (int i = position; i < n - 1; ++i) {
+        keys[i] = keys[i + 1];
+        slots[i] = slots[i + 1];
+    }
+    n--;
+    encode(blocks[id], keys, slots, n);
+    first_keys[block_index] = blocks[id].base;
+
+    if (n >= PACKED_MERGE_KEYS || order.size() == 1) {
+        return;
+    }
+    int left = block_index + 1 < (int)order.size() ? block_index : block_index - 1;
+    uint32_t left_id = order[left];
+    uint32_t right_id = order[left + 1];
+    int ln = blocks[left_id].count;
+    int rn = blocks[right_id].count;
+    if (ln + rn > PACKED_BLOCK_KEYS * 3 / 4) {
+        return;
+    }
+    decode_keys(blocks[left_id], keys);
+    decode_keys(blocks[right_id], keys + ln);
+    std::copy(blocks[left_id].slots.begin(), blocks[left_id].slots.end(), slots);
+    std::copy(blocks[right_id].slots.begin(), blocks[right_id].slots.end(), slots + ln);
+    encode(blocks[left_id], keys, slots, ln + rn);
+    for (int i = ln; i < ln + rn; ++i) {
+        slot_block[slots[i]] = left_id;
+    }
+    first_keys[left] = blocks[left_id].base;
+    release_block(left + 1);
+}
+
+// insert val as the most recently accessed key
+template <class T>
+int PackedTree<T>::insert(T val) {
+    uint32_t slot = new_slot();
+    link_after(slot, 0);
+    insert_key(val, slot);
+    size_++;
+    return get_height();
+}
+
+// insert val as the least recently accessed key
+template <class T>
+void PackedTree<T>::insert_lru(T val) {
+    uint32_t slot = new_slot();
+    link_after(slot, prev[0]);
+    insert_key(val, slot);
+    size_++;
+}
+
+template <class T>
+bool PackedTree<T>::remove(T val) {
+    int index, pos;
+    if (!locate(val, &index, &pos)) {
+        return false;
+    }
+    uint32_t slot = blocks[order[index]].slots[pos];
+    unlink(slot);
+    free_slots.push_back(slot);
+    erase_at(index, pos);
+    size_--;
+    return true;
+}
+
+template <class T>
+T PackedTree<T>::remove_lru() {
+    if (size_ == 0) {
+        return T();
+    }
+    T lru = key_of_slot(prev[0]);
+    remove(lru);
+    return lru;
+}
+
+template <class T>
+T PackedTree<T>::remove_mru() {
+    if (size_ == 0) {
+        return T();
+    }
+    T mru = key_of_slot(next[0]);
+    remove(mru);
+    return mru;
+}
+
+template <class T>
+bool PackedTree<T>::contains(T val) {
+    int index, pos;
+    return locate(val, &index, &pos);
+}
+
+// the height of a b-tree of the same minimum degree holding these keys in
+//  full nodes, as for FlatTree
+template <class T>
+int PackedTree<T>::get_height() {
+    int height = 1;
+    long long capacity = min_degree * 2 - 1;
+    while (capacity < size_) {
+        capacity = capacity * (min_degree * 2) + (min_degree * 2 - 1);
+        height++;
+    }
+    return height;
+}
+
+template <class T>
+int PackedTree<T>::get_max_height() {
+    return max_height;
+}
+
+template <class T>
+bool PackedTree<T>::is_empty() {
+    return size_ == 0;
+}
+
+template <class T>
+int PackedTree<T>::size() {
+    return size_;
+}
+
+// string representation: the keys in ascending order
+template <class T>
+std::string PackedTree<T>::to_string() {
+    std::string str = "[ ";
+    T keys[PACKED_BLOCK_KEYS + 1];
+    for (size_t b = 0; b < order.size(); ++b) {
+        const Block &block = blocks[order[b]];
+        decode_keys(block, keys);
+        for (int i = 0; i < block.count; ++i) {
+            str += std::to_string(keys[i]) + " ";
+        }
+    }
+    return str + "]";
+}
+
+template <class T>
+std::string PackedTree<T>::print_ordered_mru() {
+    std::vector<T> keys = keys_by_recency();
+    std::string str = "MRU-> ";
+    for (size_t i = 0; i < keys.size(); ++i) {
+        str += "#" + std::to_string(keys[i]) + "# ";
+    }
+    str += " <-LRU";
+    return str;
+}
+
+template <class T>
+std::string PackedTree<T>::print_ordered_tail() {
+    std::vector<T> keys = keys_by_recency();
+    std::string str = "(tail) LRU-> ";
+    for (size_t i = keys.size(); i > 0; --i) {
+        str += "#" + std::to_string(keys[i - 1]) + "# ";
+    }
+    str += " <-MRU";
+    return str;
+}
+
+// every block is unpacked once into a table by slot, then the list is walked
+template <class T>
+std::vector<T> PackedTree<T>::keys_by_recency() {
+    std::vector<T> key_of(prev.size());
+    T keys[PACKED_BLOCK_KEYS + 1];
+    for (size_t b = 0; b < order.size(); ++b) {
+        const Block &block = blocks[order[b]];
+        decode_keys(block, keys);
+        for (int i = 0; i < block.count; ++i) {
+            key_of[block.slots[i]] = keys[i];
+        }
+    }
+    std::vector<T> recent;
+    recent.reserve(size_);
+    for (uint32_t slot = next[0]; slot != 0; slot = next[slot]) {
+        recent.push_back(key_of[slot]);
+    }
+    return recent;
+}
+
+// replace the contents with the n given keys, ordered from the most to the
+//  least recently accessed, in blocks of keys_per_block keys
+template <class T>
+void PackedTree<T>::rebuild(const T *mru_keys, int n, int keys_per_block) {
+    std::vector<std::pair<T, uint32_t> > sorted(n);
+    for (int i = 0; i < n; ++i) {
+        sorted[i] = std::make_pair(mru_keys[i], (uint32_t)i + 1);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    blocks.clear();
+    order.clear();
+    first_keys.clear();
+    free_blocks.clear();
+    free_slots.clear();
+    prev.assign(n + 1, 0);
+    next.assign(n + 1, 0);
+    slot_block.assign(n + 1, 0);
+    for (int slot = 1; slot <= n; ++slot) {
+        prev[slot] = slot - 1;
+        next[slot - 1] = slot;
+    }
+    prev[0] = n;
+    next[n] = 0;
+
+    std::vector<T> keys(keys_per_block);
+    std::vector<uint32_t> slots(keys_per_block);
+    for (int first = 0; first < n; first += keys_per_block) {
+        int count = std::min(keys_per_block, n - first);
+        for (int i = 0; i < count; ++i) {
+            keys[i] = sorted[first + i].first;
+            slots[i] = sorted[first + i].second;
+            slot_block[slots[i]] = blocks.size();
+        }
+        order.push_back(blocks.size());
+        blocks.push_back(Block());
+        encode(blocks.back(), keys.data(), slots.data(), count);
+        first_keys.push_back(keys[0]);
+    }
+    size_ = n;
+}
+
+// blocks are left three quarters full whatever the fill, leaving room for
+//  inserts
+template <class T>
+void PackedTree<T>::bulk_load(const T *mru_keys, int n, double fill) {
+    (void)fill;
+    rebuild(mru_keys, n, PACKED_BLOCK_KEYS * 3 / 4);
+}
+
+template <class T>
+int PackedTree<T>::recency_position(T val) {
+    int index, pos;
+    if (!locate(val, &index, &pos)) {
+        return -1;
+    }
+    uint32_t target = blocks[order[index]].slots[pos];
+    int position = 0;
+    for (uint32_t slot = next[0]; slot != target; slot = next[slot]) {
+        position++;
+    }
+    return position;
+}
+
+// the lookup is not counted as a visit, so that a snapshot may copy from the
+//  tree on another thread between writes (see snapshot.h)
+template <class T>
+bool PackedTree<T>::append_by_recency(const T *after, int count, std::vector<T> &out) {
+    uint32_t slot = 0;
+    if (after != nullptr) {
+        int index, pos;
+        if (!locate(*after, &index, &pos, false)) {
+            return false;
+        }
+        slot = blocks[order[index]].slots[pos];
+    }
+    for (slot = next[slot]; slot != 0 && count > 0; slot = next[slot], count--) {
+        out.push_back(key_of_slot(slot));
+    }
+    return true;
+}
+
+// append the keys in [lo, hi] to out in ascending order
+template <class T>
+void PackedTree<T>::append_range(T lo, T hi, std::vector<T> &out) {
+    T keys[PACKED_BLOCK_KEYS + 1];
+    for (int b = std::max(find_block(lo), 0); b < (int)order.size(); ++b) {
+        const Block &block = blocks[order[b]];
+        if (hi < block.base) {
+            return;
+        }
+        decode_keys(block, keys);
+        for (int i = 0; i < block.count; ++i) {
+            if (!(keys[i] < lo) && !(hi < keys[i])) {
+                out.push_back(keys[i]);
+            }
+        }
+    }
+}
+
+// memory held by the blocks and the slot arrays. blocks count as nodes with
+//  room for PACKED_BLOCK_KEYS keys
+template <class T>
+MemoryStats PackedTree<T>::memory_stats() {
+    MemoryStats stats;
+    stats.live_keys = size_;
+    stats.live_nodes = order.size();
+    stats.pooled_nodes = free_blocks.size();
+    stats.key_slots = (long long)order.size() * PACKED_BLOCK_KEYS;
+    long long bytes = sizeof(PackedTree<T>) + blocks.capacity() * sizeof(Block)
+            + order.capacity() * sizeof(uint32_t) + first_keys.capacity() * sizeof(T)
+            + free_blocks.capacity() * sizeof(uint32_t) + free_slots.capacity() * sizeof(uint32_t)
+            + (prev.capacity() + next.capacity() + slot_block.capacity()) * sizeof(uint32_t);
+    int allocations = 7;
+    for (size_t b = 0; b < order.size(); ++b) {
+        const Block &block = blocks[order[b]];
+        bytes += block.packed.capacity() * sizeof(uint64_t) + block.slots.capacity() * sizeof(uint32_t);
+        allocations += 2;
+    }
+    stats.allocator_overhead = (long long)allocations * ALLOCATION_OVERHEAD;
+    stats.bytes = bytes + stats.allocator_overhead;
+    return stats;
+}
+
+// blocks below min_fill, or more free slots than keys
+template <class T>
+bool PackedTree<T>::needs_compaction(double min_fill) {
+    return memory_stats().fill_factor() < min_fill || (int)free_slots.size() > size_;
+}
+
+// rebuild with blocks filled to target_fill, renumbering the slots so the
+//  slot arrays hold no free entries
+template <class T>
+void PackedTree<T>::compact(double target_fill) {
+    std::vector<T> keys = keys_by_recency();
+    int keys_per_block = std::max(1, std::min(PACKED_BLOCK_KEYS, (int)(PACKED_BLOCK_KEYS * target_fill)));
+    rebuild(keys.data(), keys.size(), keys_per_block);
+    blocks.shrink_to_fit();
+    order.shrink_to_fit();
+    first_keys.shrink_to_fit();
+    free_blocks.shrink_to_fit();
+    free_slots.shrink_to_fit();
+}
+
+template <class T>
+long long PackedTree<T>::node_visits() {
+    return visits;
+}
+
+#endif // PACKEDTREE_H
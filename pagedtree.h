@@ -0,0 +1,1058 @@
+/*
+ * pagedtree.h
+ *
+ * out-of-core storage for the coldest levels of a working set tree. Nodes are
+ * fixed-size pages of a file, children are referenced by page id, and only a
+ * bounded number of pages is held in memory by a PagePool, which reads and
+ * writes pages with pread/pwrite and evicts them with the clock algorithm.
+ *
+ * PagedBTree<K, V> is a b-tree map from unique keys to values whose minimum
+ * degree is chosen so that a node fills one page. PagedTree<T> keeps the keys
+ * of one level in two such maps, key -> recency stamp and recency stamp -> key,
+ * so that its recency order survives without the pointer-linked list of BTree,
+ * whose links would turn every key move into random writes across pages. It
+ * provides the container operations listed in level.h. Its files are unlinked
+ * as soon as they are opened, so they vanish with the process.
+ *
+ * A pool whose file cannot be created or written does not lose pages: a page
+ * that cannot be written back stays in memory, the pool growing by a frame
+ * when no other can be evicted, and failed() reports it from then on.
+ *
+ * Available on POSIX systems (WST_HAVE_PAGED_STORAGE is defined).
+*/
+
+#ifndef PAGEDTREE_H
+#define PAGEDTREE_H
+
+#if defined(__unix__) || defined(__APPLE__)
+#define WST_HAVE_PAGED_STORAGE 1
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring> // for std::memcpy
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "memorystats.h"
+
+const int PAGE_SIZE = 4096;
+const int MIN_POOL_PAGES = 8; // a b-tree operation pins at most three pages at once
+const uint32_t NO_PAGE = UINT32_MAX;
+
+class PagePool {
+public:
+    // pages are stored in a new file created in directory
+    PagePool(const std::string &directory, int num_frames);
+    bool failed(); // whether the file could not be created, read or written
+    ~PagePool();
+    char* pin(uint32_t page_id); // the page stays in memory until unpinned
+    void unpin(uint32_t page_id, bool dirty);
+    uint32_t allocate_page();
+    void release_page(uint32_t page_id);
+    int num_frames();
+    int pages_in_use();
+    int released_pages();
+    long long reads; // pages read from the file
+    long long writes; // pages written back to the file
+    long long hits; // pins served from memory
+private:
+    struct Frame {
+        uint32_t page_id;
+        int pins;
+        bool dirty;
+        bool referenced;
+    };
+    struct Page {
+        char bytes[PAGE_SIZE];
+    };
+    int fd;
+    bool failed_;
+    std::deque<Page> memory; // grows without moving pinned pages
+    std::vector<Frame> frames;
+    std::unordered_map<uint32_t, int> frame_of_page;
+    int clock_hand;
+    uint32_t next_page;
+    std::vector<uint32_t> free_pages;
+    int find_victim();
+};
+
+inline PagePool::PagePool(const std::string &directory, int num_frames)
+    : reads(0), writes(0), hits(0), failed_(false), clock_hand(0), next_page(0) {
+    if (num_frames < MIN_POOL_PAGES) {
+        num_frames = MIN_POOL_PAGES;
+    }
+    std::string path = directory + "/wst_pages_XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    fd = mkstemp(name.data());
+    if (fd < 0) {
+        failed_ = true;
+    }
+    else {
+        unlink(name.data());
+    }
+
+    memory.resize(num_frames);
+    Frame empty = {NO_PAGE, 0, false, false};
+    frames.assign(num_frames, empty);
+}
+
+inline PagePool::~PagePool() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+inline bool PagePool::failed() {
+    return failed_;
+}
+
+// the frame to load a page into: a free frame, or the first unpinned frame
+//  not referenced since the clock hand last passed it. a dirty victim is
+//  written back first, and kept if it cannot be. a frame is added when every
+//  frame is pinned or kept
+inline int PagePool::find_victim() {
+    int num = frames.size();
+    for (int step = 0; step < 2 * num + 1; ++step) {
+        int f = clock_hand;
+        clock_hand = (clock_hand + 1) % num;
+        Frame &frame = frames[f];
+        if (frame.page_id == NO_PAGE) {
+            return f;
+        }
+        if (frame.pins > 0) {
+            continue;
+        }
+        if (frame.referenced) {
+            frame.referenced = false;
+            continue;
+        }
+        if (frame.dirty) {
+            // after a failure dirty pages are no longer written, only kept
+            if (failed_ || pwrite(fd, memory[f].bytes, PAGE_SIZE, (off_t)frame.page_id * PAGE_SIZE) != PAGE_SIZE) {
+                failed_ = true;
+                continue;
+            }
+            writes++;
+        }
+        frame_of_page.erase(frame.page_id);
+        frame.page_id = NO_PAGE;
+        return f;
+    }
+    Frame empty = {NO_PAGE, 0, false, false};
+    frames.push_back(empty);
+    memory.emplace_back();
+    return frames.size() - 1;
+}
+
+inline char* PagePool::pin(uint32_t page_id) {
+    std::unordered_map<uint32_t, int>::iterator it = frame_of_page.find(page_id);
+    if (it != frame_of_page.end()) {
+        Frame &frame = frames[it->second];
+        frame.pins++;
+        frame.referenced = true;
+        hits++;
+        return memory[it->second].bytes;
+    }
+
+    int f = find_victim();
+    char *data = memory[f].bytes;
+    ssize_t got = fd < 0 ? 0 : pread(fd, data, PAGE_SIZE, (off_t)page_id * PAGE_SIZE);
+    if (got < 0) {
+        failed_ = true;
+    }
+    if (got < PAGE_SIZE) {
+        // pages never written back read as zeroes
+        std::memset(data + (got > 0 ? got : 0), 0, PAGE_SIZE - (got > 0 ? got : 0));
+    }
+    reads++;
+    Frame frame = {page_id, 1, false, true};
+    frames[f] = frame;
+    frame_of_page[page_id] = f;
+    return data;
+}
+
+inline void PagePool::unpin(uint32_t page_id, bool dirty) {
+    Frame &frame = frames[frame_of_page[page_id]];
+    frame.pins--;
+    frame.dirty = frame.dirty || dirty;
+}
+
+inline uint32_t PagePool::allocate_page() {
+    if (!free_pages.empty()) {
+        uint32_t page_id = free_pages.back();
+        free_pages.pop_back();
+        return page_id;
+    }
+    return next_page++;
+}
+
+// the page's contents are dropped without being written back
+inline void PagePool::release_page(uint32_t page_id) {
+    std::unordered_map<uint32_t, int>::iterator it = frame_of_page.find(page_id);
+    if (it != frame_of_page.end() && frames[it->second].pins == 0) {
+        frames[it->second].page_id = NO_PAGE;
+        frames[it->second].dirty = false;
+        frame_of_page.erase(it);
+    }
+    free_pages.push_back(page_id);
+}
+
+inline int PagePool::num_frames() {
+    return frames.size();
+}
+
+inline int PagePool::pages_in_use() {
+    return next_page - free_pages.size();
+}
+
+inline int PagePool::released_pages() {
+    return free_pages.size();
+}
+
+// a page pinned for the lifetime of the object
+class PinnedPage {
+public:
+    PinnedPage(PagePool *p, uint32_t id) : pool(p), page_id(id), data(p->pin(id)), dirty(false) {}
+    ~PinnedPage() {
+        pool->unpin(page_id, dirty);
+    }
+    PagePool *pool;
+    uint32_t page_id;
+    char *data;
+    bool dirty; // set when the page was changed
+private:
+    PinnedPage(const PinnedPage&);
+    PinnedPage& operator=(const PinnedPage&);
+};
+
+/*
+ * page layout: uint16 num_keys, uint16 is_leaf, then the keys, the values and
+ * the child page ids, each array aligned for its type
+*/
+template <class K, class V>
+class PagedBTree {
+public:
+    explicit PagedBTree(PagePool *p);
+    ~PagedBTree();
+    bool find(K key, V *value);
+    void insert(K key, V value); // replaces the value if key is present
+    bool erase(K key, V *value); // stores the erased value if found
+    bool min(K *key, V *value);
+    bool max(K *key, V *value);
+    int size();
+    int height();
+    int max_keys(); // keys per page, 2*min_degree - 1
+    static int page_min_degree();
+    // call f(key, value) for every key in [lo, hi], ascending or descending
+    template <class F> void for_range(K lo, K hi, F f);
+    template <class F> void for_each_descending(F f);
+    template <class F> void for_below(K hi, int count, F f); // the first count keys below hi, descending
+private:
+    PagePool *pool;
+    uint32_t root;
+    int size_;
+    int height_;
+    int min_degree;
+    size_t values_offset;
+    size_t children_offset;
+
+    uint16_t& num_keys(char *page) { return *reinterpret_cast<uint16_t*>(page); }
+    bool is_leaf(char *page) { return *reinterpret_cast<uint16_t*>(page + 2) != 0; }
+    void set_leaf(char *page, bool leaf) { *reinterpret_cast<uint16_t*>(page + 2) = leaf; }
+    K* keys(char *page) { return reinterpret_cast<K*>(page + 8); }
+    V* values(char *page) { return reinterpret_cast<V*>(page + values_offset); }
+    uint32_t* children(char *page) { return reinterpret_cast<uint32_t*>(page + children_offset); }
+
+    uint32_t new_page(bool leaf);
+    void split_child(PinnedPage &parent, int index);
+    void merge_children(PinnedPage &parent, int index);
+    void destroy(uint32_t page_id);
+    template <class F> void visit_range(uint32_t page_id, K lo, K hi, F &f);
+    template <class F> void visit_descending(uint32_t page_id, F &f);
+    template <class F> void visit_below(uint32_t page_id, K hi, int &count, F &f);
+};
+
+static inline size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+template <class K, class V>
+PagedBTree<K, V>::PagedBTree(PagePool *p) : pool(p), size_(0), height_(1) {
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                  "paged storage requires trivially copyable keys and values");
+
+    min_degree = page_min_degree();
+    values_offset = align_up(8 + (2 * min_degree - 1) * sizeof(K), alignof(V));
+    children_offset = align_up(values_offset + (2 * min_degree - 1) * sizeof(V), alignof(uint32_t));
+
+    root = new_page(true);
+}
+
+// the largest minimum degree whose node fits in a page
+template <class K, class V>
+int PagedBTree<K, V>::page_min_degree() {
+    int degree = 2;
+    while (true) {
+        int t = degree + 1;
+        size_t vals = align_up(8 + (2 * t - 1) * sizeof(K), alignof(V));
+        size_t kids = align_up(vals + (2 * t - 1) * sizeof(V), alignof(uint32_t));
+        if (kids + 2 * t * sizeof(uint32_t) > (size_t)PAGE_SIZE) {
+            return degree;
+        }
+        degree = t;
+    }
+}
+
+template <class K, class V>
+PagedBTree<K, V>::~PagedBTree() {
+    destroy(root);
+}
+
+template <class K, class V>
+void PagedBTree<K, V>::destroy(uint32_t page_id) {
+    std::vector<uint32_t> kids;
+    {
+        PinnedPage page(pool, page_id);
+        if (!is_leaf(page.data)) {
+            kids.assign(children(page.data), children(page.data) + num_keys(page.data) + 1);
+        }
+    }
+    for (size_t i = 0; i < kids.size(); ++i) {
+        destroy(kids[i]);
+    }
+    pool->release_page(page_id);
+}
+
+template <class K, class V>
+uint32_t PagedBTree<K, V>::new_page(bool leaf) {
+    uint32_t page_id = pool->allocate_page();
+    PinnedPage page(pool, page_id);
+    num_keys(page.data) = 0;
+    set_leaf(page.data, leaf);
+    page.dirty = true;
+    return page_id;
+}
+
+template <class K, class V>
+bool PagedBTree<K, V>::find(K key, V *value) {
+    uint32_t page_id = root;
+    while (true) {
+        PinnedPage page(pool, page_id);
+        int n = num_keys(page.data);
+        K *k = keys(page.data);
+        int i = 0;
+        while (i < n && k[i] < key) {
+            i++;
+        }
+        if (i < n && k[i] == key) {
+            *value = values(page.data)[i];
+            return true;
+        }
+        if (is_leaf(page.data)) {
+            return false;
+        }
+        page_id = children(page.data)[i];
+    }
+}
+
+// move the upper half of the full child at index into a new page, and its
+//  middle key up into parent
+template <class K, class V>
+void PagedBTree<K, V>::split_child(PinnedPage &parent, int index) {
+    int t = min_degree;
+    uint32_t left_id = children(parent.data)[index];
+    PinnedPage left(pool, left_id);
+    uint32_t right_id = new_page(is_leaf(left.data));
+    PinnedPage right(pool, right_id);
+
+    std::memcpy(keys(right.data), keys(left.data) + t, (t - 1) * sizeof(K));
+    std::memcpy(values(right.data), values(left.data) + t, (t - 1) * sizeof(V));
+    if (!is_leaf(left.data)) {
+        std::memcpy(children(right.data), children(left.data) + t, t * sizeof(uint32_t));
+    }
+    num_keys(right.data) = t - 1;
+    num_keys(left.data) = t - 1;
+
+    int n = num_keys(parent.data);
+    K *pk = keys(parent.data);
+    V *pv = values(parent.data);
+    uint32_t *pc = children(parent.data);
+    for (int j = n; j > index; --j) {
+        pk[j] = pk[j - 1];
+        pv[j] = pv[j - 1];
+        pc[j + 1] = pc[j];
+    }
+    pk[index] = keys(left.data)[t - 1];
+    pv[index] = values(left.data)[t - 1];
+    pc[index + 1] = right_id;
+    num_keys(parent.data) = n + 1;
+
+    parent.dirty = left.dirty = right.dirty = true;
+}
+
+template <class K, class V>
+void PagedBTree<K, V>::insert(K key, V value) {
+    {
+        PinnedPage top(pool, root);
+        if (num_keys(top.data) == 2 * min_degree - 1) {
+            uint32_t new_root = new_page(false);
+            PinnedPage page(pool, new_root);
+            children(page.data)[0] = root;
+            split_child(page, 0);
+            root = new_root;
+            height_++;
+        }
+    }
+
+    // descend, splitting full children before entering them
+    uint32_t page_id = root;
+    while (true) {
+        PinnedPage page(pool, page_id);
+        int n = num_keys(page.data);
+        K *k = keys(page.data);
+        int i = 0;
+        while (i < n && k[i] < key) {
+            i++;
+        }
+        if (i < n && k[i] == key) {
+            values(page.data)[i] = value;
+            page.dirty = true;
+            return;
+        }
+        if (is_leaf(page.data)) {
+            V *v = values(page.data);
+            for (int j = n; j > i; --j) {
+                k[j] = k[j - 1];
+                v[j] = v[j - 1];
+            }
+            k[i] = key;
+            v[i] = value;
+            num_keys(page.data) = n + 1;
+            page.dirty = true;
+            size_++;
+            return;
+        }
+        bool full;
+        {
+            PinnedPage child(pool, children(page.data)[i]);
+            full = num_keys(child.data) == 2 * min_degree - 1;
+        }
+        if (full) {
+            split_child(page, i);
+            if (key == k[i]) {
+                values(page.data)[i] = value;
+                return;
+            }
+            if (k[i] < key) {
+                i++;
+            }
+        }
+        page_id = children(page.data)[i];
+    }
+}
+
+// merge the child at index + 1 and the parent's key at index into the child
+//  at index, releasing the right page
+template <class K, class V>
+void PagedBTree<K, V>::merge_children(PinnedPage &parent, int index) {
+    uint32_t *pc = children(parent.data);
+    uint32_t right_id = pc[index + 1];
+    {
+        PinnedPage left(pool, pc[index]);
+        PinnedPage right(pool, right_id);
+        int ln = num_keys(left.data);
+        int rn = num_keys(right.data);
+        keys(left.data)[ln] = keys(parent.data)[index];
+        values(left.data)[ln] = values(parent.data)[index];
+        std::memcpy(keys(left.data) + ln + 1, keys(right.data), rn * sizeof(K));
+        std::memcpy(values(left.data) + ln + 1, values(right.data), rn * sizeof(V));
+        if (!is_leaf(left.data)) {
+            std::memcpy(children(left.data) + ln + 1, children(right.data), (rn + 1) * sizeof(uint32_t));
+        }
+        num_keys(left.data) = ln + rn + 1;
+        left.dirty = true;
+    }
+    pool->release_page(right_id);
+
+    int n = num_keys(parent.data);
+    K *pk = keys(parent.data);
+    V *pv = values(parent.data);
+    for (int j = index; j < n - 1; ++j) {
+        pk[j] = pk[j + 1];
+        pv[j] = pv[j + 1];
+        pc[j + 1] = pc[j + 2];
+    }
+    num_keys(parent.data) = n - 1;
+    parent.dirty = true;
+}
+
+// top-down deletion: every child is given at least min_degree keys before
+//  the descent enters it, so the key can always be removed from a leaf
+//  without a second pass
+template <class K, class V>
+bool PagedBTree<K, V>::erase(K key, V *value) {
+    bool found = false;
+    uint32_t page_id = root;
+    uint32_t old_root = NO_PAGE;
+    while (true) {
+        {
+            PinnedPage page(pool, page_id);
+            int n = num_keys(page.data);
+            K *k = keys(page.data);
+            V *v = values(page.data);
+            uint32_t *c = children(page.data);
+            int i = 0;
+            while (i < n && k[i] < key) {
+                i++;
+            }
+
+            if (is_leaf(page.data)) {
+                if (i < n && k[i] == key) {
+                    if (!found) {
+                        *value = v[i];
+                        found = true;
+                    }
+                    for (int j = i; j < n - 1; ++j) {
+                        k[j] = k[j + 1];
+                        v[j] = v[j + 1];
+                    }
+                    num_keys(page.data) = n - 1;
+                    page.dirty = true;
+                    size_--;
+                }
+                break;
+            }
+
+            if (i < n && k[i] == key) {
+                if (!found) {
+                    *value = v[i];
+                    found = true;
+                }
+                int left_keys, right_keys;
+                {
+                    PinnedPage left(pool, c[i]);
+                    PinnedPage right(pool, c[i + 1]);
+                    left_keys = num_keys(left.data);
+                    right_keys = num_keys(right.data);
+                }
+                if (left_keys >= min_degree || right_keys >= min_degree) {
+                    // replace key with its predecessor (or successor) and delete
+                    //  that one from the child instead
+                    bool use_left = left_keys >= min_degree;
+                    uint32_t id = c[use_left ? i : i + 1];
+                    while (true) {
+                        PinnedPage p(pool, id);
+                        if (is_leaf(p.data)) {
+                            int pos = use_left ? num_keys(p.data) - 1 : 0;
+                            k[i] = keys(p.data)[pos];
+                            v[i] = values(p.data)[pos];
+                            break;
+                        }
+                        id = children(p.data)[use_left ? num_keys(p.data) : 0];
+                    }
+                    page.dirty = true;
+                    key = k[i];
+                    page_id = c[use_left ? i : i + 1];
+                }
+                else {
+                    merge_children(page, i);
+                    page_id = c[i];
+                }
+            }
+            else {
+                // make sure the child the key is in holds at least min_degree keys
+                bool merge = false;
+                {
+                    PinnedPage child(pool, c[i]);
+                    if (num_keys(child.data) < min_degree) {
+                        int cn = num_keys(child.data);
+                        bool done = false;
+                        if (i > 0) {
+                            PinnedPage left(pool, c[i - 1]);
+                            int ln = num_keys(left.data);
+                            if (ln >= min_degree) {
+                                K *ck = keys(child.data);
+                                V *cv = values(child.data);
+                                for (int j = cn; j > 0; --j) {
+                                    ck[j] = ck[j - 1];
+                                    cv[j] = cv[j - 1];
+                                }
+                                ck[0] = k[i - 1];
+                                cv[0] = v[i - 1];
+                                if (!is_leaf(child.data)) {
+                                    uint32_t *cc = children(child.data);
+                                    for (int j = cn + 1; j > 0; --j) {
+                                        cc[j] = cc[j - 1];
+                                    }
+                                    cc[0] = children(left.data)[ln];
+                                }
+                                k[i - 1] = keys(left.data)[ln - 1];
+                                v[i - 1] = values(left.data)[ln - 1];
+                                num_keys(left.data) = ln - 1;
+                                num_keys(child.data) = cn + 1;
+                                left.dirty = child.dirty = page.dirty = true;
+                                done = true;
+                            }
+                        }
+                        if (!done && i < n) {
+                            PinnedPage right(pool, c[i + 1]);
+                            int rn = num_keys(right.data);
+                            if (rn >= min_degree) {
+                                keys(child.data)[cn] = k[i];
+                                values(child.data)[cn] = v[i];
+                                if (!is_leaf(child.data)) {
+                                    children(child.data)[cn + 1] = children(right.data)[0];
+                                    std::memmove(children(right.data), children(right.data) + 1, rn * sizeof(uint32_t));
+                                }
+                                k[i] = keys(right.data)[0];
+                                v[i] = values(right.data)[0];
+                                std::memmove(keys(right.data), keys(right.data) + 1, (rn - 1) * sizeof(K));
+                                std::memmove(values(right.data), values(right.data) + 1, (rn - 1) * sizeof(V));
+                                num_keys(right.data) = rn - 1;
+                                num_keys(child.data) = cn + 1;
+                                right.dirty = child.dirty = page.dirty = true;
+                                done = true;
+                            }
+                        }
+                        merge = !done;
+                    }
+                }
+                // the child is unpinned first, as the merge may release its page
+                if (merge) {
+                    if (i < n) {
+                        merge_children(page, i);
+                    }
+                    else {
+                        merge_children(page, i - 1);
+                        i--;
+                    }
+                }
+                page_id = c[i];
+            }
+
+            // the root lost its last key to a merge: its only child becomes the root
+            if (page.page_id == root && num_keys(page.data) == 0 && !is_leaf(page.data)) {
+                root = c[0];
+                height_--;
+                old_root = page.page_id;
+            }
+        }
+        if (old_root != NO_PAGE) {
+            pool->release_page(old_root);
+            old_root = NO_PAGE;
+        }
+    }
+    return found;
+}
+
+template <class K, class V>
+bool PagedBTree<K, V>::min(K *key, V *value) {
+    uint32_t page_id = root;
+    while (true) {
+        PinnedPage page(pool, page_id);
+        if (num_keys(page.data) == 0) {
+            return false;
+        }
+        if (is_leaf(page.data)) {
+            *key = keys(page.data)[0];
+            *value = values(page.data)[0];
+            return true;
+        }
+        page_id = children(page.data)[0];
+    }
+}
+
+template <class K, class V>
+bool PagedBTree<K, V>::max(K *key, V *value) {
+    uint32_t page_id = root;
+    while (true) {
+        PinnedPage page(pool, page_id);
+        int n = num_keys(page.data);
+        if (n == 0) {
+            return false;
+        }
+        if (is_leaf(page.data)) {
+            *key = keys(page.data)[n - 1];
+            *value = values(page.data)[n - 1];
+            return true;
+        }
+        page_id = children(page.data)[n];
+    }
+}
+
+template <class K, class V>
+int PagedBTree<K, V>::size() {
+    return size_;
+}
+
+template <class K, class V>
+int PagedBTree<K, V>::height() {
+    return height_;
+}
+
+template <class K, class V>
+int PagedBTree<K, V>::max_keys() {
+    return 2 * min_degree - 1;
+}
+
+template <class K, class V>
+template <class F>
+void PagedBTree<K, V>::for_range(K lo, K hi, F f) {
+    visit_range(root, lo, hi, f);
+}
+
+template <class K, class V>
+template <class F>
+void PagedBTree<K, V>::for_each_descending(F f) {
+    visit_descending(root, f);
+}
+
+template <class K, class V>
+template <class F>
+void PagedBTree<K, V>::for_below(K hi, int count, F f) {
+    if (count > 0) {
+        visit_below(root, hi, count, f);
+    }
+}
+
+// pages are copied before recursing so that only one page is pinned at a time
+template <class K, class V>
+template <class F>
+void PagedBTree<K, V>::visit_range(uint32_t page_id, K lo, K hi, F &f) {
+    std::vector<char> copy(PAGE_SIZE);
+    {
+        PinnedPage page(pool, page_id);
+        std::memcpy(copy.data(), page.data, PAGE_SIZE);
+    }
+    char *data = copy.data();
+    int n = num_keys(data);
+    bool leaf = is_leaf(data);
+    for (int i = 0; i <= n; ++i) {
+        if (!leaf && (i == 0 || keys(data)[i - 1] < hi)) {
+            if (i == n || lo < keys(data)[i]) {
+                visit_range(children(data)[i], lo, hi, f);
+            }
+        }
+        if (i < n && !(keys(data)[i] < lo) && !(hi < keys(data)[i])) {
+            f(keys(data)[i], values(data)[i]);
+        }
+    }
+}
+
+template <class K, class V>
+template <class F>
+void PagedBTree<K, V>::visit_descending(uint32_t page_id, F &f) {
+    std::vector<char> copy(PAGE_SIZE);
+    {
+        PinnedPage page(pool, page_id);
+        std::memcpy(copy.data(), page.data, PAGE_SIZE);
+    }
+    char *data = copy.data();
+    int n = num_keys(data);
+    for (int i = n; i >= 0; --i) {
+        if (!is_leaf(data)) {
+            visit_descending(children(data)[i], f);
+        }
+        if (i > 0) {
+            f(keys(data)[i - 1], values(data)[i - 1]);
+        }
+    }
+}
+
+template <class K, class V>
+template <class F>
+void PagedBTree<K, V>::visit_below(uint32_t page_id, K hi, int &count, F &f) {
+    std::vector<char> copy(PAGE_SIZE);
+    {
+        PinnedPage page(pool, page_id);
+        std::memcpy(copy.data(), page.data, PAGE_SIZE);
+    }
+    char *data = copy.data();
+    int n = num_keys(data);
+    for (int i = n; i >= 0 && count > 0; --i) {
+        if (!is_leaf(data) && (i == 0 || keys(data)[i - 1] < hi)) {
+            visit_below(children(data)[i], hi, count, f);
+        }
+        if (i > 0 && count > 0 && keys(data)[i - 1] < hi) {
+            f(keys(data)[i - 1], values(data)[i - 1]);
+            count--;
+        }
+    }
+}
+
+// one level of a working set tree kept in paged storage. recency is recorded
+//  as a stamp per key: inserting takes a stamp above every other, inserting
+//  as least recent takes one below every other
+template <class T>
+class PagedTree {
+public:
+    PagedTree(const std::string &directory, int pool_pages, int min_deg, int max_hght)
+        : pool(directory, pool_pages), by_key(&pool), by_stamp(&pool),
+          mru_stamp(FIRST_STAMP), lru_stamp(FIRST_STAMP + 1), min_degree(min_deg), max_height(max_hght) {}
+    int insert(T val);
+    void insert_lru(T val);
+    bool remove(T val);
+    T remove_lru();
+    T remove_mru();
+    bool contains(T val);
+    int get_height();
+    int get_max_height();
+    bool is_empty();
+    int size();
+    std::string to_string();
+    std::string print_ordered_mru();
+    std::string print_ordered_tail();
+    std::vector<T> keys_by_recency();
+    void bulk_load(const T *keys, int n, double fill = 1.0);
+    int recency_position(T val);
+    bool append_by_recency(const T *after, int count, std::vector<T> &out);
+    void append_range(T lo, T hi, std::vector<T> &out);
+    MemoryStats memory_stats();
+    bool needs_compaction(double min_fill);
+    void compact(double target_fill);
+    long long node_visits(); // pages pinned, from memory or from the file
+    PagePool& page_pool() {
+        return pool;
+    }
+    // pages taken by num_keys keys inserted in random order, which leaves
+    //  b-tree nodes about 69% full (ln 2)
+    static long long estimated_pages(long long num_keys) {
+        double key_page = (2 * PagedBTree<T, uint64_t>::page_min_degree() - 1) * 0.69;
+        double stamp_page = (2 * PagedBTree<uint64_t, T>::page_min_degree() - 1) * 0.69;
+        return (long long)(num_keys / key_page + num_keys / stamp_page) + 2;
+    }
+private:
+    static const uint64_t FIRST_STAMP = 1ULL << 62;
+    PagePool pool;
+    PagedBTree<T, uint64_t> by_key;
+    PagedBTree<uint64_t, T> by_stamp;
+    uint64_t mru_stamp; // the stamp of the most recent key
+    uint64_t lru_stamp; // the stamp of the least recent key
+    int min_degree;
+    int max_height;
+    void place(T val, uint64_t stamp);
+};
+
+// give val the stamp, dropping its previous stamp if it was present
+template <class T>
+void PagedTree<T>::place(T val, uint64_t stamp) {
+    uint64_t old_stamp;
+    if (by_key.find(val, &old_stamp)) {
+        T old_key;
+        by_stamp.erase(old_stamp, &old_key);
+    }
+    by_key.insert(val, stamp);
+    by_stamp.insert(stamp, val);
+}
+
+template <class T>
+int PagedTree<T>::insert(T val) {
+    place(val, ++mru_stamp);
+    return get_height();
+}
+
+template <class T>
+void PagedTree<T>::insert_lru(T val) {
+    place(val, --lru_stamp);
+}
+
+template <class T>
+bool PagedTree<T>::remove(T val) {
+    uint64_t stamp;
+    if (!by_key.erase(val, &stamp)) {
+        return false;
+    }
+    T key;
+    by_stamp.erase(stamp, &key);
+    return true;
+}
+
+template <class T>
+T PagedTree<T>::remove_lru() {
+    uint64_t stamp;
+    T key = T();
+    if (by_stamp.min(&stamp, &key)) {
+        remove(key);
+    }
+    return key;
+}
+
+template <class T>
+T PagedTree<T>::remove_mru() {
+    uint64_t stamp;
+    T key = T();
+    if (by_stamp.max(&stamp, &key)) {
+        remove(key);
+    }
+    return key;
+}
+
+template <class T>
+bool PagedTree<T>::contains(T val) {
+    uint64_t stamp;
+    return by_key.find(val, &stamp);
+}
+
+// the height of a b-tree of the level's minimum degree holding these keys in
+//  full nodes, as for FlatTree. the pages themselves hold far more keys each
+template <class T>
+int PagedTree<T>::get_height() {
+    int height = 1;
+    long long capacity = min_degree * 2 - 1;
+    while (capacity < (long long)by_key.size()) {
+        capacity = capacity * (min_degree * 2) + (min_degree * 2 - 1);
+        height++;
+    }
+    return height;
+}
+
+template <class T>
+int PagedTree<T>::get_max_height() {
+    return max_height;
+}
+
+template <class T>
+bool PagedTree<T>::is_empty() {
+    return by_key.size() == 0;
+}
+
+template <class T>
+int PagedTree<T>::size() {
+    return by_key.size();
+}
+
+// string representation: the keys in ascending order
+template <class T>
+std::string PagedTree<T>::to_string() {
+    std::string str = "[ ";
+    std::vector<T> recent = keys_by_recency();
+    std::sort(recent.begin(), recent.end());
+    for (size_t i = 0; i < recent.size(); ++i) {
+        str += std::to_string(recent[i]) + " ";
+    }
+    return str + "]";
+}
+
+template <class T>
+std::string PagedTree<T>::print_ordered_mru() {
+    std::vector<T> keys = keys_by_recency();
+    std::string str = "MRU-> ";
+    for (size_t i = 0; i < keys.size(); ++i) {
+        str += "#" + std::to_string(keys[i]) + "# ";
+    }
+    str += " <-LRU";
+    return str;
+}
+
+template <class T>
+std::string PagedTree<T>::print_ordered_tail() {
+    std::vector<T> keys = keys_by_recency();
+    std::string str = "(tail) LRU-> ";
+    for (size_t i = keys.size(); i > 0; --i) {
+        str += "#" + std::to_string(keys[i - 1]) + "# ";
+    }
+    str += " <-MRU";
+    return str;
+}
+
+template <class T>
+std::vector<T> PagedTree<T>::keys_by_recency() {
+    std::vector<T> keys;
+    keys.reserve(by_key.size());
+    by_stamp.for_each_descending([&keys](uint64_t, T key) {
+        keys.push_back(key);
+    });
+    return keys;
+}
+
+// replace the contents with the n given keys, ordered from the most to the
+//  least recently accessed. they are inserted one by one, so the pages fill
+//  as insertion leaves them whatever the fill
+template <class T>
+void PagedTree<T>::bulk_load(const T *keys, int n, double fill) {
+    (void)fill;
+    while (!is_empty()) {
+        remove_mru();
+    }
+    for (int i = n - 1; i >= 0; --i) {
+        insert(keys[i]);
+    }
+}
+
+template <class T>
+int PagedTree<T>::recency_position(T val) {
+    uint64_t stamp;
+    if (!by_key.find(val, &stamp)) {
+        return -1;
+    }
+    int position = 0;
+    by_stamp.for_range(stamp + 1, mru_stamp, [&position](uint64_t, T) {
+        position++;
+    });
+    return position;
+}
+
+// pins pages like any other lookup: the page pool is not shared between
+//  threads, so a snapshot of paged levels must not be read while the tree is
+//  used on another thread (see snapshot.h)
+template <class T>
+bool PagedTree<T>::append_by_recency(const T *after, int count, std::vector<T> &out) {
+    uint64_t stamp = mru_stamp + 1;
+    if (after != nullptr && !by_key.find(*after, &stamp)) {
+        return false;
+    }
+    by_stamp.for_below(stamp, count, [&out](uint64_t, T key) {
+        out.push_back(key);
+    });
+    return true;
+}
+
+template <class T>
+void PagedTree<T>::append_range(T lo, T hi, std::vector<T> &out) {
+    if (hi < lo) {
+        return;
+    }
+    by_key.for_range(lo, hi, [&out](T key, uint64_t) {
+        out.push_back(key);
+    });
+}
+
+// memory held in RAM: the page frames and the page table. pages on disk are
+//  reported as nodes but not counted in bytes
+template <class T>
+MemoryStats PagedTree<T>::memory_stats() {
+    MemoryStats stats;
+    stats.live_keys = size();
+    stats.live_nodes = pool.pages_in_use();
+    stats.pooled_nodes = pool.released_pages();
+    stats.key_slots = (long long)stats.live_nodes * by_key.max_keys() / 2; // both maps hold every key
+    stats.allocator_overhead = 2 * ALLOCATION_OVERHEAD;
+    stats.bytes = sizeof(PagedTree<T>) + (long long)pool.num_frames() * (PAGE_SIZE + 32) + stats.allocator_overhead;
+    return stats;
+}
+
+template <class T>
+bool PagedTree<T>::needs_compaction(double min_fill) {
+    (void)min_fill;
+    return false;
+}
+
+// pages are reused through the pool's free list, so there is nothing to repack
+template <class T>
+void PagedTree<T>::compact(double target_fill) {
+    (void)target_fill;
+}
+
+template <class T>
+long long PagedTree<T>::node_visits() {
+    return pool.hits + pool.reads;
+}
+
+#endif // defined(__unix__) || defined(__APPLE__)
+
+#endif // PAGEDTREE_H
@@ -0,0 +1,159 @@
+/*
+ * perfcounters.h
+ *
+ * hardware performance counters of the calling thread around a phase of a
+ * benchmark: cycles, instructions, L1 data cache read misses, last level
+ * cache misses, branch misses and data TLB read misses. Every counter is
+ * opened on its own through perf_event_open on Linux, so that the ones the
+ * processor or kernel do not offer (or that perf_event_paranoid forbids)
+ * are left out without affecting the others. When the kernel multiplexes
+ * counters, the counts are scaled by the time each counter was running.
+ * Elsewhere, or when no counter can be opened, available() is false and a
+ * benchmark reports its timings only.
+*/
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <cstdint>
+#include <string>
+
+#if defined(__linux__)
+#define WST_HAVE_PERF_EVENTS 1
+#include <cstring> // for std::memset
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    NUM_PERF_EVENTS
+};
+
+inline std::string perf_event_name(PerfEvent event) {
+    const char *names[NUM_PERF_EVENTS] = {"cycles", "instructions", "L1d misses", "LLC misses",
+                                          "branch misses", "dTLB misses"};
+    return names[event];
+}
+
+class PerfCounters {
+public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    bool available() const; // whether any counter could be opened
+    void start(); // reset and enable every counter
+    void stop(); // disable every counter and read the counts
+    long long value(PerfEvent event) const; // count of the last phase, or -1 if not counted
+    // "cycles/op: c, instructions/op: i, ..." for the counters open, or
+    //  "performance counters unavailable"
+    std::string report(long long ops) const;
+private:
+    int fds[NUM_PERF_EVENTS]; // -1 for a counter that is not open
+    long long counts[NUM_PERF_EVENTS];
+};
+
+#ifdef WST_HAVE_PERF_EVENTS
+inline PerfCounters::PerfCounters() {
+    const uint32_t types[NUM_PERF_EVENTS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                             PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+    const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint64_t configs[NUM_PERF_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                               PERF_COUNT_HW_CACHE_L1D | read_miss, PERF_COUNT_HW_CACHE_MISSES,
+                                               PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_DTLB | read_miss};
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0); // this thread, on any cpu
+        counts[i] = -1;
+    }
+}
+
+inline PerfCounters::~PerfCounters() {
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+inline void PerfCounters::start() {
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+inline void PerfCounters::stop() {
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        uint64_t data[3]; // value, time enabled, time running
+        counts[i] = -1;
+        if (fds[i] < 0 || read(fds[i], data, sizeof(data)) != (ssize_t)sizeof(data) || data[2] == 0) {
+            continue;
+        }
+        counts[i] = (long long)(data[0] * ((double)data[1] / data[2]));
+    }
+}
+#else
+inline PerfCounters::PerfCounters() {
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        fds[i] = -1;
+        counts[i] = -1;
+    }
+}
+
+inline PerfCounters::~PerfCounters() {}
+
+inline void PerfCounters::start() {}
+
+inline void PerfCounters::stop() {}
+#endif
+
+inline bool PerfCounters::available() const {
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        if (fds[i] >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline long long PerfCounters::value(PerfEvent event) const {
+    return counts[event];
+}
+
+inline std::string PerfCounters::report(long long ops) const {
+    std::string str;
+    for (int i = 0; i < NUM_PERF_EVENTS; ++i) {
+        if (counts[i] < 0) {
+            continue;
+        }
+        str += (str.empty() ? "" : ", ") + perf_event_name((PerfEvent)i) + "/op: ";
+        str += std::to_string(ops > 0 ? (double)counts[i] / ops : 0.0);
+    }
+    return str.empty() ? "performance counters unavailable" : str;
+}
+
+#endif // PERFCOUNTERS_H
@@ -0,0 +1,431 @@
+/*
+ * replay.h
+ *
+ * pipelined replay of a trace of int keys, one per line, in the format of
+ * the data files main.cpp replays. Three kinds of stages run on their own
+ * threads:
+ *   reader  hands out the file in chunks of whole lines, as views into a
+ *           mapping of the file where possible and as buffers read in
+ *           REPLAY_CHUNK_BYTES pieces otherwise
+ *   parser  turns the chunks into batches of keys, one batch per shard, a
+ *           key going to shard replay_shard(key, shards)
+ *   apply   one per shard, applies every key of its batches to its own tree
+ * Neighbouring stages are connected by lock-free single-producer single-
+ * consumer rings (SpscRing) of a fixed number of slots: a stage finding the
+ * next ring full waits for its consumer, so a slow apply stage holds back
+ * the parser and the reader instead of letting the batches pile up. Every
+ * stage counts the items it handled and the time it spent waiting for input
+ * and for room in its output, from which ReplayStats tells which stage
+ * limits the replay.
+ *
+ * The keys of a shard are applied in trace order. Keys of different shards
+ * are applied concurrently, so a tree must not be shared between shards.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <algorithm> // for std::min
+#include <atomic>
+#include <chrono>
+#include <cstring> // for std::memchr
+#include <fstream>
+#include <memory> // for std::unique_ptr
+#include <string>
+#include <thread>
+#include <vector>
+#include "mrcsimulator.h" // for mrc_hash
+
+#if defined(__unix__) || defined(__APPLE__)
+#define WST_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const size_t REPLAY_CHUNK_BYTES = 1 << 20;
+const int REPLAY_BATCH_KEYS = 4096;
+const int DEFAULT_REPLAY_RING_SLOTS = 64;
+const size_t SPSC_PADDING = 64; // bytes between the indices, so that they sit on their own cache lines
+const int SPSC_SPINS = 64; // failed attempts before a waiting stage yields its thread
+
+// a bounded queue between exactly one producer thread and one consumer
+//  thread. tail is written by the producer only and head by the consumer
+//  only; each side keeps the last value it read of the other's index, and
+//  reads it again only when that copy says the ring is full or empty
+template <class T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t min_slots);
+    bool try_push(const T &item);
+    bool try_pop(T &item);
+    // wait for room, returning the seconds spent waiting
+    double push(const T &item);
+    // wait for an item, adding the seconds spent waiting to waited. false once
+    //  the ring is closed and empty
+    bool pop(T &item, double &waited);
+    void close(); // by the producer, after its last push
+private:
+    std::vector<T> slots;
+    size_t mask;
+    char pad0[SPSC_PADDING];
+    std::atomic<size_t> head; // next slot to pop
+    size_t cached_tail; // consumer's copy
+    char pad1[SPSC_PADDING];
+    std::atomic<size_t> tail; // next slot to push
+    size_t cached_head; // producer's copy
+    std::atomic<bool> closed;
+    char pad2[SPSC_PADDING];
+};
+
+template <class T>
+SpscRing<T>::SpscRing(size_t min_slots) : head(0), cached_tail(0), tail(0), cached_head(0), closed(false) {
+    size_t size = 2;
+    while (size < min_slots) {
+        size *= 2;
+    }
+    slots.resize(size);
+    mask = size - 1;
+}
+
+template <class T>
+bool SpscRing<T>::try_push(const T &item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - cached_head == slots.size()) {
+        cached_head = head.load(std::memory_order_acquire);
+        if (t - cached_head == slots.size()) {
+            return false;
+        }
+    }
+    slots[t & mask] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+template <class T>
+bool SpscRing<T>::try_pop(T &item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == cached_tail) {
+        cached_tail = tail.load(std::memory_order_acquire);
+        if (h == cached_tail) {
+            return false;
+        }
+    }
+    item = slots[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+template <class T>
+double SpscRing<T>::push(const T &item) {
+    if (try_push(item)) {
+        return 0.0;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int spins = 0; !try_push(item); ++spins) {
+        if (spins >= SPSC_SPINS) {
+            std::this_thread::yield();
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// closed is read before the last attempt, so that an item pushed just before
+//  close is not missed
+template <class T>
+bool SpscRing<T>::pop(T &item, double &waited) {
+    if (try_pop(item)) {
+        return true;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool popped = false;
+    for (int spins = 0;; ++spins) {
+        bool done = closed.load(std::memory_order_acquire);
+        if (try_pop(item)) {
+            popped = true;
+            break;
+        }
+        if (done) {
+            break;
+        }
+        if (spins >= SPSC_SPINS) {
+            std::this_thread::yield();
+        }
+    }
+    waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return popped;
+}
+
+template <class T>
+void SpscRing<T>::close() {
+    closed.store(true, std::memory_order_release);
+}
+
+// the shard of key among shards, by hash so that runs of keys are spread
+inline int replay_shard(int key, int shards) {
+    return shards <= 1 ? 0 : (int)(mrc_hash((uint64_t)(int64_t)key) % shards);
+}
+
+struct ReplayStageStats {
+    std::string name;
+    long long items; // chunks read, keys parsed or keys applied
+    double seconds; // from the start of the stage to its end
+    double input_wait; // seconds waiting for the previous stage
+    double output_wait; // seconds waiting for room in the next ring
+
+    ReplayStageStats(const std::string &stage_name)
+        : name(stage_name), items(0), seconds(0.0), input_wait(0.0), output_wait(0.0) {}
+    // items per second of the time the stage was not waiting
+    double busy_rate() const;
+};
+
+struct ReplayStats {
+    long long bytes; // of the trace
+    long long keys; // parsed from the trace
+    double seconds; // of the whole replay
+    std::vector<ReplayStageStats> stages; // reader, parser, then one apply stage per shard
+
+    ReplayStats() : bytes(0), keys(0), seconds(0.0) {}
+    // a line of stage,items,seconds,input_wait,output_wait,busy_items_per_sec
+    //  per stage
+    std::string to_string() const;
+};
+
+inline double ReplayStageStats::busy_rate() const {
+    double busy = seconds - input_wait - output_wait;
+    return busy > 0 ? items / busy : 0.0;
+}
+
+inline std::string ReplayStats::to_string() const {
+    std::string str = "stage,items,seconds,input_wait,output_wait,busy_items_per_sec\n";
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const ReplayStageStats &s = stages[i];
+        str += s.name + "," + std::to_string(s.items) + "," + std::to_string(s.seconds) + ","
+            + std::to_string(s.input_wait) + "," + std::to_string(s.output_wait) + ","
+            + std::to_string(s.busy_rate()) + "\n";
+    }
+    return str + "total," + std::to_string(keys) + "," + std::to_string(seconds) + ",,,"
+        + std::to_string(seconds > 0 ? keys / seconds : 0.0) + "\n";
+}
+
+// whole lines of the trace, either a view into the mapping of the file or a
+//  buffer of its own
+struct ReplayChunk {
+    const char *begin;
+    const char *end;
+    std::vector<char> buffer;
+};
+
+// the reader stage. the file stays mapped as long as the reader exists, since
+//  the chunks it hands out may point into the mapping
+class ReplayReader {
+public:
+    ReplayReader() : data(nullptr), length(0) {}
+    ~ReplayReader();
+    ReplayReader(const ReplayReader&) = delete;
+    ReplayReader& operator=(const ReplayReader&) = delete;
+    // push the file at path as chunks of whole lines of about
+    //  REPLAY_CHUNK_BYTES, then close out. returns the bytes read, or -1 if
+    //  the file cannot be opened
+    long long run(const std::string &path, SpscRing<ReplayChunk*> &out, ReplayStageStats &stats);
+private:
+    const char *data; // the mapping, if the file is mapped
+    size_t length;
+    long long read_stream(const std::string &path, SpscRing<ReplayChunk*> &out, ReplayStageStats &stats);
+};
+
+inline ReplayReader::~ReplayReader() {
+#ifdef WST_HAVE_MMAP
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), length);
+    }
+#endif
+}
+
+inline long long ReplayReader::run(const std::string &path, SpscRing<ReplayChunk*> &out, ReplayStageStats &stats) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long bytes = -1;
+#ifdef WST_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            data = static_cast<const char*>(mapped);
+            length = st.st_size;
+            madvise(mapped, length, MADV_SEQUENTIAL);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+    if (data != nullptr) {
+        size_t pos = 0;
+        while (pos < length) {
+            size_t end = std::min(pos + REPLAY_CHUNK_BYTES, length);
+            const char *newline = static_cast<const char*>(std::memchr(data + end - 1, '\n', length - end + 1));
+            end = newline != nullptr ? newline - data + 1 : length;
+            ReplayChunk *chunk = new ReplayChunk();
+            chunk->begin = data + pos;
+            chunk->end = data + end;
+            stats.output_wait += out.push(chunk);
+            stats.items++;
+            pos = end;
+        }
+        bytes = length;
+    }
+    else {
+        bytes = read_stream(path, out, stats);
+    }
+    out.close();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return bytes;
+}
+
+// without a mapping, the file is read in pieces of REPLAY_CHUNK_BYTES, the
+//  line cut at the end of a piece carried over to the next
+inline long long ReplayReader::read_stream(const std::string &path, SpscRing<ReplayChunk*> &out,
+                                           ReplayStageStats &stats) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) {
+        return -1;
+    }
+    long long bytes = 0;
+    std::vector<char> carry;
+    while (ifs) {
+        ReplayChunk *chunk = new ReplayChunk();
+        chunk->buffer.swap(carry);
+        size_t kept = chunk->buffer.size();
+        chunk->buffer.resize(kept + REPLAY_CHUNK_BYTES);
+        ifs.read(chunk->buffer.data() + kept, REPLAY_CHUNK_BYTES);
+        size_t filled = kept + ifs.gcount();
+        bytes += ifs.gcount();
+        size_t end = filled;
+        if (ifs) {
+            while (end > 0 && chunk->buffer[end - 1] != '\n') {
+                end--;
+            }
+            carry.assign(chunk->buffer.begin() + end, chunk->buffer.begin() + filled);
+        }
+        chunk->buffer.resize(end);
+        chunk->begin = chunk->buffer.data();
+        chunk->end = chunk->buffer.data() + end;
+        stats.output_wait += out.push(chunk);
+        stats.items++;
+    }
+    return bytes;
+}
+
+// the key at the start of the line [p, end), after any blanks. false if the
+//  line does not start with one, as strtol would find no digits
+inline bool parse_replay_key(const char *p, const char *end, int &key) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+    long long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+    key = (int)(negative ? -value : value);
+    return true;
+}
+
+// replay the trace at path, applying apply(*shards[s], key) to every key of
+//  shard s on a thread of its own. returns the counters of every stage; the
+//  replay applies nothing, and bytes is -1, if the file cannot be opened
+template <class Tree, class Apply>
+ReplayStats replay_pipelined(const std::string &path, std::vector<Tree*> &shards, Apply apply,
+                             int ring_slots = DEFAULT_REPLAY_RING_SLOTS) {
+    typedef std::vector<int> Batch;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int num_shards = shards.size();
+    ReplayStats result;
+    result.stages.push_back(ReplayStageStats("reader"));
+    result.stages.push_back(ReplayStageStats("parser"));
+    for (int s = 0; s < num_shards; ++s) {
+        result.stages.push_back(ReplayStageStats("apply " + std::to_string(s)));
+    }
+
+    SpscRing<ReplayChunk*> chunks(ring_slots);
+    std::vector<std::unique_ptr<SpscRing<Batch*> > > batches;
+    for (int s = 0; s < num_shards; ++s) {
+        batches.push_back(std::unique_ptr<SpscRing<Batch*> >(new SpscRing<Batch*>(ring_slots)));
+    }
+
+    std::vector<std::thread> workers;
+    for (int s = 0; s < num_shards; ++s) {
+        workers.push_back(std::thread([&, s] {
+            ReplayStageStats &stats = result.stages[2 + s];
+            std::chrono::steady_clock::time_point begun = std::chrono::steady_clock::now();
+            Tree &tree = *shards[s];
+            Batch *batch;
+            while (batches[s]->pop(batch, stats.input_wait)) {
+                for (size_t i = 0; i < batch->size(); ++i) {
+                    apply(tree, (*batch)[i]);
+                }
+                stats.items += batch->size();
+                delete batch;
+            }
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begun).count();
+        }));
+    }
+    std::thread parser([&] {
+        ReplayStageStats &stats = result.stages[1];
+        std::chrono::steady_clock::time_point begun = std::chrono::steady_clock::now();
+        std::vector<Batch*> pending(num_shards);
+        for (int s = 0; s < num_shards; ++s) {
+            pending[s] = new Batch();
+            pending[s]->reserve(REPLAY_BATCH_KEYS);
+        }
+        ReplayChunk *chunk;
+        while (chunks.pop(chunk, stats.input_wait)) {
+            const char *p = chunk->begin;
+            while (p < chunk->end) {
+                const char *line_end = static_cast<const char*>(std::memchr(p, '\n', chunk->end - p));
+                if (line_end == nullptr) {
+                    line_end = chunk->end;
+                }
+                int key;
+                if (parse_replay_key(p, line_end, key)) {
+                    int s = replay_shard(key, num_shards);
+                    pending[s]->push_back(key);
+                    stats.items++;
+                    if (pending[s]->size() == (size_t)REPLAY_BATCH_KEYS) {
+                        stats.output_wait += batches[s]->push(pending[s]);
+                        pending[s] = new Batch();
+                        pending[s]->reserve(REPLAY_BATCH_KEYS);
+                    }
+                }
+                p = line_end + 1;
+            }
+            delete chunk;
+        }
+        for (int s = 0; s < num_shards; ++s) {
+            stats.output_wait += batches[s]->push(pending[s]);
+            batches[s]->close();
+        }
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begun).count();
+    });
+
+    ReplayReader reader;
+    result.bytes = reader.run(path, chunks, result.stages[0]);
+    parser.join();
+    for (int s = 0; s < num_shards; ++s) {
+        workers[s].join();
+    }
+    result.keys = result.stages[1].items;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+#endif // REPLAY_H
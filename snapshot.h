@@ -0,0 +1,510 @@
+/*
+ * snapshot.h
+ *
+ * point-in-time, read-only views of a tree. Taking a snapshot is O(1): the
+ * handle shares a SnapshotState, which copies the keys of every level in
+ * recency order a bounded number at a time, so that no single operation pays
+ * for the whole tree:
+ *
+ *   - while a copy is under way, every write copies up to SNAPSHOT_COPY_KEYS
+ *     more keys when it is done. a reader that needs the keys sooner copies
+ *     them itself between writes, in steps of the same size, so a write waits
+ *     at most for one step
+ *   - the copy of a level walks it from its most recent key. the keys no
+ *     write has touched keep their relative order, so every step goes on from
+ *     where the last one stopped. a write reports every key it moves: the
+ *     first time a key is moved or removed, the key that followed it is
+ *     journaled with it, and keys added since the snapshot are remembered so
+ *     that the copy skips them. a write journals O(1) per key it moves
+ *   - once every level is copied, the first reader puts the journaled keys
+ *     back where they were, off the writer's thread
+ *
+ * All snapshots taken between two writes share one state, and the copy stops
+ * when every handle to it has been released. The state holds keys only (no
+ * nodes or links) and is freed with its last handle. While no copy is under
+ * way, writes skip the registry after one emptiness check.
+ *
+ * Changes that are not journaled finish the copies under way first, on the
+ * writer's thread, in O(n) for a tree of n keys: insert_batch, remove_range,
+ * remove_batch, compact, migrate_step, load, build, set_bplus_trees,
+ * set_packed_storage, set_paged_storage, set_weight_boundaries and the
+ * destruction of the tree.
+ *
+ * A reader copying holds the state's lock for one step, so a write may wait
+ * for a reader, but for at most SNAPSHOT_COPY_KEYS keys of copying.
+ *
+ * Readers copy from the tree itself, through append_by_recency (see level.h).
+ * Paged levels pin pages to do so, and their page pool is not thread-safe, so
+ * a snapshot of paged levels must not be read while the tree is used on
+ * another thread.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <algorithm> // for std::sort
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread> // for std::this_thread::yield
+#include <unordered_map>
+#include <vector>
+
+const int SNAPSHOT_COPY_KEYS = 256; // keys copied by one step
+
+template <class T>
+class SnapshotRegistry;
+
+template <class T>
+class SnapshotState {
+public:
+    // appends up to count keys of a level, from the one accessed next less
+    //  recently than *after (see append_by_recency in level.h)
+    typedef std::function<bool(int level, const T *after, int count, std::vector<T> &out)> Reader;
+
+    SnapshotState(int levels, const Reader &reader)
+        : copied(false), read(reader), num_levels(levels), started(false) {}
+
+    // the keys of every level from the most to the least recently accessed
+    const std::vector<std::vector<T> >& levels() {
+        if (!copied.load()) {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!copy_step()) {
+                guard.unlock();
+                std::this_thread::yield(); // let a waiting write in
+                guard.lock();
+            }
+        }
+        std::call_once(assembled, [this]() {
+            assemble();
+        });
+        return keys;
+    }
+
+private:
+    friend class SnapshotRegistry<T>;
+
+    // a key moved or removed before the copy reached it, and the untouched key
+    //  that followed it at that moment, if any
+    struct Removal {
+        T key;
+        int level;
+        bool has_next;
+        T next;
+    };
+
+    std::mutex lock; // held by the writer during a write, or by a reader copying
+    std::atomic<bool> copied;
+    Reader read; // the live tree, until copied
+    int num_levels;
+    bool started;
+    std::vector<std::vector<T> > copies; // keys of each level copied so far
+    std::vector<char> level_copied;
+    std::vector<T> next_key; // first key of each level not copied yet
+    // keys moved, removed or added since the snapshot: the index of their
+    //  removal, or -1 for keys that were not in the tree
+    std::unordered_map<T, int> touched;
+    std::vector<Removal> removals;
+    std::vector<T> buffer;
+    std::once_flag assembled;
+    std::vector<std::vector<T> > keys;
+
+    void start();
+    bool copy_step();
+    void record_removal(int level, T key, const T *next);
+    void assemble();
+    void append_restored(const std::vector<int> *group,
+                         const std::unordered_map<T, std::vector<int> > &before, std::vector<T> &out);
+};
+
+// find the most recent key of every level, before the first write
+template <class T>
+void SnapshotState<T>::start() {
+    if (started) {
+        return;
+    }
+    started = true;
+    copies.resize(num_levels);
+    level_copied.assign(num_levels, 0);
+    next_key.resize(num_levels);
+    for (int level = 0; level < num_levels; ++level) {
+        buffer.clear();
+        read(level, nullptr, 1, buffer);
+        if (buffer.empty()) {
+            level_copied[level] = 1;
+        }
+        else {
+            next_key[level] = buffer[0];
+        }
+    }
+}
+
+// copy up to SNAPSHOT_COPY_KEYS keys, from the first level not copied yet.
+//  the copy of a level ends at its least recent key or at the first key added
+//  since the snapshot, as keys only enter a level at either end. returns
+//  whether every level is copied
+template <class T>
+bool SnapshotState<T>::copy_step() {
+    if (copied.load()) {
+        return true;
+    }
+    start();
+    int budget = SNAPSHOT_COPY_KEYS;
+    for (int level = 0; level < num_levels && budget > 0; ++level) {
+        if (level_copied[level]) {
+            continue;
+        }
+        // next_key is untouched, so it is still in the level
+        int wanted = budget;
+        buffer.clear();
+        read(level, &next_key[level], wanted, buffer);
+        copies[level].push_back(next_key[level]);
+        budget--;
+        bool more = false;
+        for (int i = 0; i < (int)buffer.size(); ++i) {
+            if (touched.count(buffer[i]) != 0) {
+                break;
+            }
+            if (i == wanted - 1) {
+                next_key[level] = buffer[i];
+                more = true;
+                break;
+            }
+            copies[level].push_back(buffer[i]);
+            budget--;
+        }
+        if (!more) {
+            level_copied[level] = 1;
+        }
+    }
+    for (int level = 0; level < num_levels; ++level) {
+        if (!level_copied[level]) {
+            return false;
+        }
+    }
+    read = nullptr;
+    buffer = std::vector<T>();
+    copied.store(true);
+    return true;
+}
+
+// key, untouched until now, leaves level. next is the key that follows it
+template <class T>
+void SnapshotState<T>::record_removal(int level, T key, const T *next) {
+    Removal removal;
+    removal.key = key;
+    removal.level = level;
+    removal.has_next = next != nullptr && touched.count(*next) == 0;
+    removal.next = removal.has_next ? *next : T();
+    touched[key] = removals.size();
+    removals.push_back(removal);
+    if (level < num_levels && !level_copied[level] && next_key[level] == key) {
+        if (removal.has_next) {
+            next_key[level] = removal.next;
+        }
+        else {
+            level_copied[level] = 1;
+        }
+    }
+}
+
+// put the keys removed before they were copied back in front of the keys
+//  that followed them, undoing the latest removal first. keys copied before
+//  they were removed are in place already
+template <class T>
+void SnapshotState<T>::assemble() {
+    std::vector<char> restore(removals.size(), 1);
+    for (int level = 0; level < num_levels; ++level) {
+        for (size_t i = 0; i < copies[level].size(); ++i) {
+            typename std::unordered_map<T, int>::const_iterator it = touched.find(copies[level][i]);
+            if (it != touched.end() && it->second >= 0) {
+                restore[it->second] = 0;
+            }
+        }
+    }
+    std::unordered_map<T, std::vector<int> > before; // by the key that followed, latest first
+    std::vector<std::vector<int> > at_end(num_levels);
+    for (int i = removals.size(); i-- > 0;) {
+        if (!restore[i] || removals[i].level >= num_levels) {
+            continue;
+        }
+        if (removals[i].has_next) {
+            before[removals[i].next].push_back(i);
+        }
+        else {
+            at_end[removals[i].level].push_back(i);
+        }
+    }
+    keys.resize(num_levels);
+    for (int level = 0; level < num_levels; ++level) {
+        for (size_t i = 0; i < copies[level].size(); ++i) {
+            typename std::unordered_map<T, std::vector<int> >::const_iterator it = before.find(copies[level][i]);
+            if (it != before.end()) {
+                append_restored(&it->second, before, keys[level]);
+            }
+            keys[level].push_back(copies[level][i]);
+        }
+        append_restored(&at_end[level], before, keys[level]);
+        std::vector<T>().swap(copies[level]);
+    }
+    std::unordered_map<T, int>().swap(touched);
+    std::vector<Removal>().swap(removals);
+}
+
+// append the keys of group, each preceded by the keys restored in front of
+//  it. the chains can be long, so they are followed with an explicit stack
+template <class T>
+void SnapshotState<T>::append_restored(const std::vector<int> *group,
+                                       const std::unordered_map<T, std::vector<int> > &before, std::vector<T> &out) {
+    struct Frame {
+        const std::vector<int> *group;
+        size_t position;
+        int removal; // appended once its group is, -1 for none
+    };
+    std::vector<Frame> stack(1, Frame{group, 0, -1});
+    while (!stack.empty()) {
+        Frame &top = stack.back();
+        if (top.position < top.group->size()) {
+            int removal = (*top.group)[top.position++];
+            typename std::unordered_map<T, std::vector<int> >::const_iterator it = before.find(removals[removal].key);
+            if (it != before.end()) {
+                stack.push_back(Frame{&it->second, 0, removal});
+            }
+            else {
+                out.push_back(removals[removal].key);
+            }
+        }
+        else {
+            if (top.removal >= 0) {
+                out.push_back(removals[top.removal].key);
+            }
+            stack.pop_back();
+        }
+    }
+}
+
+template <class T>
+class Snapshot {
+public:
+    Snapshot() {}
+    explicit Snapshot(const std::shared_ptr<SnapshotState<T> > &st) : state(st) {}
+
+    // a default-constructed or released handle is empty
+    bool is_valid() const {
+        return state != nullptr;
+    }
+
+    int num_levels() const {
+        if (!is_valid()) {
+            return 0;
+        }
+        return state->levels().size();
+    }
+
+    // keys of one level (tree) from the most to the least recently accessed
+    const std::vector<T>& level(int index) const {
+        static const std::vector<T> none;
+        if (!is_valid()) {
+            return none;
+        }
+        return state->levels()[index];
+    }
+
+    int size() const {
+        if (!is_valid()) {
+            return 0;
+        }
+        int total = 0;
+        const std::vector<std::vector<T> > &levels = state->levels();
+        for (size_t i = 0; i < levels.size(); ++i) {
+            total += levels[i].size();
+        }
+        return total;
+    }
+
+    // all keys from the most to the least recently accessed
+    std::vector<T> keys_by_recency() const {
+        std::vector<T> keys;
+        if (!is_valid()) {
+            return keys;
+        }
+        const std::vector<std::vector<T> > &levels = state->levels();
+        for (size_t i = 0; i < levels.size(); ++i) {
+            keys.insert(keys.end(), levels[i].begin(), levels[i].end());
+        }
+        return keys;
+    }
+
+    // all keys in ascending order
+    std::vector<T> keys() const {
+        std::vector<T> sorted = keys_by_recency();
+        std::sort(sorted.begin(), sorted.end());
+        return sorted;
+    }
+
+    void release() {
+        state.reset();
+    }
+
+private:
+    std::shared_ptr<SnapshotState<T> > state;
+};
+
+// the snapshots of one tree whose copy is under way. the owning tree wraps
+//  every write that reports the keys it moves in a SnapshotWrite, and calls
+//  before_write() before any other change and before its destruction, so that
+//  the outstanding snapshots stay readable
+template <class T>
+class SnapshotRegistry {
+public:
+    SnapshotRegistry() : unchanged(false), depth(0) {}
+
+    Snapshot<T> take(int num_levels, const typename SnapshotState<T>::Reader &read) {
+        if (capturing.empty() || !unchanged) {
+            capturing.push_back(std::make_shared<SnapshotState<T> >(num_levels, read));
+            unchanged = true;
+        }
+        return Snapshot<T>(capturing.back());
+    }
+
+    // finish the copies a handle is still held to, before a change that is
+    //  not journaled
+    void before_write() {
+        unchanged = false;
+        if (capturing.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < capturing.size(); ++i) {
+            SnapshotState<T> &state = *capturing[i];
+            if (depth == 0) {
+                state.lock.lock();
+            }
+            if (capturing[i].use_count() > 1) {
+                while (!state.copy_step()) {
+                }
+            }
+            state.lock.unlock();
+        }
+        capturing.clear();
+    }
+
+    // the copies under way stay locked from the start to the end of a write,
+    //  which then copies one more step of each. a write begun with none under
+    //  way is not counted: none can start before it ends
+    void begin_write() {
+        if (depth == 0 && capturing.empty()) {
+            unchanged = false;
+            return;
+        }
+        if (depth++ > 0) {
+            return;
+        }
+        unchanged = false;
+        size_t kept = 0;
+        for (size_t i = 0; i < capturing.size(); ++i) {
+            if (capturing[i].use_count() == 1) {
+                continue; // every handle was released
+            }
+            capturing[i]->lock.lock();
+            if (capturing[i]->copied.load()) { // a reader finished it
+                capturing[i]->lock.unlock();
+                continue;
+            }
+            capturing[i]->start();
+            capturing[kept++] = capturing[i];
+        }
+        capturing.resize(kept);
+    }
+
+    void end_write() {
+        if (depth == 0 || --depth > 0) {
+            return;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < capturing.size(); ++i) {
+            bool copied = capturing[i]->copy_step();
+            capturing[i]->lock.unlock();
+            if (!copied) {
+                capturing[kept++] = capturing[i];
+            }
+        }
+        capturing.resize(kept);
+    }
+
+    // the keys a write moves, reported as it moves them
+    void inserted(T key) {
+        if (capturing.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < capturing.size(); ++i) {
+            capturing[i]->touched.insert(std::pair<T, int>(key, -1));
+        }
+    }
+
+    // before key is removed from level, if it is there
+    void removing(int level, T key) {
+        if (capturing.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < capturing.size(); ++i) {
+            SnapshotState<T> &state = *capturing[i];
+            if (state.touched.count(key) != 0) {
+                continue;
+            }
+            buffer.clear();
+            if (state.read(level, &key, 1, buffer)) {
+                state.record_removal(level, key, buffer.empty() ? nullptr : &buffer[0]);
+            }
+        }
+    }
+
+    void removed_lru(int level, T key) {
+        if (capturing.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < capturing.size(); ++i) {
+            if (capturing[i]->touched.count(key) == 0) {
+                capturing[i]->record_removal(level, key, nullptr);
+            }
+        }
+    }
+
+    // the key that followed the most recent one is now the most recent
+    void removed_mru(int level, T key) {
+        if (capturing.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < capturing.size(); ++i) {
+            SnapshotState<T> &state = *capturing[i];
+            if (state.touched.count(key) != 0) {
+                continue;
+            }
+            buffer.clear();
+            state.read(level, nullptr, 1, buffer);
+            state.record_removal(level, key, buffer.empty() ? nullptr : &buffer[0]);
+        }
+    }
+
+private:
+    std::vector<std::shared_ptr<SnapshotState<T> > > capturing; // the newest last
+    bool unchanged; // whether the newest was taken after the last write
+    int depth; // of nested writes
+    std::vector<T> buffer;
+};
+
+// brackets a write whose moves are reported to the registry
+template <class T>
+class SnapshotWrite {
+public:
+    explicit SnapshotWrite(SnapshotRegistry<T> &reg) : registry(reg) {
+        registry.begin_write();
+    }
+    ~SnapshotWrite() {
+        registry.end_write();
+    }
+private:
+    SnapshotRegistry<T> &registry;
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,151 @@
+/*
+ * trace.h
+ *
+ * spans of the operations of the trees, for finding out where the time of a
+ * slow operation went. Built with WST_TRACE defined, WST_TRACE_SPAN(name)
+ * records the time from where it appears to the end of the enclosing block
+ * as one event in a ring of the last TRACE_RING_EVENTS events, shared by
+ * all threads. Recording is lock-free: a thread claims the next slot with
+ * one atomic increment, fills it, and marks it complete with the index it
+ * claimed, so that a dump skips slots that are being overwritten. Nested
+ * spans (a shift_back within an insert, a split_child within that) nest in
+ * the dump. trace_to_json() and dump_trace() write the ring in the Chrome
+ * trace event format, for chrome://tracing or Perfetto.
+ *
+ * Without WST_TRACE, WST_TRACE_SPAN expands to nothing and no code or data
+ * of the ring is used.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+const size_t TRACE_RING_EVENTS = 1 << 16;
+
+struct TraceEvent {
+    std::atomic<uint64_t> sequence; // index claimed + 1 once written, 0 while empty
+    const char *name; // a string literal
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t thread;
+};
+
+class TraceRing {
+public:
+    TraceRing() : next(0), events(TRACE_RING_EVENTS) {
+        for (size_t i = 0; i < events.size(); ++i) {
+            events[i].sequence.store(0, std::memory_order_relaxed);
+        }
+    }
+    void record(const char *name, uint64_t start_ns, uint64_t duration_ns, uint32_t thread) {
+        uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+        TraceEvent &event = events[index % events.size()];
+        event.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        event.name = name;
+        event.start_ns = start_ns;
+        event.duration_ns = duration_ns;
+        event.thread = thread;
+        event.sequence.store(index + 1, std::memory_order_release);
+    }
+    std::string to_json();
+    void clear();
+private:
+    std::atomic<uint64_t> next;
+    std::vector<TraceEvent> events;
+};
+
+inline TraceRing& trace_ring() {
+    static TraceRing ring;
+    return ring;
+}
+
+inline uint64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// small ids for the threads, in the order they first record an event
+inline uint32_t trace_thread_id() {
+    static std::atomic<uint32_t> next_id(0);
+    thread_local uint32_t id = next_id.fetch_add(1);
+    return id;
+}
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *span_name) : name(span_name), start_ns(trace_now_ns()) {}
+    ~TraceSpan() {
+        trace_ring().record(name, start_ns, trace_now_ns() - start_ns, trace_thread_id());
+    }
+private:
+    const char *name;
+    uint64_t start_ns;
+};
+
+// complete events ("ph": "X") of the slots written completely, in the
+//  order they ended. times are in microseconds
+inline std::string TraceRing::to_json() {
+    std::string json = "{\"traceEvents\":[";
+    uint64_t end = next.load(std::memory_order_acquire);
+    uint64_t begin = end > events.size() ? end - events.size() : 0;
+    bool first = true;
+    for (uint64_t index = begin; index < end; ++index) {
+        TraceEvent &event = events[index % events.size()];
+        if (event.sequence.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        const char *name = event.name;
+        uint64_t start_ns = event.start_ns;
+        uint64_t duration_ns = event.duration_ns;
+        uint32_t thread = event.thread;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (event.sequence.load(std::memory_order_relaxed) != index + 1) {
+            continue; // overwritten while being read
+        }
+        json += first ? "\n" : ",\n";
+        json += "{\"name\":\"" + std::string(name) + "\",\"cat\":\"wst\",\"ph\":\"X\",\"ts\":"
+            + std::to_string(start_ns / 1000.0) + ",\"dur\":" + std::to_string(duration_ns / 1000.0)
+            + ",\"pid\":0,\"tid\":" + std::to_string(thread) + "}";
+        first = false;
+    }
+    return json + "\n]}\n";
+}
+
+inline void TraceRing::clear() {
+    for (size_t i = 0; i < events.size(); ++i) {
+        events[i].sequence.store(0, std::memory_order_relaxed);
+    }
+    next.store(0, std::memory_order_release);
+}
+
+inline std::string trace_to_json() {
+    return trace_ring().to_json();
+}
+
+inline bool dump_trace(const std::string &path) {
+    std::ofstream ofs(path, std::ios::trunc);
+    ofs << trace_to_json();
+    return ofs.good();
+}
+
+inline void clear_trace() {
+    trace_ring().clear();
+}
+
+#define WST_TRACE_CONCAT_(a, b) a##b
+#define WST_TRACE_CONCAT(a, b) WST_TRACE_CONCAT_(a, b)
+
+#ifdef WST_TRACE
+#define WST_TRACE_SPAN(name) TraceSpan WST_TRACE_CONCAT(trace_span_, __LINE__)(name)
+#else
+#define WST_TRACE_SPAN(name) do {} while (0)
+#endif
+
+#endif // TRACE_H
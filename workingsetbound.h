@@ -0,0 +1,155 @@
+/*
+ * workingsetbound.h
+ *
+ * checks a working set tree against its working set bound on a workload.
+ * The working set number w(x) of an access to x is the number of distinct
+ * keys accessed since the previous access to x, x included; the tree
+ * promises an access cost of O(log w(x)). Every search of the workload is
+ * given its exact w(x) (counted with the Fenwick tree of mrcsimulator.h over
+ * access times) and its real cost: the nodes visited in every tree probed,
+ * plus the keys moved between trees by shift_back and shift_forward. The
+ * report gives the distribution of cost / log2(w(x) + 1), and the mean cost
+ * and ratio for every power of two of w(x). If the ratio grows with w(x),
+ * the bound does not hold for the tree's parameters on this workload.
+ *
+ * Inserts count as accesses and removed keys stop counting, so w(x) is the
+ * recency rank of x among the keys present, plus one. Searches for absent
+ * keys have no working set number and are only counted.
+*/
+
+#ifndef WORKINGSETBOUND_H
+#define WORKINGSETBOUND_H
+
+#include <algorithm> // for std::sort, std::max
+#include <cmath> // for std::log2
+#include <string>
+#include <vector>
+#include "mrcsimulator.h"
+#include "workload.h"
+
+const int BOUND_RATIO_BUCKETS = 64; // ratios of 64 and more share the last bucket
+
+struct WorkingSetBoundReport {
+    long long searches; // of present keys
+    long long misses; // searches of absent keys
+    long long search_cost; // nodes visited and keys shifted by the searches
+    long long update_cost; // by the inserts and removes
+    double log_sum; // of log2(w + 1) over the searches
+    std::vector<long long> ratio_histogram; // searches by floor(cost / log2(w + 1))
+    std::vector<double> ratio_percentiles; // p50, p90, p99, p99.9, max
+    // by floor(log2(w)): searches, their total cost and the sum of their ratios
+    std::vector<long long> bucket_searches;
+    std::vector<long long> bucket_cost;
+    std::vector<double> bucket_ratio;
+
+    WorkingSetBoundReport() : searches(0), misses(0), search_cost(0), update_cost(0), log_sum(0.0),
+        ratio_histogram(BOUND_RATIO_BUCKETS, 0) {}
+
+    // total cost of the searches over the sum of their bounds, which is what
+    //  an amortized bound limits
+    double amortized_ratio() const {
+        return log_sum == 0 ? 0.0 : search_cost / log_sum;
+    }
+    std::string to_string() const;
+};
+
+// the summary, then the ratio histogram and the table by w, as
+//  comma-separated lines
+inline std::string WorkingSetBoundReport::to_string() const {
+    std::string str = "searches," + std::to_string(searches) + "\nmisses," + std::to_string(misses)
+            + "\nsearch_cost," + std::to_string(search_cost) + "\nupdate_cost," + std::to_string(update_cost)
+            + "\namortized_ratio," + std::to_string(amortized_ratio()) + "\n";
+    const char *names[] = {"p50_ratio", "p90_ratio", "p99_ratio", "p999_ratio", "max_ratio"};
+    for (size_t p = 0; p < ratio_percentiles.size(); ++p) {
+        str += std::string(names[p]) + "," + std::to_string(ratio_percentiles[p]) + "\n";
+    }
+    str += "\nratio,searches\n";
+    for (int r = 0; r < BOUND_RATIO_BUCKETS; ++r) {
+        if (ratio_histogram[r] > 0) {
+            str += std::to_string(r) + "," + std::to_string(ratio_histogram[r]) + "\n";
+        }
+    }
+    str += "\nlog2_w,searches,mean_cost,mean_ratio\n";
+    for (size_t b = 0; b < bucket_searches.size(); ++b) {
+        if (bucket_searches[b] > 0) {
+            str += std::to_string(b) + "," + std::to_string(bucket_searches[b]) + ","
+                    + std::to_string(bucket_cost[b] * 1.0 / bucket_searches[b]) + ","
+                    + std::to_string(bucket_ratio[b] / bucket_searches[b]) + "\n";
+        }
+    }
+    return str;
+}
+
+// replay workload on tree, which should start empty. Tree is a
+//  WorkingSetTree<int, Policy>, or anything with its insert, search, remove,
+//  node_visits and shifted_keys
+template <class Tree>
+WorkingSetBoundReport verify_working_set_bound(Tree &tree, const Workload &workload) {
+    WorkingSetBoundReport report;
+    StackDistanceTracker tracker;
+    std::vector<double> ratios;
+    ratios.reserve(workload.ops.size());
+
+    for (size_t i = 0; i < workload.initial_keys.size(); ++i) {
+        tree.insert(workload.initial_keys[i]);
+        tracker.access(workload.initial_keys[i]);
+    }
+
+    for (size_t i = 0; i < workload.ops.size(); ++i) {
+        const WorkloadOp &op = workload.ops[i];
+        long long cost = tree.node_visits() + tree.shifted_keys();
+        if (op.type == WORKLOAD_INSERT) {
+            tree.insert(op.key);
+            tracker.access(op.key);
+            report.update_cost += tree.node_visits() + tree.shifted_keys() - cost;
+            continue;
+        }
+        if (op.type == WORKLOAD_REMOVE) {
+            tree.remove(op.key);
+            tracker.forget(op.key);
+            report.update_cost += tree.node_visits() + tree.shifted_keys() - cost;
+            continue;
+        }
+        bool found = tree.search(op.key);
+        cost = tree.node_visits() + tree.shifted_keys() - cost;
+        if (!found) {
+            report.misses++;
+            continue;
+        }
+        long long w = tracker.access(op.key) + 1;
+        if (w <= 0) {
+            w = 1; // a key the workload never inserted: the tree did not start empty
+        }
+        double bound = std::log2(w + 1.0);
+        double ratio = cost / bound;
+        report.searches++;
+        report.search_cost += cost;
+        report.log_sum += bound;
+        report.ratio_histogram[std::min(BOUND_RATIO_BUCKETS - 1, (int)ratio)]++;
+        ratios.push_back(ratio);
+
+        size_t bucket = 0;
+        while ((2LL << bucket) <= w) {
+            bucket++;
+        }
+        if (bucket >= report.bucket_searches.size()) {
+            report.bucket_searches.resize(bucket + 1, 0);
+            report.bucket_cost.resize(bucket + 1, 0);
+            report.bucket_ratio.resize(bucket + 1, 0.0);
+        }
+        report.bucket_searches[bucket]++;
+        report.bucket_cost[bucket] += cost;
+        report.bucket_ratio[bucket] += ratio;
+    }
+
+    if (!ratios.empty()) {
+        std::sort(ratios.begin(), ratios.end());
+        double percentiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+        for (int p = 0; p < 5; ++p) {
+            report.ratio_percentiles.push_back(ratios[(size_t)(percentiles[p] * (ratios.size() - 1))]);
+        }
+    }
+    return report;
+}
+
+#endif // WORKINGSETBOUND_H
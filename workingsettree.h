@@ -1,64 +1,467 @@
 #ifndef WORKINGSETTREE_H
 #define WORKINGSETTREE_H
 
+#include <algorithm> // for std::min
+#include <atomic>
+#include <cstdint>
+#include <cstring> // for std::memcpy
+#include <fstream>
+#include <functional> // for std::greater
+#include <queue>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <utility> // for std::pair
 #include "node.h"
+#include "autotune.h"
 #include "btree.h"
+#include "bplustree.h"
+#include "flattree.h"
+#include "level.h"
+#include "packedtree.h"
+#include "pagedtree.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "wstpolicy.h"
 
-const int DEFAULT_MINIMUM_DEGREE = 2;
-const int DEFAULT_SCALE_FACTOR = 2;
-const int BASE_HEIGHT = 2; // the max height of the smallest b-tree
+#if defined(__unix__) || defined(__APPLE__)
+#define WST_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-template <class T>
+// bounds on the number of distinct keys accessed since a key, derived from the
+//  tree holding it: every key of an earlier tree is counted, and the key's own
+//  tree contributes between none and all of its other keys. lower == upper
+//  when the count is exact. tree_index is -1 when the key is not found
+struct RecencyRank {
+    int tree_index;
+    long long lower;
+    long long upper;
+};
+
+// snapshot file format (all fields in host byte order):
+//   header: magic "WSTS", uint32 version, uint32 sizeof(T), int32 min_degree,
+//           int32 scale_factor, int32 base_height, int32 boundary mode,
+//           int32 base_capacity, uint32 number of trees
+//   per tree: int32 height the tree may grow to, uint64 number of keys,
+//           followed by the keys from the most to the least recently accessed
+// version 1 files lack base_height, boundary mode and base_capacity, and
+//  always use height boundaries with the first tree's height as base_height
+const char SNAPSHOT_MAGIC[4] = {'W', 'S', 'T', 'S'};
+const uint32_t SNAPSHOT_VERSION = 2;
+const int BATCH_REBUILD_RATIO = 4; // see insert_batch
+
+// the shape of the trees is set by Policy (see wstpolicy.h). the default
+//  DynamicPolicy is configured at runtime through the constructor. every
+//  level is held in a Level (see level.h): a FlatTree, BTree, BPlusTree,
+//  PackedTree or PagedTree depending on its index. set_weight_boundaries
+//  bounds the trees by the total weight of their keys instead
+template <class T, class Policy = DynamicPolicy>
 class WorkingSetTree {
 public:
-    WorkingSetTree() : size_(0), min_degree(DEFAULT_MINIMUM_DEGREE), scale_factor(DEFAULT_SCALE_FACTOR) {
-        BTree<T> *tree = new BTree<T>(min_degree, BASE_HEIGHT);
-        trees.push_back(tree);
+    WorkingSetTree() : size_(0), first_bplus_level(-1), first_packed_level(-1), first_paged_level(-1), page_pool_pages(0), shifts(0),
+          migrating_(false), migrated_levels(0), first_old_level(0), tuning(false), window_searches(0), window_misses(0),
+          window_inserts(0), ops_since_step(0), base_weight(0), max_total_weight(-1), total_weight_(0),
+          collecting_evictions(false) {
+        add_tree();
     }
-    WorkingSetTree(int degree, int factor = DEFAULT_SCALE_FACTOR) : size_(0), min_degree(degree), scale_factor(factor) {
-        BTree<T> *tree = new BTree<T>(min_degree, BASE_HEIGHT);
-        trees.push_back(tree);
+    WorkingSetTree(int degree, int factor = DEFAULT_SCALE_FACTOR)
+        : size_(0), policy(degree, factor), first_bplus_level(-1), first_packed_level(-1), first_paged_level(-1), page_pool_pages(0), shifts(0),
+          migrating_(false), migrated_levels(0), first_old_level(0), tuning(false), window_searches(0), window_misses(0),
+          window_inserts(0), ops_since_step(0), base_weight(0), max_total_weight(-1), total_weight_(0),
+          collecting_evictions(false) {
+        add_tree();
+    }
+    explicit WorkingSetTree(const Policy &pol)
+        : size_(0), policy(pol), first_bplus_level(-1), first_packed_level(-1), first_paged_level(-1), page_pool_pages(0), shifts(0),
+          migrating_(false), migrated_levels(0), first_old_level(0), tuning(false), window_searches(0), window_misses(0),
+          window_inserts(0), ops_since_step(0), base_weight(0), max_total_weight(-1), total_weight_(0),
+          collecting_evictions(false) {
+        add_tree();
     }
     ~WorkingSetTree();
     void insert(T value);
+    // insert a key of the given weight, e.g. the bytes of the object cached
+    //  under it. weights count only under weight boundaries
+    void insert(T value, long long weight);
+    // insert n keys as if one after another, the last becoming the most
+    //  recent. as for insert, the keys must not be in the tree already; a key
+    //  repeated in the batch is inserted once, at its last position. under
+    //  weight boundaries every key weighs 1 unless weights gives the weight
+    //  of each, as insert(value, weight) would
+    void insert_batch(const T *keys, size_t n);
+    void insert_batch(const T *keys, const long long *weights, size_t n);
     bool search(T val);
     bool remove(T val);
+    // remove every key in [lo, hi], or the n given keys, returning how many
+    //  were removed. a tree rebuilt from the keys it keeps is filled as build
+    //  fills it (see load_fill in wstpolicy.h), and the trees are refilled
+    //  once at the end
+    int remove_range(T lo, T hi);
+    int remove_batch(const T *keys, int n);
     int size();
     std::string to_string();
     std::string print_list();
+    std::vector<int> tree_sizes(); // number of keys in each tree, from the most recent tree
+    std::vector<MemoryStats> tree_memory_stats(); // memory held by each tree
+    MemoryStats memory_stats(); // memory held by all trees together
+    // nodes visited by the trees, counted from when they were last rebuilt
+    //  (by load or by a change of container)
+    long long node_visits();
+    long long shifted_keys(); // keys moved between trees by shift_back and shift_forward
+    // compact the trees filled below min_fill, returning how many were compacted
+    int compact(double min_fill = DEFAULT_MIN_FILL, double target_fill = DEFAULT_TARGET_FILL);
+    Snapshot<T> snapshot(); // O(1) point-in-time view of every tree, see snapshot.h
+    std::vector<T> range(T lo, T hi); // keys in [lo, hi] in ascending order
+    // a debug helper, linear in the size of the tree holding val when exact
+    RecencyRank recency_rank(T val, bool exact = false);
+    bool save(const std::string &path);
+    bool load(const std::string &path);
+    // replace the contents with n distinct keys, as if inserted in order into
+    //  an empty tree, building the trees in parallel on up to threads threads
+    //  (0 for one per core)
+    void build(const T *keys, int n, int threads = 0);
+    // keep the trees from first_level on as BPlusTree, with every key in a
+    //  linked leaf (see bplustree.h)
+    void set_bplus_trees(int first_level);
+    // keep the trees from first_level on as PackedTree, with compressed keys
+    //  (see packedtree.h). returns false, changing nothing, unless T is an
+    //  integer type
+    bool set_packed_storage(int first_level);
+#ifdef WST_HAVE_PAGED_STORAGE
+    // keep the trees from first_level on in paged storage (see pagedtree.h),
+    //  with files in directory and at most pool_pages pages of each in memory.
+    //  returns false, changing nothing, if no file can be created in directory
+    bool set_paged_storage(int first_level, const std::string &directory, int pool_pages);
+    // whether a paged tree could not create, read or write its file, so that
+    //  its pages stay in memory beyond the pool
+    bool paged_storage_failed();
+#endif
+    // sample the trees holding the keys searched for and retune the scale
+    //  factor and base height to the layout the cost model of autotune.h
+    //  expects to be cheapest, every options.window searches
+    void set_auto_tuning(bool enabled, const TuningOptions &options = TuningOptions());
+    // move to a policy with the given parameters, keeping the boundary mode.
+    //  the trees are rebuilt one level at a time, every step_interval
+    //  operations, while every operation keeps seeing every key. returns
+    //  false, changing nothing, if the policy does not accept them or the
+    //  trees are under weight boundaries
+    bool retune(int degree, int factor, int base);
+    Policy get_policy(); // the policy being migrated to while migrating
+    bool migrating(); // whether trees of the previous policy remain
+    void finish_migration(); // rebuild the remaining levels now
+    // searches that found their key in each tree, and misses, in the current
+    //  tuning window
+    std::vector<long long> level_hit_counts();
+    long long window_miss_count();
+    // bound the trees by the total weight of their keys instead of by the
+    //  policy: tree i holds at most base * scale_factor^i, and while all the
+    //  keys together weigh more than max_total (-1 for no cap), the least
+    //  recent keys are evicted. keys that were inserted without boundaries
+    //  weigh 1. a base of 0 returns to the boundaries of the policy
+    void set_weight_boundaries(long long base, long long max_total = -1);
+    long long total_weight();
+    std::vector<long long> tree_weights(); // total weight of each tree, from the most recent tree
+    // keep the keys the weight cap evicts for take_evictions, which must then
+    //  be called regularly. off by default, so that nothing accumulates
+    void collect_evictions(bool enabled);
+    // the keys evicted by the weight cap since the last call, from the least
+    //  recent, while collect_evictions is on
+    std::vector<T> take_evictions();
 private:
     int size_;
-    int min_degree;
-    int scale_factor;
-    std::vector<BTree<T>*> trees;
+    Policy policy;
+    int first_bplus_level; // -1 while no tree is a b+-tree
+    int first_packed_level; // -1 while no tree is packed
+    int first_paged_level; // -1 while every tree is held in memory
+    std::string page_directory;
+    int page_pool_pages;
+    long long shifts;
+    // while migrating, the first migrated_levels trees follow policy and the
+    //  rest follow old_policy, from its level first_old_level on
+    Policy old_policy;
+    bool migrating_;
+    int migrated_levels;
+    int first_old_level;
+    bool tuning;
+    TuningOptions tuning_options;
+    std::vector<long long> hits_by_level;
+    long long window_searches;
+    long long window_misses;
+    long long window_inserts;
+    long long ops_since_step;
+    // under weight boundaries the weight of every key is kept here, and the
+    //  weight of every tree is updated wherever a key enters or leaves it
+    long long base_weight; // 0 while the policy bounds the trees
+    long long max_total_weight;
+    long long total_weight_;
+    std::vector<long long> weight_by_tree;
+    std::unordered_map<T, long long> weights;
+    bool collecting_evictions;
+    std::vector<T> evictions;
+    std::vector<Level<T>*> trees;
+    SnapshotRegistry<T> snapshots;
+    void add_tree();
+    Level<T>* new_level(const Policy &pol, int index, int level);
+    const Policy& policy_for(int index, int &level);
+    void rebuild_trees_from(int first_level);
+    Level<T>* new_packed_tree(const Policy &pol, int level, std::true_type);
+    Level<T>* new_packed_tree(const Policy &pol, int level, std::false_type);
+    void migrate_step();
+    void after_operation();
+    void evaluate_tuning();
+    void reset_tuning_window();
+    bool weighted();
+    long long& tree_weight(int index);
+    long long weight_limit(int index);
+    void move_weight(T key, int from, int to);
+    void recount_weights();
+    void rebalance();
+    void evict_over_weight();
     void shift_back(int start_tree_index);
     void shift_forward(int tree_index);
+    void refill_from(int tree_index);
+    bool over_capacity(int index);
+    bool under_capacity(int index);
+    bool load_from_buffer(const char *data, size_t length);
 };
 
-template <class T>
-WorkingSetTree<T>::~WorkingSetTree() {
+template <class T, class Policy>
+WorkingSetTree<T, Policy>::~WorkingSetTree() {
+    snapshots.before_write();
     int num_trees = trees.size();
     for (int i = 0; i < num_trees; ++i) {
         delete trees[i];
     }
 }
 
-template <class T>
-void WorkingSetTree<T>::insert(T value) {
+// append an empty tree whose max height is given by the policy
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::add_tree() {
+    int level;
+    const Policy &pol = policy_for(trees.size(), level);
+    trees.push_back(new_level(pol, trees.size(), level));
+}
+
+// an empty tree for the given index in trees, shaped by pol at level
+template <class T, class Policy>
+Level<T>* WorkingSetTree<T, Policy>::new_level(const Policy &pol, int index, int level) {
+#ifdef WST_HAVE_PAGED_STORAGE
+    if (first_paged_level >= 0 && index >= first_paged_level) {
+        return new LevelAdapter<T, PagedTree<T> >(page_directory, page_pool_pages,
+                                                  pol.min_degree(), pol.tree_height(level));
+    }
+#endif
+    if (first_packed_level >= 0 && index >= first_packed_level) {
+        return new_packed_tree(pol, level, std::is_integral<T>());
+    }
+    else if (first_bplus_level >= 0 && index >= first_bplus_level) {
+        return new LevelAdapter<T, BPlusTree<T> >(pol.min_degree(), pol.tree_height(level));
+    }
+    else if (index < pol.flat_levels()) {
+        return new LevelAdapter<T, FlatTree<T> >(pol.min_degree(), pol.tree_height(level));
+    }
+    return new LevelAdapter<T, BTree<T> >(pol.min_degree(), pol.tree_height(level));
+}
+
+// the policy the tree at index follows, and its level under that policy
+template <class T, class Policy>
+const Policy& WorkingSetTree<T, Policy>::policy_for(int index, int &level) {
+    if (migrating_ && index >= migrated_levels) {
+        level = index - migrated_levels + first_old_level;
+        return old_policy;
+    }
+    level = index;
+    return policy;
+}
+
+template <class T, class Policy>
+Level<T>* WorkingSetTree<T, Policy>::new_packed_tree(const Policy &pol, int level, std::true_type) {
+    return new LevelAdapter<T, PackedTree<T> >(pol.min_degree(), pol.tree_height(level));
+}
+
+// never called: set_packed_storage refuses keys that are not integers
+template <class T, class Policy>
+Level<T>* WorkingSetTree<T, Policy>::new_packed_tree(const Policy &pol, int level, std::false_type) {
+    return new LevelAdapter<T, BTree<T> >(pol.min_degree(), pol.tree_height(level));
+}
+
+// replace the trees at or past first_level with the containers add_tree now
+//  chooses, keeping their keys and recency order
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::rebuild_trees_from(int first_level) {
+    std::vector<Level<T>*> old_trees(trees.begin() + std::min<size_t>(first_level, trees.size()), trees.end());
+    trees.resize(trees.size() - old_trees.size());
+    for (size_t i = 0; i < old_trees.size(); ++i) {
+        std::vector<T> keys = old_trees[i]->keys_by_recency();
+        delete old_trees[i];
+        add_tree();
+        trees.back()->bulk_load(keys.data(), keys.size());
+    }
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::set_bplus_trees(int first_level) {
+    finish_migration();
+    snapshots.before_write();
+    first_bplus_level = first_level;
+    rebuild_trees_from(first_level);
+}
+
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::set_packed_storage(int first_level) {
+    if (!std::is_integral<T>::value) {
+        return false;
+    }
+    finish_migration();
+    snapshots.before_write();
+    first_packed_level = first_level;
+    rebuild_trees_from(first_level);
+    return true;
+}
+
+#ifdef WST_HAVE_PAGED_STORAGE
+// trees already at or past first_level are moved into paged storage
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::set_paged_storage(int first_level, const std::string &directory, int pool_pages) {
+    if (PagePool(directory, MIN_POOL_PAGES).failed()) {
+        return false;
+    }
+    finish_migration();
+    snapshots.before_write();
+    first_paged_level = first_level;
+    page_directory = directory;
+    page_pool_pages = pool_pages;
+    rebuild_trees_from(first_level);
+    return true;
+}
+
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::paged_storage_failed() {
+    for (size_t i = 0; i < trees.size(); ++i) {
+        LevelAdapter<T, PagedTree<T> > *paged = dynamic_cast<LevelAdapter<T, PagedTree<T> >*>(trees[i]);
+        if (paged != nullptr && paged->container().page_pool().failed()) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::insert(T value) {
+    insert(value, 1);
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::insert(T value, long long weight) {
+    WST_TRACE_SPAN("WorkingSetTree::insert");
+    SnapshotWrite<T> write(snapshots);
+    snapshots.inserted(value);
     trees[0]->insert(value);
+    if (weighted()) {
+        weights[value] = weight;
+        tree_weight(0) += weight;
+        total_weight_ += weight;
+    }
     shift_back(0);
     size_++;
+    window_inserts++;
+    evict_over_weight();
+    after_operation();
 }
 
-template <class T>
-bool WorkingSetTree<T>::search(T val) {
+// the batch is ordered by recency once, then enters every tree as one
+//  segment: a tree takes the incoming keys as its most recent ones and passes
+//  the keys it no longer has room for, its least recent, on to the next tree
+//  as the next segment. a tree receiving at least 1/BATCH_REBUILD_RATIO of
+//  its size is rebuilt from the merged keys instead of taking them one by one,
+//  keeping as many as build would give it (see load_keys in wstpolicy.h)
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::insert_batch(const T *keys, size_t n) {
+    insert_batch(keys, nullptr, n);
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::insert_batch(const T *keys, const long long *key_weights, size_t n) {
+    WST_TRACE_SPAN("WorkingSetTree::insert_batch");
+    snapshots.before_write();
+
+    // keep the last occurrence of every key, ordered from the most recent
+    std::vector<std::pair<T, size_t> > by_key(n);
+    for (size_t i = 0; i < n; ++i) {
+        by_key[i] = std::pair<T, size_t>(keys[i], i);
+    }
+    std::sort(by_key.begin(), by_key.end());
+    std::vector<char> kept(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        if (i + 1 == n || by_key[i].first < by_key[i + 1].first) {
+            kept[by_key[i].second] = 1;
+        }
+    }
+    if (weighted()) {
+        // the segments are sized by key count, so the keys go in one by one,
+        //  from the least recent, each with the weight at its last position
+        for (size_t i = 0; i < n; ++i) {
+            if (kept[i]) {
+                insert(keys[i], key_weights != nullptr ? key_weights[i] : 1);
+            }
+        }
+        return;
+    }
+    std::vector<T> segment;
+    for (size_t i = n; i-- > 0;) {
+        if (kept[i]) {
+            segment.push_back(keys[i]);
+        }
+    }
+    size_ += segment.size();
+    window_inserts += segment.size();
+
+    std::vector<T> merged;
+    for (int index = 0; !segment.empty(); ++index) {
+        if (index == (int)trees.size()) {
+            add_tree();
+        }
+        Level<T> *tree = trees[index];
+        if (segment.size() * BATCH_REBUILD_RATIO >= (size_t)tree->size()) {
+            merged = tree->keys_by_recency();
+            merged.insert(merged.begin(), segment.begin(), segment.end());
+            int level;
+            const Policy &pol = policy_for(index, level);
+            size_t keep = (size_t)std::min<long long>(pol.load_keys(level), merged.size());
+            tree->bulk_load(merged.data(), keep, pol.load_fill());
+            segment.assign(merged.begin() + keep, merged.end());
+            shifts += segment.size();
+            continue;
+        }
+        for (size_t i = segment.size(); i-- > 0;) {
+            tree->insert(segment[i]);
+        }
+        segment.clear();
+        while (over_capacity(index)) {
+            segment.push_back(tree->remove_lru());
+        }
+        std::reverse(segment.begin(), segment.end());
+        shifts += segment.size();
+    }
+    after_operation();
+}
+
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::search(T val) {
+    WST_TRACE_SPAN("WorkingSetTree::search");
+    SnapshotWrite<T> write(snapshots);
 
     int index = 0;
     int num_trees = trees.size();
     while (index < num_trees) {
 //        std::pair<Node<T>*, int> node_index = trees[index]->search(val);
+        snapshots.removing(index, val);
         if (!trees[index]->remove(val)) { // val not found in this tree
             index++;
         }
@@ -67,73 +470,591 @@ bool WorkingSetTree<T>::search(T val) {
             if (new_index < 0) {
                 new_index = 0;
             }
+            snapshots.inserted(val);
             trees[new_index]->insert(val);
+            move_weight(val, index, new_index);
             shift_back(new_index);
             shift_forward(index);
-
+            if (tuning && !migrating_) {
+                if ((int)hits_by_level.size() <= index) {
+                    hits_by_level.resize(index + 1, 0);
+                }
+                hits_by_level[index]++;
+                window_searches++;
+            }
+            after_operation();
             return true;
         }
     }
+    if (tuning && !migrating_) {
+        window_misses++;
+        window_searches++;
+    }
+    after_operation();
     return false;
 
 }
 
 
-template <class T>
-bool WorkingSetTree<T>::remove(T val) {
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::remove(T val) {
+    WST_TRACE_SPAN("WorkingSetTree::remove");
+    SnapshotWrite<T> write(snapshots);
     int index = 0;
     int num_trees = trees.size();
     while (index < num_trees) {
+        snapshots.removing(index, val);
         if (trees[index]->remove(val)) {
+            if (weighted()) {
+                typename std::unordered_map<T, long long>::iterator it = weights.find(val);
+                tree_weight(index) -= it->second;
+                total_weight_ -= it->second;
+                weights.erase(it);
+            }
             shift_forward(index);
             size_--;
+            after_operation();
             return true;
         }
         index++;
     }
+    after_operation();
     return false;
 }
 
-template <class T>
-int WorkingSetTree<T>::size() {
+template <class T, class Policy>
+int WorkingSetTree<T, Policy>::remove_range(T lo, T hi) {
+    WST_TRACE_SPAN("WorkingSetTree::remove_range");
+    snapshots.before_write();
+    int removed = 0;
+    int first_changed = -1;
+    int num_trees = trees.size();
+    std::vector<T> in_range;
+    for (int i = 0; i < num_trees; ++i) {
+        if (weighted()) {
+            in_range.clear();
+            trees[i]->append_range(lo, hi, in_range);
+            for (size_t k = 0; k < in_range.size(); ++k) {
+                typename std::unordered_map<T, long long>::iterator it = weights.find(in_range[k]);
+                tree_weight(i) -= it->second;
+                total_weight_ -= it->second;
+                weights.erase(it);
+            }
+        }
+        int level;
+        int from_tree = trees[i]->remove_range(lo, hi, policy_for(i, level).load_fill());
+        if (from_tree > 0 && first_changed < 0) {
+            first_changed = i;
+        }
+        removed += from_tree;
+    }
+    if (first_changed >= 0) {
+        refill_from(first_changed);
+    }
+    size_ -= removed;
+    after_operation();
+    return removed;
+}
+
+// every tree is offered the whole batch: which tree holds a key is not known
+//  without searching for it
+template <class T, class Policy>
+int WorkingSetTree<T, Policy>::remove_batch(const T *keys, int n) {
+    WST_TRACE_SPAN("WorkingSetTree::remove_batch");
+    snapshots.before_write();
+    std::vector<T> sorted(keys, keys + n);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    int removed = 0;
+    int first_changed = -1;
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees && removed < (int)sorted.size(); ++i) {
+        for (size_t k = 0; weighted() && k < sorted.size(); ++k) {
+            typename std::unordered_map<T, long long>::iterator it = weights.find(sorted[k]);
+            if (it != weights.end() && trees[i]->contains(sorted[k])) {
+                tree_weight(i) -= it->second;
+                total_weight_ -= it->second;
+                weights.erase(it);
+            }
+        }
+        int level;
+        int from_tree = trees[i]->remove_batch(sorted.data(), sorted.size(), policy_for(i, level).load_fill());
+        if (from_tree > 0 && first_changed < 0) {
+            first_changed = i;
+        }
+        removed += from_tree;
+    }
+    if (first_changed >= 0) {
+        refill_from(first_changed);
+    }
+    size_ -= removed;
+    after_operation();
+    return removed;
+}
+
+template <class T, class Policy>
+int WorkingSetTree<T, Policy>::size() {
     return size_;
 }
 
-template <class T>
-void WorkingSetTree<T>::shift_back(int start_tree_index) {
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::shift_back(int start_tree_index) {
+    WST_TRACE_SPAN("WorkingSetTree::shift_back");
 
     int index = start_tree_index;
-    while (trees[index]->get_height() > trees[index]->get_max_height()) {
-        int max_height = trees[index]->get_max_height();
-        while (trees[index]->get_height() > max_height) {
+    while (over_capacity(index)) {
+        while (over_capacity(index)) {
             T lru = trees[index]->remove_lru();
+            snapshots.removed_lru(index, lru);
             if (trees.size() == index + 1) {
-                //trees.push_back(std::make_shared<BTree<T>>(min_degree, trees.back()->get_max_height()*scale_factor));
-                BTree<T> *tree = new BTree<T>(min_degree, trees.back()->get_max_height() * scale_factor);
-                trees.push_back(tree);
+                add_tree();
             }
+            snapshots.inserted(lru);
             trees[index + 1]->insert(lru);
+            move_weight(lru, index, index + 1);
+            shifts++;
         }
         index++;
     }
 }
 
-template <class T>
-void WorkingSetTree<T>::shift_forward(int tree_index) {
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::shift_forward(int tree_index) {
+    WST_TRACE_SPAN("WorkingSetTree::shift_forward");
     int index = tree_index;
     int num_trees = trees.size();
-    while ((index + 1<num_trees) && trees[index]->get_height() < trees[index]->get_max_height()) { // TODO what is the condition for shifting forward??
-        int max_height = trees[index]->get_max_height();
-        while (trees[index]->get_height() < max_height) {
+    while ((index + 1<num_trees) && under_capacity(index)) {
+        while (under_capacity(index) && !trees[index + 1]->is_empty()) {
             T mru = trees[index + 1]->remove_mru();
+            snapshots.removed_mru(index + 1, mru);
+            snapshots.inserted(mru);
+            if (weighted() && tree_weight(index) + weights.find(mru)->second > weight_limit(index)) {
+                trees[index + 1]->insert(mru); // back as its most recent key, where it was
+                break;
+            }
             trees[index]->insert_lru(mru);
+            move_weight(mru, index + 1, index);
+            shifts++;
         }
         index++;
     }
 }
 
-template <class T>
-std::string WorkingSetTree<T>::to_string() {
+// after keys were removed from any number of trees from tree_index on, pull
+//  keys forward in one pass from the front. every tree is topped up from the
+//  most recent keys of the first later tree that still has any, so a tree
+//  behind one that ran dry fills up as it would by removing the keys one by
+//  one. source only moves back, past trees that are empty
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::refill_from(int tree_index) {
+    int num_trees = trees.size();
+    int source = tree_index + 1;
+    for (int index = tree_index; index + 1 < num_trees; ++index) {
+        source = std::max(source, index + 1);
+        while (under_capacity(index)) {
+            while (source < num_trees && trees[source]->is_empty()) {
+                source++;
+            }
+            if (source == num_trees) {
+                return;
+            }
+            T mru = trees[source]->remove_mru();
+            snapshots.removed_mru(source, mru);
+            snapshots.inserted(mru);
+            if (weighted() && tree_weight(index) + weights.find(mru)->second > weight_limit(index)) {
+                trees[source]->insert(mru); // back as its most recent key, where it was
+                break;
+            }
+            trees[index]->insert_lru(mru);
+            move_weight(mru, source, index);
+            shifts++;
+        }
+    }
+}
+
+// whether the tree at index holds more keys than its level allows, by height
+//  or by key count depending on the policy, or by weight
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::over_capacity(int index) {
+    if (weighted()) {
+        return tree_weight(index) > weight_limit(index);
+    }
+    int level;
+    const Policy &pol = policy_for(index, level);
+    if (pol.boundaries() == KEY_COUNT_BOUNDARIES) {
+        return trees[index]->size() > pol.capacity(level);
+    }
+    return trees[index]->get_height() > pol.max_height(level);
+}
+
+// whether the tree at index should take keys from the next tree. under weight
+//  boundaries shift_forward also checks that the key fits
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::under_capacity(int index) {
+    if (weighted()) {
+        return tree_weight(index) < weight_limit(index);
+    }
+    int level;
+    const Policy &pol = policy_for(index, level);
+    if (pol.boundaries() == KEY_COUNT_BOUNDARIES) {
+        return trees[index]->size() < pol.capacity(level);
+    }
+    return trees[index]->get_height() < pol.max_height(level);
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::set_auto_tuning(bool enabled, const TuningOptions &options) {
+    tuning = enabled;
+    tuning_options = options;
+    reset_tuning_window();
+}
+
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::retune(int degree, int factor, int base) {
+    Policy next = policy;
+    if (weighted() || degree < 2 || factor < 1 || base < 1
+            || !next.configure(degree, factor, base, policy.boundaries(), policy.base_capacity())) {
+        return false;
+    }
+    finish_migration();
+    if (degree == policy.min_degree() && factor == policy.scale_factor() && base == policy.base_height()) {
+        return true;
+    }
+    old_policy = policy;
+    policy = next;
+    migrating_ = true;
+    migrated_levels = 0;
+    first_old_level = 0;
+    ops_since_step = 0;
+    reset_tuning_window();
+    return true;
+}
+
+template <class T, class Policy>
+Policy WorkingSetTree<T, Policy>::get_policy() {
+    return policy;
+}
+
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::migrating() {
+    return migrating_;
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::finish_migration() {
+    while (migrating_) {
+        migrate_step();
+    }
+}
+
+template <class T, class Policy>
+std::vector<long long> WorkingSetTree<T, Policy>::level_hit_counts() {
+    return hits_by_level;
+}
+
+template <class T, class Policy>
+long long WorkingSetTree<T, Policy>::window_miss_count() {
+    return window_misses;
+}
+
+// build the tree of the next level of the new policy from the most recent
+//  keys of the trees of the old policy, which come right after it in recency
+//  order. it takes the keys and node fill build would give it, which are
+//  also what the cost model of autotune.h expects. old trees drained
+//  completely are dropped, and the next old tree gives up its most recent
+//  keys one by one. the migration is done when no old tree is left
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::migrate_step() {
+    WST_TRACE_SPAN("WorkingSetTree::migrate_step");
+    snapshots.before_write();
+
+    int level = migrated_levels;
+    long long share = policy.load_keys(level);
+    std::vector<T> keys;
+    while ((int)trees.size() > migrated_levels && (long long)keys.size() < share) {
+        Level<T> *old_tree = trees[migrated_levels];
+        long long wanted = share - (long long)keys.size();
+        if (old_tree->size() <= wanted) {
+            std::vector<T> tree_keys = old_tree->keys_by_recency();
+            keys.insert(keys.end(), tree_keys.begin(), tree_keys.end());
+            delete old_tree;
+            trees.erase(trees.begin() + migrated_levels);
+            first_old_level++;
+        }
+        else {
+            for (long long i = 0; i < wanted; ++i) {
+                keys.push_back(old_tree->remove_mru());
+            }
+        }
+    }
+    while ((int)trees.size() > migrated_levels && trees.back()->is_empty()) {
+        delete trees.back();
+        trees.pop_back();
+    }
+
+    Level<T> *tree = new_level(policy, migrated_levels, level);
+    tree->bulk_load(keys.data(), keys.size(), policy.load_fill());
+    trees.insert(trees.begin() + migrated_levels, tree);
+    migrated_levels++;
+    if ((int)trees.size() == migrated_levels) {
+        migrating_ = false;
+    }
+}
+
+// called at the end of every public operation changing the recency order
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::after_operation() {
+    if (migrating_) {
+        if (++ops_since_step >= tuning_options.step_interval) {
+            ops_since_step = 0;
+            migrate_step();
+        }
+    }
+    else if (tuning && !weighted() && window_searches >= tuning_options.window) {
+        evaluate_tuning();
+    }
+}
+
+// estimate the cost of the window under every candidate scale factor and base
+//  height, and migrate to the cheapest if it saves enough
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::evaluate_tuning() {
+    std::vector<int> sizes = tree_sizes();
+    double current = estimated_window_cost(policy, sizes, hits_by_level, window_misses, window_inserts);
+    double best = current;
+    int best_factor = policy.scale_factor();
+    int best_base = policy.base_height();
+    for (size_t f = 0; f < tuning_options.scale_factors.size(); ++f) {
+        for (size_t b = 0; b < tuning_options.base_heights.size(); ++b) {
+            int factor = tuning_options.scale_factors[f];
+            int base = tuning_options.base_heights[b];
+            Policy candidate = policy;
+            if (factor < 1 || base < 1 || !candidate.configure(policy.min_degree(), factor, base, policy.boundaries(),
+                                                               policy.base_capacity())) {
+                continue;
+            }
+            double cost = estimated_window_cost(candidate, sizes, hits_by_level, window_misses, window_inserts);
+            if (cost < best) {
+                best = cost;
+                best_factor = factor;
+                best_base = base;
+            }
+        }
+    }
+    if (best <= current * (1.0 - tuning_options.min_gain)) {
+        retune(policy.min_degree(), best_factor, best_base);
+    }
+    reset_tuning_window();
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::reset_tuning_window() {
+    hits_by_level.clear();
+    window_searches = 0;
+    window_misses = 0;
+    window_inserts = 0;
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::set_weight_boundaries(long long base, long long max_total) {
+    finish_migration();
+    snapshots.before_write();
+    if (base <= 0) {
+        base_weight = 0;
+        max_total_weight = -1;
+        weights.clear();
+        weight_by_tree.clear();
+        total_weight_ = 0;
+        rebalance();
+        return;
+    }
+    bool was_weighted = weighted();
+    base_weight = base;
+    max_total_weight = max_total;
+    if (!was_weighted) {
+        weights.clear();
+        recount_weights();
+    }
+    rebalance();
+    evict_over_weight();
+}
+
+template <class T, class Policy>
+long long WorkingSetTree<T, Policy>::total_weight() {
+    return total_weight_;
+}
+
+template <class T, class Policy>
+std::vector<long long> WorkingSetTree<T, Policy>::tree_weights() {
+    std::vector<long long> result;
+    for (size_t i = 0; i < trees.size(); ++i) {
+        result.push_back(tree_weight(i));
+    }
+    return result;
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::collect_evictions(bool enabled) {
+    collecting_evictions = enabled;
+    if (!enabled) {
+        std::vector<T>().swap(evictions);
+    }
+}
+
+template <class T, class Policy>
+std::vector<T> WorkingSetTree<T, Policy>::take_evictions() {
+    std::vector<T> taken;
+    taken.swap(evictions);
+    return taken;
+}
+
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::weighted() {
+    return base_weight > 0;
+}
+
+// the weight of the tree at index, sized lazily as trees are added
+template <class T, class Policy>
+long long& WorkingSetTree<T, Policy>::tree_weight(int index) {
+    if ((int)weight_by_tree.size() <= index) {
+        weight_by_tree.resize(index + 1, 0);
+    }
+    return weight_by_tree[index];
+}
+
+template <class T, class Policy>
+long long WorkingSetTree<T, Policy>::weight_limit(int index) {
+    return scaled_weight(base_weight, policy.scale_factor(), index);
+}
+
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::move_weight(T key, int from, int to) {
+    if (!weighted() || from == to) {
+        return;
+    }
+    long long weight = weights.find(key)->second;
+    tree_weight(from) -= weight;
+    tree_weight(to) += weight;
+}
+
+// total the weights of every tree from the keys it holds. keys without a
+//  weight are given a weight of 1
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::recount_weights() {
+    weight_by_tree.assign(trees.size(), 0);
+    total_weight_ = 0;
+    for (size_t i = 0; i < trees.size(); ++i) {
+        std::vector<T> keys = trees[i]->keys_by_recency();
+        for (size_t k = 0; k < keys.size(); ++k) {
+            long long &weight = weights[keys[k]];
+            if (weight == 0) {
+                weight = 1;
+            }
+            weight_by_tree[i] += weight;
+        }
+        total_weight_ += weight_by_tree[i];
+    }
+}
+
+// bring every tree within the boundaries in force after they changed
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::rebalance() {
+    for (size_t i = 0; i < trees.size(); ++i) {
+        shift_back(i);
+    }
+    refill_from(0);
+}
+
+// drop the least recent keys, from the last trees, until the cap is met
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::evict_over_weight() {
+    if (!weighted() || max_total_weight < 0) {
+        return;
+    }
+    int last = trees.size() - 1;
+    while (total_weight_ > max_total_weight && last >= 0) {
+        if (trees[last]->is_empty()) {
+            last--;
+            continue;
+        }
+        T lru = trees[last]->remove_lru();
+        snapshots.removed_lru(last, lru);
+        typename std::unordered_map<T, long long>::iterator it = weights.find(lru);
+        tree_weight(last) -= it->second;
+        total_weight_ -= it->second;
+        weights.erase(it);
+        if (collecting_evictions) {
+            evictions.push_back(lru);
+        }
+        size_--;
+    }
+}
+
+template <class T, class Policy>
+std::vector<int> WorkingSetTree<T, Policy>::tree_sizes() {
+    std::vector<int> sizes;
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees; ++i) {
+        sizes.push_back(trees[i]->size());
+    }
+    return sizes;
+}
+
+template <class T, class Policy>
+std::vector<MemoryStats> WorkingSetTree<T, Policy>::tree_memory_stats() {
+    std::vector<MemoryStats> stats;
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees; ++i) {
+        stats.push_back(trees[i]->memory_stats());
+    }
+    return stats;
+}
+
+template <class T, class Policy>
+MemoryStats WorkingSetTree<T, Policy>::memory_stats() {
+    MemoryStats total;
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees; ++i) {
+        total += trees[i]->memory_stats();
+    }
+    total.bytes += sizeof(WorkingSetTree<T, Policy>) + trees.capacity() * sizeof(Level<T>*);
+    return total;
+}
+
+template <class T, class Policy>
+long long WorkingSetTree<T, Policy>::node_visits() {
+    long long visits = 0;
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees; ++i) {
+        visits += trees[i]->node_visits();
+    }
+    return visits;
+}
+
+template <class T, class Policy>
+long long WorkingSetTree<T, Policy>::shifted_keys() {
+    return shifts;
+}
+
+// repack every tree whose fill factor has dropped below min_fill (or whose
+//  pool of free nodes outgrew it) to target_fill. recency is preserved
+template <class T, class Policy>
+int WorkingSetTree<T, Policy>::compact(double min_fill, double target_fill) {
+    snapshots.before_write();
+    int compacted = 0;
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees; ++i) {
+        if (trees[i]->needs_compaction(min_fill)) {
+            trees[i]->compact(target_fill);
+            compacted++;
+        }
+    }
+    return compacted;
+}
+
+template <class T, class Policy>
+std::string WorkingSetTree<T, Policy>::to_string() {
     std::string str = "";
     int num_trees = trees.size();
     for (int i = 0; i < num_trees; ++i) {
@@ -142,8 +1063,8 @@ std::string WorkingSetTree<T>::to_string() {
     return str;
 }
 
-template <class T>
-std::string WorkingSetTree<T>::print_list() {
+template <class T, class Policy>
+std::string WorkingSetTree<T, Policy>::print_list() {
     std::string str = "";
     int num_trees = trees.size();
     for (int i = 0; i < num_trees; ++i) {
@@ -156,4 +1077,311 @@ std::string WorkingSetTree<T>::print_list() {
     return str;
 }
 
+// write every tree's keys in recency order, together with the tree
+//  parameters, to path. returns whether the snapshot was fully written
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::save(const std::string &path) {
+    static_assert(std::is_trivially_copyable<T>::value, "snapshots require trivially copyable keys");
+
+    finish_migration(); // the file records the tree heights of one policy
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open()) {
+        return false;
+    }
+
+    uint32_t version = SNAPSHOT_VERSION;
+    uint32_t key_size = sizeof(T);
+    int32_t degree = policy.min_degree();
+    int32_t factor = policy.scale_factor();
+    int32_t base_height = policy.base_height();
+    int32_t bounds = policy.boundaries();
+    int32_t base_cap = policy.base_capacity();
+    uint32_t num_trees = trees.size();
+    ofs.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    ofs.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    ofs.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+    ofs.write(reinterpret_cast<const char*>(&degree), sizeof(degree));
+    ofs.write(reinterpret_cast<const char*>(&factor), sizeof(factor));
+    ofs.write(reinterpret_cast<const char*>(&base_height), sizeof(base_height));
+    ofs.write(reinterpret_cast<const char*>(&bounds), sizeof(bounds));
+    ofs.write(reinterpret_cast<const char*>(&base_cap), sizeof(base_cap));
+    ofs.write(reinterpret_cast<const char*>(&num_trees), sizeof(num_trees));
+
+    for (uint32_t i = 0; i < num_trees; ++i) {
+        std::vector<T> keys = trees[i]->keys_by_recency();
+        int32_t max_height = policy.tree_height(i);
+        uint64_t num_keys = keys.size();
+        ofs.write(reinterpret_cast<const char*>(&max_height), sizeof(max_height));
+        ofs.write(reinterpret_cast<const char*>(&num_keys), sizeof(num_keys));
+        ofs.write(reinterpret_cast<const char*>(keys.data()), num_keys * sizeof(T));
+    }
+
+    return ofs.good();
+}
+
+// replace the contents of the working set tree with the snapshot at path.
+//  the file is mapped into memory where possible, and every tree is bulk
+//  built from the mapped keys. returns false, leaving the working set tree
+//  unchanged, if the file cannot be read or is not a valid snapshot
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::load(const std::string &path) {
+    static_assert(std::is_trivially_copyable<T>::value, "snapshots require trivially copyable keys");
+
+#ifdef WST_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    size_t length = st.st_size;
+    void *data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, length, MADV_SEQUENTIAL);
+    bool loaded = load_from_buffer(static_cast<const char*>(data), length);
+    munmap(data, length);
+    return loaded;
+#else
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    std::vector<char> buffer((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    return load_from_buffer(buffer.data(), buffer.size());
+#endif
+}
+
+template <class T, class Policy>
+bool WorkingSetTree<T, Policy>::load_from_buffer(const char *data, size_t length) {
+    const size_t header_size = sizeof(SNAPSHOT_MAGIC) + 5 * sizeof(uint32_t);
+    if (length < header_size || std::memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        return false;
+    }
+
+    uint32_t version, key_size, num_trees;
+    int32_t degree, factor, base_height = 0, bounds = HEIGHT_BOUNDARIES, base_cap = DEFAULT_BASE_CAPACITY;
+    size_t pos = sizeof(SNAPSHOT_MAGIC);
+    std::memcpy(&version, data + pos, sizeof(version)); pos += sizeof(version);
+    std::memcpy(&key_size, data + pos, sizeof(key_size)); pos += sizeof(key_size);
+    std::memcpy(&degree, data + pos, sizeof(degree)); pos += sizeof(degree);
+    std::memcpy(&factor, data + pos, sizeof(factor)); pos += sizeof(factor);
+    if (version == 2) {
+        if (length - pos < 3 * sizeof(int32_t) + sizeof(uint32_t)) {
+            return false;
+        }
+        std::memcpy(&base_height, data + pos, sizeof(base_height)); pos += sizeof(base_height);
+        std::memcpy(&bounds, data + pos, sizeof(bounds)); pos += sizeof(bounds);
+        std::memcpy(&base_cap, data + pos, sizeof(base_cap)); pos += sizeof(base_cap);
+    }
+    else if (version != 1) {
+        return false;
+    }
+    std::memcpy(&num_trees, data + pos, sizeof(num_trees)); pos += sizeof(num_trees);
+    if (key_size != sizeof(T) || degree < 2 || factor < 1 || num_trees == 0) {
+        return false;
+    }
+    if (version == 1) {
+        if (length - pos < sizeof(base_height)) {
+            return false;
+        }
+        std::memcpy(&base_height, data + pos, sizeof(base_height));
+    }
+
+    // a static policy only accepts snapshots taken with its own parameters
+    Policy loaded = policy;
+    if (base_height < 1 || base_cap < 1 || (bounds != HEIGHT_BOUNDARIES && bounds != KEY_COUNT_BOUNDARIES)
+            || !loaded.configure(degree, factor, base_height, (BoundaryMode)bounds, base_cap)) {
+        return false;
+    }
+
+    // validate the layout of every tree before touching the current trees
+    std::vector<int32_t> max_heights(num_trees);
+    std::vector<uint64_t> key_counts(num_trees);
+    std::vector<size_t> key_offsets(num_trees);
+    for (uint32_t i = 0; i < num_trees; ++i) {
+        if (length - pos < sizeof(int32_t) + sizeof(uint64_t)) {
+            return false;
+        }
+        std::memcpy(&max_heights[i], data + pos, sizeof(int32_t)); pos += sizeof(int32_t);
+        std::memcpy(&key_counts[i], data + pos, sizeof(uint64_t)); pos += sizeof(uint64_t);
+        if (max_heights[i] != loaded.tree_height(i) || key_counts[i] > (uint64_t)INT_MAX
+                || (length - pos) / sizeof(T) < key_counts[i]) {
+            return false;
+        }
+        key_offsets[i] = pos;
+        pos += key_counts[i] * sizeof(T);
+    }
+
+    snapshots.before_write();
+    policy = loaded;
+    migrating_ = false;
+    reset_tuning_window();
+    for (size_t i = 0; i < trees.size(); ++i) {
+        delete trees[i];
+    }
+    trees.clear();
+    size_ = 0;
+
+    std::vector<T> aligned_keys;
+    for (uint32_t i = 0; i < num_trees; ++i) {
+        add_tree();
+        Level<T> *tree = trees.back();
+        const char *keys = data + key_offsets[i];
+        int num_keys = (int)key_counts[i];
+        if (reinterpret_cast<uintptr_t>(keys) % alignof(T) == 0) {
+            // build straight from the mapped file
+            tree->bulk_load(reinterpret_cast<const T*>(keys), num_keys, policy.load_fill());
+        }
+        else {
+            aligned_keys.resize(num_keys);
+            std::memcpy(aligned_keys.data(), keys, num_keys * sizeof(T));
+            tree->bulk_load(aligned_keys.data(), num_keys, policy.load_fill());
+        }
+        size_ += num_keys;
+    }
+    if (weighted()) {
+        // snapshots hold no weights, and the trees are sized by the policy
+        weights.clear();
+        recount_weights();
+        rebalance();
+        evict_over_weight();
+    }
+
+    return true;
+}
+
+// the layout insertion would reach is set by recency alone: the last keys
+//  fill tree 0, the ones before them tree 1, and so on. every tree is given
+//  its share of the keys, from the most recent, and bulk loaded on its own
+//  thread, largest first. under key-count boundaries every tree ends up with
+//  the keys insertion would give it. under height boundaries the number of
+//  keys a tree holds after insertion depends on its splits, so every tree is
+//  given the keys its height holds at the node fill insertion reaches and
+//  loaded to that fill (see load_keys in wstpolicy.h): the keys and their
+//  recency order are the same, the boundaries between trees may differ, and
+//  every node has room left for the inserts that follow
+template <class T, class Policy>
+void WorkingSetTree<T, Policy>::build(const T *keys, int n, int threads) {
+    snapshots.before_write();
+    migrating_ = false;
+    reset_tuning_window();
+    for (size_t i = 0; i < trees.size(); ++i) {
+        delete trees[i];
+    }
+    trees.clear();
+
+    std::vector<T> mru_keys(keys, keys + n);
+    std::reverse(mru_keys.begin(), mru_keys.end());
+    std::vector<int> offsets;
+    int placed = 0;
+    do {
+        long long share = policy.load_keys(trees.size());
+        offsets.push_back(placed);
+        placed += (int)std::min<long long>(share, n - placed);
+        add_tree();
+    } while (placed < n);
+    offsets.push_back(n);
+    size_ = n;
+
+    int num_trees = trees.size();
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, num_trees);
+    std::atomic<int> next_tree(num_trees - 1);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; ++w) {
+        workers.push_back(std::thread([&] {
+            for (int i = next_tree--; i >= 0; i = next_tree--) {
+                trees[i]->bulk_load(mru_keys.data() + offsets[i], offsets[i + 1] - offsets[i], policy.load_fill());
+            }
+        }));
+    }
+    for (int w = 0; w < threads; ++w) {
+        workers[w].join();
+    }
+    if (weighted()) {
+        // the keys come without weights, and the trees were filled by count
+        weights.clear();
+        recount_weights();
+        rebalance();
+        evict_over_weight();
+    }
+}
+
+// collect the keys in [lo, hi] of all trees in ascending order. the sorted
+//  keys in range of every tree are merged through a min-heap holding the
+//  next key of each tree. the recency of the keys is not affected
+template <class T, class Policy>
+std::vector<T> WorkingSetTree<T, Policy>::range(T lo, T hi) {
+    typedef std::pair<T, int> key_tree;
+    std::priority_queue<key_tree, std::vector<key_tree>, std::greater<key_tree> > heap;
+    std::vector<std::vector<T> > runs(trees.size());
+    std::vector<size_t> cursors(trees.size(), 0);
+    std::vector<T> keys;
+
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees; ++i) {
+        trees[i]->append_range(lo, hi, runs[i]);
+        if (!runs[i].empty()) {
+            heap.push(key_tree(runs[i][0], i));
+        }
+    }
+
+    while (!heap.empty()) {
+        key_tree top = heap.top();
+        heap.pop();
+        keys.push_back(top.first);
+
+        int i = top.second;
+        if (++cursors[i] < runs[i].size()) {
+            heap.push(key_tree(runs[i][cursors[i]], i));
+        }
+    }
+
+    return keys;
+}
+
+// bound the number of distinct keys accessed since val without changing its
+//  recency. the bounds cost one search per tree up to the one holding val.
+//  with exact set, val's position in the linked list of its tree is walked
+//  as well, which costs O(size of that tree): subtree key counts order keys
+//  by value, not by recency, so they cannot shorten the walk. meant for
+//  debugging and tests rather than per-operation use
+template <class T, class Policy>
+RecencyRank WorkingSetTree<T, Policy>::recency_rank(T val, bool exact) {
+    RecencyRank result = {-1, 0, 0};
+    long long preceding = 0;
+    int num_trees = trees.size();
+    for (int i = 0; i < num_trees; ++i) {
+        if (trees[i]->contains(val)) {
+            result.tree_index = i;
+            if (exact) {
+                result.lower = preceding + trees[i]->recency_position(val);
+                result.upper = result.lower;
+            }
+            else {
+                result.lower = preceding;
+                result.upper = preceding + trees[i]->size() - 1;
+            }
+            return result;
+        }
+        preceding += trees[i]->size();
+    }
+    return result;
+}
+
+template <class T, class Policy>
+Snapshot<T> WorkingSetTree<T, Policy>::snapshot() {
+    return snapshots.take(trees.size(), [this](int level, const T *after, int count, std::vector<T> &out) {
+        return trees[level]->append_by_recency(after, count, out);
+    });
+}
+
 #endif // WORKINGSETTREE_H
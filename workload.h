@@ -0,0 +1,154 @@
+/*
+ * workload.h
+ *
+ * sequences of operations for replaying against a working set tree and the
+ * structures it is compared with. A workload is a set of keys to load and a
+ * list of inserts, searches and removes. It is either read from the data
+ * files main.cpp replays, or generated: searches are drawn from a popularity
+ * order of the present keys (uniformly, by a Zipf law, or from a window of
+ * hot keys sliding along the order), and a fraction of the operations
+ * replace a present key with an absent one, which takes its place in the
+ * order. Every search thus finds its key, and no key is inserted twice.
+ * Generation is deterministic for a given seed.
+*/
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <algorithm> // for std::upper_bound, std::shuffle
+#include <cmath> // for std::pow
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+enum WorkloadOpType {
+    WORKLOAD_INSERT,
+    WORKLOAD_SEARCH,
+    WORKLOAD_REMOVE
+};
+
+struct WorkloadOp {
+    WorkloadOpType type;
+    int key;
+
+    WorkloadOp(WorkloadOpType t, int k) : type(t), key(k) {}
+};
+
+struct Workload {
+    std::string name;
+    std::vector<int> initial_keys; // loaded before the operations, in this order
+    std::vector<WorkloadOp> ops;
+};
+
+enum WorkloadDistribution {
+    UNIFORM_ACCESS,
+    ZIPF_ACCESS,
+    SLIDING_WINDOW_ACCESS // uniform over window_keys keys, moving one key every window_step operations
+};
+
+struct WorkloadOptions {
+    int initial_keys;
+    int operations;
+    double update_fraction; // operations that remove a key and insert another
+    double zipf_skew;
+    int window_keys;
+    int window_step;
+    unsigned seed;
+
+    WorkloadOptions() : initial_keys(100000), operations(1000000), update_fraction(0.05), zipf_skew(0.99),
+        window_keys(1000), window_step(10), seed(1) {}
+};
+
+inline std::string workload_distribution_name(WorkloadDistribution distribution) {
+    switch (distribution) {
+    case UNIFORM_ACCESS:
+        return "uniform";
+    case ZIPF_ACCESS:
+        return "zipf";
+    default:
+        return "sliding window";
+    }
+}
+
+// keys are drawn from [0, 2 * initial_keys). the loaded keys, shuffled, give
+//  the first popularity order; the other keys are inserted by updates
+inline Workload generate_workload(WorkloadDistribution distribution, const WorkloadOptions &options) {
+    Workload workload;
+    workload.name = workload_distribution_name(distribution);
+    int n = std::max(1, options.initial_keys);
+    std::mt19937 rng(options.seed);
+
+    std::vector<int> universe(2 * n);
+    for (int i = 0; i < 2 * n; ++i) {
+        universe[i] = i;
+    }
+    std::shuffle(universe.begin(), universe.end(), rng);
+    workload.initial_keys.assign(universe.begin(), universe.begin() + n);
+    std::vector<int> popularity(universe.begin(), universe.begin() + n); // the present keys
+    std::vector<int> absent(universe.begin() + n, universe.end());
+
+    std::vector<double> zipf_cdf;
+    if (distribution == ZIPF_ACCESS) {
+        zipf_cdf.resize(n);
+        double sum = 0;
+        for (int r = 0; r < n; ++r) {
+            sum += 1.0 / std::pow(r + 1.0, options.zipf_skew);
+            zipf_cdf[r] = sum;
+        }
+        for (int r = 0; r < n; ++r) {
+            zipf_cdf[r] /= sum;
+        }
+    }
+
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    int window = std::max(1, std::min(n, options.window_keys));
+    workload.ops.reserve(options.operations);
+    for (int i = 0; i < options.operations; ++i) {
+        if (unit(rng) < options.update_fraction) {
+            // swap a random present key for a random absent one
+            int p = rng() % n;
+            int a = rng() % n;
+            workload.ops.push_back(WorkloadOp(WORKLOAD_REMOVE, popularity[p]));
+            workload.ops.push_back(WorkloadOp(WORKLOAD_INSERT, absent[a]));
+            std::swap(popularity[p], absent[a]);
+            continue;
+        }
+        int rank;
+        if (distribution == ZIPF_ACCESS) {
+            rank = std::upper_bound(zipf_cdf.begin(), zipf_cdf.end() - 1, unit(rng)) - zipf_cdf.begin();
+        }
+        else if (distribution == SLIDING_WINDOW_ACCESS) {
+            rank = (i / std::max(1, options.window_step) + rng() % window) % n;
+        }
+        else {
+            rank = rng() % n;
+        }
+        workload.ops.push_back(WorkloadOp(WORKLOAD_SEARCH, popularity[rank]));
+    }
+    return workload;
+}
+
+// the keys of tree_file loaded, then a search for every key of search_file and
+//  a remove for every key of delete_file. files that cannot be read add nothing
+inline Workload file_workload(const std::string &tree_file, const std::string &search_file,
+                              const std::string &delete_file) {
+    Workload workload;
+    workload.name = tree_file;
+    std::string line;
+    std::ifstream tree_ifs(tree_file);
+    while (getline(tree_ifs, line)) {
+        workload.initial_keys.push_back(std::stoi(line));
+    }
+    std::ifstream search_ifs(search_file);
+    while (getline(search_ifs, line)) {
+        workload.ops.push_back(WorkloadOp(WORKLOAD_SEARCH, std::stoi(line)));
+    }
+    std::ifstream delete_ifs(delete_file);
+    while (getline(delete_ifs, line)) {
+        workload.ops.push_back(WorkloadOp(WORKLOAD_REMOVE, std::stoi(line)));
+    }
+    return workload;
+}
+
+#endif // WORKLOAD_H
@@ -1,9 +1,12 @@
 QT += core
 QT -= gui
 
-CONFIG += c++11
+CONFIG += c++11 thread
 
 TARGET = wst
+# spans of tree operations, written to data/wst_trace.json (see trace.h)
+#DEFINES += WST_TRACE
+
 CONFIG += console
 CONFIG -= app_bundle
 
@@ -14,5 +17,25 @@ SOURCES += main.cpp
 HEADERS += \
     element.h \
     node.h \
+    autotune.h \
+    baselines.h \
+    batchops.h \
+    bplustree.h \
     btree.h \
-    workingsettree.h
+    btreeiterator.h \
+    flattree.h \
+    frontcache.h \
+    frozentree.h \
+    level.h \
+    memorystats.h \
+    mrcsimulator.h \
+    packedtree.h \
+    pagedtree.h \
+    perfcounters.h \
+    replay.h \
+    snapshot.h \
+    trace.h \
+    workingsetbound.h \
+    workingsettree.h \
+    workload.h \
+    wstpolicy.h
@@ -0,0 +1,223 @@
+/*
+ * wstpolicy.h
+ *
+ * policies that configure the shape of a working set tree: the minimum degree
+ * of its b-trees, the factor by which the trees grow from one level to the
+ * next, and how large the smallest tree is. StaticPolicy fixes all of them at
+ * compile time so that the per-tree capacities are constant expressions and
+ * the shifting loops can be specialized. DynamicPolicy keeps them as runtime
+ * values, for experimenting with different configurations without recompiling.
+ *
+ * A tree overflows (and shifts keys back) according to one of two boundaries:
+ *   HEIGHT_BOUNDARIES     its height exceeds max_height(level) = base_height *
+ *                         scale_factor^level. the number of keys this allows
+ *                         varies by a factor of about 2*min_degree
+ *   KEY_COUNT_BOUNDARIES  its number of keys exceeds capacity(level) =
+ *                         base_capacity^(scale_factor^level), e.g. 2^(2^i)
+ *
+ * The first flat_levels() levels are stored as FlatTrees, contiguous arrays in
+ * recency order, and the remaining levels as BTrees (see level.h).
+ *
+ * Both policies expose the same interface:
+ *   min_degree(), scale_factor(), base_height(), boundaries(), base_capacity(),
+ *   flat_levels()
+ *   max_height(level)  max height of the b-tree at index level
+ *   max_keys(level)    the most keys a b-tree of that max height can hold
+ *   capacity(level)    the most keys of the tree at index level under key
+ *                      count boundaries
+ *   tree_height(level) the height the tree at index level can grow to,
+ *                      used to size its b-tree
+ *   load_keys(level)   the keys the tree at index level is loaded with when
+ *                      it is built in bulk, see load_fill()
+ *   load_fill()        the node fill it is loaded to
+ *   configure(degree, factor, base, boundaries, base_capacity)  adopt the
+ *                      given parameters if the policy can, returning whether
+ *                      it now matches them
+*/
+
+#ifndef WSTPOLICY_H
+#define WSTPOLICY_H
+
+#include <climits> // for INT_MAX, LLONG_MAX
+#include "node.h"
+
+enum BoundaryMode { HEIGHT_BOUNDARIES, KEY_COUNT_BOUNDARIES };
+
+const int DEFAULT_SCALE_FACTOR = 2;
+const int DEFAULT_BASE_HEIGHT = 2; // the max height of the smallest b-tree
+const int DEFAULT_BASE_CAPACITY = 2; // the most keys of the smallest tree under key count boundaries
+const int DEFAULT_FLAT_LEVELS = 0; // number of front levels stored as flat arrays
+
+// base * factor^level, saturated at INT_MAX
+constexpr int scaled_height(int base, int factor, int level) {
+    return level == 0 ? base : scaled_height(base > INT_MAX / factor ? INT_MAX : base * factor, factor, level - 1);
+}
+
+// (2*degree)^height - 1, saturated at LLONG_MAX
+constexpr long long max_tree_keys(int degree, int height, long long capacity = 1) {
+    return height == 0 ? capacity - 1
+        : capacity > LLONG_MAX / (2 * degree) ? LLONG_MAX
+        : max_tree_keys(degree, height - 1, capacity * (2 * degree));
+}
+
+// base^exponent, saturated at LLONG_MAX
+constexpr long long saturating_pow(long long base, int exponent, long long result = 1) {
+    return exponent == 0 ? result
+        : base != 0 && result > LLONG_MAX / base ? LLONG_MAX
+        : saturating_pow(base, exponent - 1, result * base);
+}
+
+// base^(factor^level), saturated at LLONG_MAX
+constexpr long long scaled_capacity(long long base, int factor, int level) {
+    return level == 0 ? base : scaled_capacity(saturating_pow(base, factor), factor, level - 1);
+}
+
+// base * factor^level, saturated at LLONG_MAX: the most weight of the tree at
+//  level under weight boundaries (see WorkingSetTree::set_weight_boundaries)
+constexpr long long scaled_weight(long long base, int factor, int level) {
+    return level == 0 ? base : scaled_weight(base > LLONG_MAX / factor ? LLONG_MAX : base * factor, factor, level - 1);
+}
+
+// the fraction of its key slots a node of a b-tree holds on average once
+//  keys were inserted in random order (about ln 2). under height boundaries
+//  trees built in bulk are loaded to this fill, so they hold the keys
+//  insertion would give them and every node keeps room for more
+constexpr double INSERTION_FILL = 0.69;
+
+constexpr int clamped(int value, int low, int high) {
+    return value < low ? low : value > high ? high : value;
+}
+
+// keys per node of a b-tree filled to fill, rounded as BTree::bulk_load does
+constexpr int filled_node_keys(int degree, double fill) {
+    return clamped((int)(fill * (2 * degree - 1) + 0.5), degree > 2 ? degree - 1 : 1, 2 * degree - 1);
+}
+
+// (keys_per_node + 1)^height - 1: the keys of a b-tree of the given height
+//  whose nodes hold keys_per_node keys each, saturated at LLONG_MAX
+constexpr long long filled_tree_keys(int keys_per_node, int height) {
+    return saturating_pow(keys_per_node + 1, height) == LLONG_MAX ? LLONG_MAX
+        : saturating_pow(keys_per_node + 1, height) - 1;
+}
+
+// the greatest height of a b-tree holding keys keys, reached when every node
+//  is minimally full: such a tree of height h holds 2*degree^(h-1) - 1 keys
+constexpr int min_fill_height(int degree, long long keys, int height = 1, long long capacity = 1) {
+    return 2 * capacity - 1 >= keys || capacity > LLONG_MAX / (2 * degree) ? height
+        : min_fill_height(degree, keys, height + 1, capacity * degree);
+}
+
+template <int MinDegree, int ScaleFactor = DEFAULT_SCALE_FACTOR, int BaseHeight = DEFAULT_BASE_HEIGHT,
+          BoundaryMode Boundaries = HEIGHT_BOUNDARIES, int BaseCapacity = DEFAULT_BASE_CAPACITY,
+          int FlatLevels = DEFAULT_FLAT_LEVELS>
+struct StaticPolicy {
+    static_assert(MinDegree >= 2, "the minimum degree of a b-tree is at least 2");
+    static_assert(ScaleFactor >= 1 && BaseHeight >= 1 && BaseCapacity >= 1, "tree sizes must be positive and non-decreasing");
+
+    static constexpr int min_degree() {
+        return MinDegree;
+    }
+    static constexpr int scale_factor() {
+        return ScaleFactor;
+    }
+    static constexpr int base_height() {
+        return BaseHeight;
+    }
+    static constexpr BoundaryMode boundaries() {
+        return Boundaries;
+    }
+    static constexpr int base_capacity() {
+        return BaseCapacity;
+    }
+    static constexpr int flat_levels() {
+        return FlatLevels;
+    }
+    static constexpr int max_height(int level) {
+        return scaled_height(BaseHeight, ScaleFactor, level);
+    }
+    static constexpr long long max_keys(int level) {
+        return max_tree_keys(MinDegree, max_height(level));
+    }
+    static constexpr long long capacity(int level) {
+        return scaled_capacity(BaseCapacity, ScaleFactor, level);
+    }
+    static constexpr int tree_height(int level) {
+        return Boundaries == HEIGHT_BOUNDARIES ? max_height(level) : min_fill_height(MinDegree, capacity(level));
+    }
+    static constexpr long long load_keys(int level) {
+        return Boundaries == KEY_COUNT_BOUNDARIES ? capacity(level)
+            : filled_tree_keys(filled_node_keys(MinDegree, load_fill()), max_height(level));
+    }
+    static constexpr double load_fill() {
+        return Boundaries == HEIGHT_BOUNDARIES ? INSERTION_FILL : 1.0;
+    }
+    static bool configure(int degree, int factor, int base, BoundaryMode bounds, int base_cap) {
+        return degree == MinDegree && factor == ScaleFactor && base == BaseHeight
+            && bounds == Boundaries && base_cap == BaseCapacity;
+    }
+};
+
+class DynamicPolicy {
+public:
+    DynamicPolicy(int degree = DEFAULT_MIN_DEGREE, int factor = DEFAULT_SCALE_FACTOR, int base = DEFAULT_BASE_HEIGHT,
+                  BoundaryMode bounds = HEIGHT_BOUNDARIES, int base_cap = DEFAULT_BASE_CAPACITY,
+                  int flat = DEFAULT_FLAT_LEVELS)
+        : degree_(degree), factor_(factor), base_(base), bounds_(bounds), base_cap_(base_cap), flat_(flat) {}
+
+    int min_degree() const {
+        return degree_;
+    }
+    int scale_factor() const {
+        return factor_;
+    }
+    int base_height() const {
+        return base_;
+    }
+    BoundaryMode boundaries() const {
+        return bounds_;
+    }
+    int base_capacity() const {
+        return base_cap_;
+    }
+    int flat_levels() const {
+        return flat_;
+    }
+    int max_height(int level) const {
+        return scaled_height(base_, factor_, level);
+    }
+    long long max_keys(int level) const {
+        return max_tree_keys(degree_, max_height(level));
+    }
+    long long capacity(int level) const {
+        return scaled_capacity(base_cap_, factor_, level);
+    }
+    int tree_height(int level) const {
+        return bounds_ == HEIGHT_BOUNDARIES ? max_height(level) : min_fill_height(degree_, capacity(level));
+    }
+    long long load_keys(int level) const {
+        return bounds_ == KEY_COUNT_BOUNDARIES ? capacity(level)
+            : filled_tree_keys(filled_node_keys(degree_, load_fill()), max_height(level));
+    }
+    double load_fill() const {
+        return bounds_ == HEIGHT_BOUNDARIES ? INSERTION_FILL : 1.0;
+    }
+    bool configure(int degree, int factor, int base, BoundaryMode bounds, int base_cap) {
+        degree_ = degree;
+        factor_ = factor;
+        base_ = base;
+        bounds_ = bounds;
+        base_cap_ = base_cap;
+        return true;
+    }
+private:
+    int degree_;
+    int factor_;
+    int base_;
+    BoundaryMode bounds_;
+    int base_cap_;
+    int flat_;
+};
+
+typedef StaticPolicy<DEFAULT_MIN_DEGREE> DefaultStaticPolicy;
+
+#endif // WSTPOLICY_H